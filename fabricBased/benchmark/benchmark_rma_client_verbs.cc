@@ -14,25 +14,24 @@ int main(int argc, char **argv) {
     }
     int port = 8080;
     auto *c2 = new cse498::Connection(addr.c_str(), false, port, cse498::Verbs);
-    c2->connect();
+    std::vector<cse498::mr_desc> remote;
+    if (!c2->connect({}, remote) || remote.empty()) {
+        std::cerr << "Server did not give a region" << std::endl;
+        return 1;
+    }
 
     cse498::unique_buf buf;
 
     uint64_t key = 1;
     c2->register_mr(buf, FI_SEND | FI_RECV | FI_READ | FI_WRITE | FI_REMOTE_READ, key);
 
-    std::cerr << "Recv" << std::endl;
-
     std::cerr << "Using buffer " << (void *) buf.get() << std::endl;
-    c2->recv(buf, 4096);
 
-    uint64_t remoteKey = *((uint64_t *) buf.get());
+    uint64_t remoteKey = remote[0].key;
 
     std::cerr << "Remote key is " << remoteKey << std::endl;
 
-    c2->recv(buf, 4096);
-
-    uint64_t remoteAddr = *((uint64_t *) buf.get());
+    uint64_t remoteAddr = remote[0].addr;
 
     std::cerr << "Remote addr is " << (void *) remoteAddr << std::endl;
 
@@ -20,7 +20,8 @@ int main(int argc, char **argv) {
 
     auto *c1 = new cse498::Connection(addr, true, 8080, cse498::Verbs);
 
-    c1->connect();
+    // Registering before connecting needs the domain up front
+    c1->share_resources();
 
     *((uint64_t *) remoteAccess.get()) = ~0;
     uint64_t key = 1;
@@ -28,18 +29,9 @@ int main(int argc, char **argv) {
     uint64_t key2 = 2;
     c1->register_mr(buf, FI_SEND | FI_RECV | FI_READ | FI_WRITE, key2);
 
-    std::cerr << "Send\n";
-
-    *((uint64_t *) buf.get()) = key;
-
-    c1->send(buf, sizeof(uint64_t));
-
-    std::cerr << "Send\n";
-
-    *((uint64_t *) buf.get()) = (uint64_t) remoteAccess.get();
-    //*((uint64_t *) buf.get()) = (uint64_t) 0;
-
-    c1->send(buf, sizeof(uint64_t));
+    // The client learns where remoteAccess lives from the handshake
+    std::vector<cse498::mr_desc> remote;
+    c1->connect({c1->describe(remoteAccess)}, remote);
 
     std::cerr << "Recv\n";
 
@@ -21,19 +21,21 @@ int main(int argc, char** argv){
     uint64_t key = 1;
     c2->register_mr(buf, FI_READ | FI_WRITE | FI_REMOTE_READ | FI_REMOTE_WRITE, key);
 
-    std::cerr << "Recv" << std::endl;
-
-    c2->recv(buf, 1);
+    // The server's region comes with the handshake; this side exposes nothing
+    std::vector<cse498::mr_desc> remote;
+    if (!c2->connect({}, remote) || remote.empty()) {
+        std::cerr << "Unable to connect" << std::endl;
+        delete c2;
+        return 1;
+    }
 
     *((uint64_t *) buf.get()) = 10;
 
-    c2->read(buf, sizeof(uint64_t), 0, 1);
-
-    while ((*(uint64_t *) buf.get()) != ~0);
-
-    std::cerr << "Read: " << *(uint64_t *) buf.get() << std::endl;
+    std::cerr << "Write" << std::endl;
 
-    std::cerr << "Send" << std::endl;
+    // The server learns the write landed from the notice; no doorbell message or polling
+    c2->write_notify(buf, sizeof(uint64_t), remote[0].addr, remote[0].key, 1);
 
-    c2->send(buf, 1);
+    delete c2;
+    return 0;
 }
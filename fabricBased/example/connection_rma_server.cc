@@ -9,7 +9,7 @@ int LOG_LEVEL = DEBUG;
 
 int main(int argc, char **argv) {
 
-    cse498::unique_buf remoteAccess, buf;
+    cse498::unique_buf remoteAccess;
 
     const char *addr = "127.0.0.1";
 
@@ -19,17 +19,27 @@ int main(int argc, char **argv) {
 
     auto *c1 = new cse498::Connection(addr, true);
 
+    // Registering before connecting needs the domain up front
+    c1->share_resources();
+
     *((uint64_t *) remoteAccess.get()) = ~0;
     uint64_t key = 1;
     c1->register_mr(remoteAccess, FI_WRITE | FI_REMOTE_WRITE | FI_READ | FI_REMOTE_READ, key);
 
-    std::cerr << "Send\n";
+    // The client learns where remoteAccess lives from the handshake
+    std::vector<cse498::mr_desc> remote;
+    if (!c1->connect({c1->describe(remoteAccess)}, remote)) {
+        std::cerr << "Unable to connect\n";
+        delete c1;
+        return 1;
+    }
 
-    c1->send(buf, 1);
+    std::cerr << "Wait for write\n";
 
-    std::cerr << "Recv\n";
+    auto n = c1->recv_notice();
 
-    c1->recv(buf, 1);
+    std::cerr << "Wrote: " << *(uint64_t *) remoteAccess.get() << " notice " << n.data << std::endl;
 
+    delete c1;
     return 0;
 }
@@ -0,0 +1,247 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_BUF_POOL_HH
+#define NETWORKLAYER_BUF_POOL_HH
+
+#include "unique_buf.hh"
+#include "shared_buf.hh"
+#include "mem_policy.hh"
+#include "Macros.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace cse498 {
+
+    /**
+     * Size class of a BufferPool
+     */
+    struct pool_class {
+        /**
+         * Size of each buffer in the class
+         */
+        size_t size;
+        /**
+         * Number of buffers in the class
+         */
+        size_t count;
+    };
+
+    /**
+     * Size classes used when a BufferPool is created without any
+     */
+    const std::vector<pool_class> DEFAULT_POOL_CLASSES = {{256,     256},
+                                                          {4096,    256},
+                                                          {1 << 16, 32}};
+
+    /**
+     * Pool of buffers carved out of one arena. Register the arena once on a connection's domain with
+     * register_on and every buffer handed out afterwards is already registered: its key, descriptor and
+     * offset into the arena are filled in. Buffers can be used on any connection with that domain.
+     * Destroyed buffers go back on a lock-free free list for their size class.
+     *
+     * The pool must outlive every buffer it hands out.
+     */
+    class BufferPool {
+    public:
+        /**
+         * Allocate the arena and split it into slabs, one per size class
+         * @param classes size classes; each size is rounded up to a multiple of 64 bytes
+         * @param policy how the arena is allocated, e.g. on hugepages next to the NIC
+         */
+        explicit BufferPool(std::vector<pool_class> classes = DEFAULT_POOL_CLASSES, const mem_policy &policy = {})
+                : arena_(allocate(arenaSize(classes), policy)) {
+            std::sort(classes.begin(), classes.end(),
+                      [](const pool_class &a, const pool_class &b) { return a.size < b.size; });
+            size_t offset = 0;
+            for (auto &c : classes) {
+                assert(c.count > 0 && c.count < UINT32_MAX);
+                slabs.emplace_back(new slab(arena_.get() + offset, roundUp(c.size), c.count));
+                offset += roundUp(c.size) * c.count;
+            }
+        }
+
+        BufferPool(const BufferPool &) = delete;
+
+        BufferPool &operator=(const BufferPool &) = delete;
+
+        /**
+         * Registers the arena on the domain of conn under a key of its own (see
+         * Connection::register_mr_unique). Must be called once before handing out buffers.
+         * @param conn connection whose domain the buffers will be used on
+         * @param access access flags for the arena
+         * @return key of the arena
+         */
+        template<typename conn_t>
+        inline uint64_t register_on(conn_t &conn, uint64_t access) {
+            assert(!domain_ && conn.get_domain());
+            uint64_t key = conn.register_mr_unique(arena_, access);
+            domain_ = conn.get_domain();
+            return key;
+        }
+
+        /**
+         * Domain the arena is registered on
+         * @return domain, null before register_on
+         */
+        [[nodiscard]] inline fid_domain *domain() const {
+            return domain_;
+        }
+
+        /**
+         * Takes a registered buffer of at least size bytes from the smallest class that has one free.
+         * @param size bytes needed
+         * @return buffer, or an empty one (get() returns nullptr) if every fitting class is empty or
+         * the arena is not registered yet
+         */
+        inline unique_buf get_unique(size_t size) {
+            char *mem = nullptr;
+            slab *s = domain_ ? take(size, mem) : nullptr;
+            if (!s) {
+                DO_LOG(DEBUG) << "No pooled buffer for " << size << " bytes";
+                return unique_buf(nullptr, 0, this, &BufferPool::give_back);
+            }
+            unique_buf b(mem, s->size, this, &BufferPool::give_back);
+            label(b, mem);
+            return b;
+        }
+
+        /**
+         * Like get_unique, but with the semantics of shared_buf
+         * @param size bytes needed
+         * @return buffer
+         */
+        inline shared_buf get_shared(size_t size) {
+            char *mem = nullptr;
+            slab *s = domain_ ? take(size, mem) : nullptr;
+            if (!s) {
+                DO_LOG(DEBUG) << "No pooled buffer for " << size << " bytes";
+                return shared_buf(nullptr, 0, this, &BufferPool::give_back);
+            }
+            shared_buf b(mem, s->size, this, &BufferPool::give_back);
+            label(b, mem);
+            return b;
+        }
+
+        /**
+         * Number of free buffers across all classes
+         * @return count
+         */
+        [[nodiscard]] inline size_t available() const {
+            size_t n = 0;
+            for (auto &s : slabs) {
+                n += s->free.load(std::memory_order_relaxed);
+            }
+            return n;
+        }
+
+    private:
+        static const size_t ALIGN = 64;
+        static const uint32_t NIL = UINT32_MAX;
+
+        // Treiber stack of block indices; the head carries a tag so a pop cannot be fooled by ABA
+        struct slab {
+            slab(char *base, size_t size, size_t count) : base(base), size(size), count(count), next(count),
+                                                          free(count) {
+                for (size_t i = 0; i < count; i++) {
+                    next[i].store(i + 1 < count ? (uint32_t) (i + 1) : NIL, std::memory_order_relaxed);
+                }
+                head.store(pack(0, 0), std::memory_order_relaxed);
+            }
+
+            static inline uint64_t pack(uint32_t idx, uint32_t tag) {
+                return ((uint64_t) tag << 32) | idx;
+            }
+
+            inline bool pop(uint32_t &idx) {
+                uint64_t h = head.load(std::memory_order_acquire);
+                while (true) {
+                    idx = (uint32_t) h;
+                    if (idx == NIL) {
+                        return false;
+                    }
+                    uint64_t n = pack(next[idx].load(std::memory_order_relaxed), (uint32_t) (h >> 32) + 1);
+                    if (head.compare_exchange_weak(h, n, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                        free.fetch_sub(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+            }
+
+            inline void push(uint32_t idx) {
+                uint64_t h = head.load(std::memory_order_relaxed);
+                while (true) {
+                    next[idx].store((uint32_t) h, std::memory_order_relaxed);
+                    uint64_t n = pack(idx, (uint32_t) (h >> 32) + 1);
+                    if (head.compare_exchange_weak(h, n, std::memory_order_release, std::memory_order_relaxed)) {
+                        free.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                }
+            }
+
+            char *const base;
+            const size_t size;
+            const size_t count;
+            std::vector<std::atomic<uint32_t>> next;
+            std::atomic<uint64_t> head;
+            std::atomic<size_t> free;
+        };
+
+        static inline size_t roundUp(size_t s) {
+            return (s + ALIGN - 1) / ALIGN * ALIGN;
+        }
+
+        static inline size_t arenaSize(const std::vector<pool_class> &classes) {
+            size_t total = 0;
+            for (auto &c : classes) {
+                total += roundUp(c.size) * c.count;
+            }
+            return total;
+        }
+
+        static void give_back(void *owner, char *buf) {
+            if (!buf) {
+                return;
+            }
+            auto *self = static_cast<BufferPool *>(owner);
+            for (auto &s : self->slabs) {
+                if (buf >= s->base && buf < s->base + s->size * s->count) {
+                    s->push((uint32_t) ((buf - s->base) / s->size));
+                    return;
+                }
+            }
+            assert(false);
+        }
+
+        inline slab *take(size_t size, char *&mem) {
+            // Slabs are sorted by size, so the first fitting one with a free block is the smallest
+            for (auto &s : slabs) {
+                uint32_t idx;
+                if (s->size >= size && s->pop(idx)) {
+                    mem = s->base + idx * s->size;
+                    return s.get();
+                }
+            }
+            return nullptr;
+        }
+
+        template<typename buf_t>
+        inline void label(buf_t &b, char *mem) {
+            b.registerMemoryCallback(arena_.key(), arena_.getDesc(), arena_.regOffset() + (mem - arena_.get()));
+        }
+
+        unique_buf arena_;
+        fid_domain *domain_ = nullptr;
+        std::vector<std::unique_ptr<slab>> slabs;
+    };
+
+}
+
+#endif //NETWORKLAYER_BUF_POOL_HH
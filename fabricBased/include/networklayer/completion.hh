@@ -0,0 +1,559 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_COMPLETION_HH
+#define NETWORKLAYER_COMPLETION_HH
+
+#include "Macros.hh"
+
+#include <rdma/fabric.h>
+#include <rdma/fi_eq.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+namespace cse498 {
+
+    /**
+     * Context passed to libfabric with an operation. When the completion for the operation is read
+     * the entry is handed back to on_complete (or on_error if the operation failed).
+     *
+     * The provider may use fi_ctx as scratch space while the operation is in flight, so an op_context
+     * must stay at the same address until its completion is read.
+     */
+    struct op_context {
+        /**
+         * Reserved for the provider
+         */
+        fi_context2 fi_ctx = {};
+
+        /**
+         * Called when the operation completes successfully
+         */
+        void (*on_complete)(op_context *ctx, const fi_cq_tagged_entry &entry) = nullptr;
+
+        /**
+         * Called when the operation completes with an error
+         */
+        void (*on_error)(op_context *ctx, const fi_cq_err_entry &entry) = nullptr;
+    };
+
+    /**
+     * Completion token for a single asynchronous operation. Returned by the async_* calls on Connection
+     * and remains valid after the operation finishes.
+     */
+    class Completion : public op_context {
+    public:
+        /**
+         * Creates a token for an operation that has not been posted yet.
+         */
+        Completion() {
+            on_complete = &Completion::complete_cb;
+            on_error = &Completion::error_cb;
+        }
+
+        Completion(const Completion &) = delete;
+
+        Completion &operator=(const Completion &) = delete;
+
+        /**
+         * Returns if the operation has finished (successfully or not)
+         * @return true if finished
+         */
+        [[nodiscard]] inline bool done() const {
+            return done_.load(std::memory_order_acquire);
+        }
+
+        /**
+         * Returns if the operation finished successfully
+         * @return true on success
+         */
+        [[nodiscard]] inline bool ok() const {
+            return done() && err == 0;
+        }
+
+        /**
+         * Error reported for the operation
+         * @return 0 or a positive fi_errno value
+         */
+        [[nodiscard]] inline int error() const {
+            return err;
+        }
+
+        /**
+         * Number of bytes reported by the completion
+         * @return length
+         */
+        [[nodiscard]] inline size_t length() const {
+            return len;
+        }
+
+        /**
+         * Keeps the token alive until the provider hands it back. Called right before posting.
+         * @param self shared pointer to this token
+         */
+        inline void posted(const std::shared_ptr<Completion> &self) {
+            assert(self.get() == this);
+            keepalive = self;
+        }
+
+        /**
+         * Marks the token as failed and drops the reference taken by posted. Used when posting fails
+         * since no completion will ever arrive.
+         * @param e positive fi_errno value
+         */
+        inline void cancel(int e) {
+            err = e;
+            done_.store(true, std::memory_order_release);
+            keepalive.reset();
+        }
+
+    private:
+        static void complete_cb(op_context *ctx, const fi_cq_tagged_entry &entry) {
+            auto *self = static_cast<Completion *>(ctx);
+            auto keep = std::move(self->keepalive);
+            self->len = entry.len;
+            self->done_.store(true, std::memory_order_release);
+        }
+
+        static void error_cb(op_context *ctx, const fi_cq_err_entry &entry) {
+            auto *self = static_cast<Completion *>(ctx);
+            auto keep = std::move(self->keepalive);
+            self->err = entry.err ? entry.err : FI_EINVAL;
+            self->len = entry.len;
+            self->done_.store(true, std::memory_order_release);
+        }
+
+        std::atomic_bool done_{false};
+        int err = 0;
+        size_t len = 0;
+        std::shared_ptr<Completion> keepalive;
+    };
+
+    /**
+     * Shared handle to a completion token
+     */
+    using completion_t = std::shared_ptr<Completion>;
+
+    /**
+     * Context shared by every operation of one kind that a connection posts without its own token.
+     * Counts their completions, so a connection can wait for its own operations even when the
+     * completion queue is shared with other connections.
+     *
+     * Only valid for endpoints opened without the FI_CONTEXT and FI_CONTEXT2 modes, since the provider
+     * must not use fi_ctx as scratch space while several operations share it.
+     */
+    class CompletionCounter : public op_context {
+    public:
+        /**
+         * Creates a counter with nothing retired
+         */
+        CompletionCounter() {
+            on_complete = &CompletionCounter::complete_cb;
+            on_error = &CompletionCounter::error_cb;
+        }
+
+        CompletionCounter(const CompletionCounter &) = delete;
+
+        CompletionCounter &operator=(const CompletionCounter &) = delete;
+
+        /**
+         * Number of retired operations that have not been taken yet
+         * @return count
+         */
+        [[nodiscard]] inline uint64_t ready() const {
+            return count.load(std::memory_order_acquire);
+        }
+
+        /**
+         * Takes one retired operation. Failed operations are handed out first.
+         * @return 0 if it succeeded, or a negative fi_errno value
+         */
+        inline int take() {
+            assert(ready() > 0);
+            count.fetch_sub(1, std::memory_order_relaxed);
+            if (failed.load(std::memory_order_acquire) > 0) {
+                failed.fetch_sub(1, std::memory_order_relaxed);
+                return -err;
+            }
+            return 0;
+        }
+
+    private:
+        // Completions may be retired by another thread than the one taking them
+        static void complete_cb(op_context *ctx, const fi_cq_tagged_entry &) {
+            static_cast<CompletionCounter *>(ctx)->count.fetch_add(1, std::memory_order_release);
+        }
+
+        static void error_cb(op_context *ctx, const fi_cq_err_entry &entry) {
+            auto *self = static_cast<CompletionCounter *>(ctx);
+            self->err = entry.err ? entry.err : FI_EINVAL;
+            self->failed.fetch_add(1, std::memory_order_release);
+            self->count.fetch_add(1, std::memory_order_release);
+        }
+
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> failed{0};
+        int err = 0;
+    };
+
+    /**
+     * Default number of entries drained by a single fi_cq_read
+     */
+    const size_t DEFAULT_CQ_BATCH = 32;
+
+    /**
+     * How long a wait spins on its completion queue before sleeping on the queue's wait object.
+     * Spinning gives the lowest latency; sleeping stops an idle waiter from burning a core.
+     */
+    struct wait_policy {
+        /**
+         * Sleep once spin has run out. Ignored for completion queues without a wait object.
+         */
+        bool block = false;
+
+        /**
+         * How long to spin before sleeping
+         */
+        std::chrono::microseconds spin{0};
+
+        /**
+         * Never sleep
+         * @return policy
+         */
+        static inline wait_policy spinning() {
+            return {};
+        }
+
+        /**
+         * Spin for spin, then sleep until a completion arrives
+         * @param spin time to spin first
+         * @return policy
+         */
+        static inline wait_policy hybrid(std::chrono::microseconds spin) {
+            return {true, spin};
+        }
+    };
+
+    /**
+     * Completion engine around a completion queue. Each poll drains up to a batch of entries with one
+     * fi_cq_read and dispatches them: entries carrying an op_context go to that context, other entries
+     * go to the first handler registered for flags they contain. Entries nobody handles are banked so
+     * that wait_for_completion can hand them out one at a time.
+     *
+     * Several threads may poll the same engine: one of them drains the queue at a time and hands
+     * every entry to its context, while the others find nothing to read and keep checking their own
+     * contexts. Handlers always run on the thread that is draining.
+     *
+     * Does not own the completion queue.
+     */
+    class CompletionQueue {
+    public:
+        /**
+         * Handler for entries posted without a context
+         */
+        using handler_t = std::function<void(const fi_cq_tagged_entry &)>;
+
+        /**
+         * Handler for error entries posted without a context
+         */
+        using error_handler_t = std::function<void(const fi_cq_err_entry &)>;
+
+        /**
+         * Creates a null engine
+         */
+        CompletionQueue() = default;
+
+        /**
+         * Wraps a completion queue
+         * @param cq completion queue
+         * @param format format the completion queue was opened with
+         * @param batch maximum entries read per fi_cq_read
+         * @param waitable true if the completion queue was opened with a wait object
+         */
+        CompletionQueue(fid_cq *cq, fi_cq_format format, size_t batch = DEFAULT_CQ_BATCH,
+                        bool waitable = false) : cq(cq),
+                                                 stride(entrySize(format)),
+                                                 batch(batch),
+                                                 entries(stride * batch),
+                                                 waitable(waitable) {
+            assert(batch > 0);
+        }
+
+        CompletionQueue(CompletionQueue &&other) noexcept {
+            *this = std::move(other);
+        }
+
+        CompletionQueue &operator=(CompletionQueue &&other) noexcept {
+            cq = other.cq;
+            stride = other.stride;
+            batch = other.batch;
+            entries = std::move(other.entries);
+            waitable = other.waitable;
+            policy = other.policy;
+            handlers = std::move(other.handlers);
+            err_handler = std::move(other.err_handler);
+            unclaimed = other.unclaimed;
+            sources = std::move(other.sources);
+            current_source = other.current_source;
+            return *this;
+        }
+
+        /**
+         * Registers a handler for entries posted without a context whose flags contain all of flags.
+         * A handler registered again for the same flags replaces the old one. Passing 0 matches everything.
+         * @param flags completion flags (e.g. FI_SEND, FI_RECV, FI_REMOTE_WRITE)
+         * @param handler
+         */
+        inline void on(uint64_t flags, handler_t handler) {
+            for (auto &h : handlers) {
+                if (h.first == flags) {
+                    h.second = std::move(handler);
+                    return;
+                }
+            }
+            handlers.emplace_back(flags, std::move(handler));
+        }
+
+        /**
+         * Registers a handler for error entries posted without a context. Without one, errors are
+         * returned from poll.
+         * @param handler
+         */
+        inline void on_error(error_handler_t handler) {
+            err_handler = std::move(handler);
+        }
+
+        /**
+         * Reads entries with fi_cq_readfrom from now on, so handlers and contexts can look up the
+         * address each entry came from with source. The endpoint must have been opened with FI_SOURCE.
+         */
+        inline void track_sources() {
+            sources.assign(batch, FI_ADDR_NOTAVAIL);
+        }
+
+        /**
+         * Address the entry being dispatched came from. Only valid inside handlers and on_complete.
+         * @return source address, or FI_ADDR_NOTAVAIL if unknown or sources are not tracked
+         */
+        [[nodiscard]] inline fi_addr_t source() const {
+            return current_source;
+        }
+
+        /**
+         * Reads and dispatches up to max entries with a single fi_cq_read. Returns 0 right away if
+         * another thread is draining the queue.
+         * @param max maximum entries to read; 0 or anything larger than the batch reads a full batch
+         * @return number of entries retired, or a negative fi_errno value on an unhandled error
+         */
+        inline int poll(size_t max = 0) {
+            if (max == 0 || max > batch) {
+                max = batch;
+            }
+            if (!lock()) {
+                return 0;
+            }
+            int ret = retire(sources.empty() ? fi_cq_read(cq, entries.data(), max)
+                                             : fi_cq_readfrom(cq, entries.data(), max, sources.data()));
+            unlock();
+            return ret;
+        }
+
+        /**
+         * Sleeps on the wait object until entries arrive, then reads and dispatches up to a batch of them.
+         * Only valid on a completion queue with a wait object. Returns 0 right away if another thread is
+         * draining the queue.
+         * @param timeout milliseconds to sleep for, or -1 to sleep until entries arrive
+         * @return number of entries retired (0 on timeout), or a negative fi_errno value on an unhandled error
+         */
+        inline int sread(int timeout = -1) {
+            assert(waitable);
+            if (!lock()) {
+                return 0;
+            }
+            ssize_t ret = sources.empty() ? fi_cq_sread(cq, entries.data(), batch, nullptr, timeout)
+                                          : fi_cq_sreadfrom(cq, entries.data(), batch, sources.data(), nullptr, timeout);
+            int retired = ret == -FI_ETIMEDOUT ? 0 : retire(ret);
+            unlock();
+            return retired;
+        }
+
+        /**
+         * Retires entries following the wait policy until ready returns true.
+         * @param ready checked before every poll
+         * @return 0 once ready, or a negative fi_errno value
+         */
+        template<typename pred_t>
+        inline int wait_until(pred_t ready) {
+            const bool blocking = policy.block && waitable;
+            auto start = std::chrono::steady_clock::now();
+            while (!ready()) {
+                int ret;
+                if (blocking && std::chrono::steady_clock::now() - start >= policy.spin) {
+                    ret = sread();
+                } else {
+                    ret = poll();
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            return 0;
+        }
+
+        /**
+         * Blocks until an entry posted without a context and not claimed by a handler has been retired.
+         * @return 0 on success, or a negative fi_errno value
+         */
+        inline int wait_for_completion() {
+            int ret = wait_until([this]() { return unclaimed > 0; });
+            if (ret < 0) {
+                return ret;
+            }
+            --unclaimed;
+            return 0;
+        }
+
+        /**
+         * Sets how waits on this queue spin and sleep
+         * @param p policy
+         */
+        inline void set_wait_policy(wait_policy p) {
+            policy = p;
+        }
+
+        /**
+         * File descriptor that becomes readable when entries arrive, for use with poll or epoll.
+         * Call fi_trywait on the queue before sleeping on it.
+         * @return file descriptor, or -1 if the queue has no fd wait object
+         */
+        [[nodiscard]] inline int fd() const {
+            int waitFd = -1;
+            if (!waitable || fi_control(&cq->fid, FI_GETWAIT, &waitFd) != 0) {
+                return -1;
+            }
+            return waitFd;
+        }
+
+        /**
+         * Number of retired entries waiting to be handed out by wait_for_completion
+         * @return count
+         */
+        [[nodiscard]] inline uint64_t pending() const {
+            return unclaimed;
+        }
+
+        /**
+         * Underlying completion queue
+         * @return completion queue
+         */
+        [[nodiscard]] inline fid_cq *get() const {
+            return cq;
+        }
+
+    private:
+
+        static inline size_t entrySize(fi_cq_format format) {
+            switch (format) {
+                case FI_CQ_FORMAT_MSG:
+                    return sizeof(fi_cq_msg_entry);
+                case FI_CQ_FORMAT_DATA:
+                    return sizeof(fi_cq_data_entry);
+                case FI_CQ_FORMAT_TAGGED:
+                    return sizeof(fi_cq_tagged_entry);
+                case FI_CQ_FORMAT_CONTEXT:
+                default:
+                    return sizeof(fi_cq_entry);
+            }
+        }
+
+        // Another thread already draining has the entries this one is after, so there is no point
+        // in waiting for it
+        inline bool lock() {
+            return !draining.exchange(true, std::memory_order_acquire);
+        }
+
+        inline void unlock() {
+            draining.store(false, std::memory_order_release);
+        }
+
+        inline int retire(ssize_t ret) {
+            if (ret > 0) {
+                for (ssize_t i = 0; i < ret; i++) {
+                    fi_cq_tagged_entry entry = {};
+                    memcpy(&entry, entries.data() + i * stride, stride);
+                    current_source = sources.empty() ? FI_ADDR_NOTAVAIL : sources[i];
+                    dispatch(entry);
+                }
+                current_source = FI_ADDR_NOTAVAIL;
+                return (int) ret;
+            }
+            if (ret == -FI_EAGAIN) {
+                return 0;
+            }
+            return readError((int) ret);
+        }
+
+        inline void dispatch(const fi_cq_tagged_entry &entry) {
+            DO_LOG(TRACE) << "Entry flags " << entry.flags << " len " << entry.len << " ops " << entry.op_context;
+            if (entry.op_context) {
+                auto *ctx = static_cast<op_context *>(entry.op_context);
+                if (ctx->on_complete) {
+                    ctx->on_complete(ctx, entry);
+                }
+                return;
+            }
+            for (auto &h : handlers) {
+                if ((entry.flags & h.first) == h.first) {
+                    h.second(entry);
+                    return;
+                }
+            }
+            ++unclaimed;
+        }
+
+        inline int readError(int ret) {
+            // New error on queue
+            fi_cq_err_entry err_entry = {};
+            if (fi_cq_readerr(cq, &err_entry, 0) < 0) {
+                return ret;
+            }
+            DO_LOG(ERROR) << fi_strerror(err_entry.err) << " "
+                          << fi_cq_strerror(cq, err_entry.prov_errno, err_entry.err_data, nullptr, 0);
+            if (err_entry.op_context) {
+                auto *ctx = static_cast<op_context *>(err_entry.op_context);
+                if (ctx->on_error) {
+                    ctx->on_error(ctx, err_entry);
+                }
+                return 1;
+            }
+            if (err_handler) {
+                err_handler(err_entry);
+                return 1;
+            }
+            return ret;
+        }
+
+        fid_cq *cq = nullptr;
+        size_t stride = sizeof(fi_cq_entry);
+        size_t batch = 0;
+        std::vector<char> entries;
+        bool waitable = false;
+        wait_policy policy;
+        std::vector<std::pair<uint64_t, handler_t>> handlers;
+        error_handler_t err_handler;
+        uint64_t unclaimed = 0;
+        // Empty unless track_sources was called
+        std::vector<fi_addr_t> sources;
+        fi_addr_t current_source = FI_ADDR_NOTAVAIL;
+        std::atomic_bool draining{false};
+    };
+
+}
+
+#endif //NETWORKLAYER_COMPLETION_HH
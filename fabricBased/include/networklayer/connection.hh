@@ -6,6 +6,12 @@
 
 #include "unique_buf.hh"
 #include "shared_buf.hh"
+#include "completion.hh"
+#include "recv_ring.hh"
+#include "segment.hh"
+#include "mr_cache.hh"
+#include "mem_policy.hh"
+#include "fabric_context.hh"
 #include "Macros.hh"
 
 #include <rdma/fabric.h>
@@ -15,10 +21,18 @@
 #include <rdma/fi_errno.h>
 #include <rdma/fi_cm.h>
 #include <rdma/fi_tagged.h>
+#include <rdma/fi_atomic.h>
 #include <functional>
 #include <cstring>
 #include <map>
 #include <cassert>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
 
 static_assert(FI_MAJOR_VERSION == MAJOR_VERSION_USED && FI_MINOR_VERSION >= MINOR_VERSION_USED,
               "Rely on libfabric 1.9");
@@ -49,10 +63,181 @@ namespace cse498 {
         }
     }
 
+    /**
+     * Maps a type to the libfabric datatype used for remote atomics on it
+     */
+    template<typename T>
+    struct atomic_datatype;
+
+    template<>
+    struct atomic_datatype<int32_t> {
+        static constexpr fi_datatype value = FI_INT32;
+    };
+
+    template<>
+    struct atomic_datatype<uint32_t> {
+        static constexpr fi_datatype value = FI_UINT32;
+    };
+
+    template<>
+    struct atomic_datatype<int64_t> {
+        static constexpr fi_datatype value = FI_INT64;
+    };
+
+    template<>
+    struct atomic_datatype<uint64_t> {
+        static constexpr fi_datatype value = FI_UINT64;
+    };
+
+    template<>
+    struct atomic_datatype<float> {
+        static constexpr fi_datatype value = FI_FLOAT;
+    };
+
+    template<>
+    struct atomic_datatype<double> {
+        static constexpr fi_datatype value = FI_DOUBLE;
+    };
+
+    /**
+     * Default number of chunks a stream keeps in flight
+     */
+    const size_t DEFAULT_STREAM_WINDOW = 8;
+
+    /**
+     * Largest chunk a stream uses, even if the provider allows larger messages
+     */
+    const size_t MAX_STREAM_CHUNK = 1 << 20;
+
+    /**
+     * Size of the internal control buffer of a connection
+     */
+    const size_t CONTROL_BUF_SIZE = 4096;
+
+    /**
+     * Bytes past the control buffer holding the operand, compare and result of a remote atomic
+     */
+    const size_t ATOMIC_SCRATCH_SIZE = 64;
+
+    /**
+     * Arrival of a write posted with write_notify, read from the receive completion queue
+     */
+    struct write_notice {
+        /**
+         * Immediate data the writer attached
+         */
+        uint64_t data;
+        /**
+         * Bytes written, if the provider reports it (0 otherwise)
+         */
+        size_t len;
+    };
+
+    /**
+     * Most private data connect and accept carry. Providers may allow less (verbs takes 56 bytes on a
+     * connection request and 196 on an accept), see Connection::cm_data_size.
+     */
+    const size_t MAX_CM_DATA_SIZE = 256;
+
+    /**
+     * Where the other side of a connection can reach a registered region, exchanged during the
+     * handshake by Connection::connect and Connection::accept
+     */
+    struct mr_desc {
+        /**
+         * Remote address, see Connection::remote_address
+         */
+        uint64_t addr;
+        /**
+         * Remote key
+         */
+        uint64_t key;
+    };
+
+    /**
+     * Domain and completion queues shared by the connections a listener accepts after
+     * Connection::share_resources. Closed once the listener and every connection using them are gone.
+     */
+    struct shared_resources {
+        /**
+         * Shared domain
+         */
+        fid_domain *domain = nullptr;
+        /**
+         * Shared transmit completion queue
+         */
+        fid_cq *tx_cq = nullptr;
+        /**
+         * Shared receive completion queue
+         */
+        fid_cq *rx_cq = nullptr;
+        /**
+         * Wait object the completion queues were opened with
+         */
+        fi_wait_obj wait_obj = FI_WAIT_NONE;
+        /**
+         * Registration cache for the shared domain
+         */
+        std::unique_ptr<MRCache> cache;
+        /**
+         * Tokens of operations still in flight when their connection went away. The shared queues
+         * may still hand back entries for them, so they live until the queues are closed.
+         */
+        std::vector<completion_t> orphans;
+        /**
+         * Guards orphans
+         */
+        std::mutex lock;
+
+        /**
+         * Keeps tokens alive until the queues are closed, dropping ones that have finished since
+         * @param tokens tokens of a connection being torn down
+         */
+        inline void adopt(std::vector<std::weak_ptr<Completion>> &tokens) {
+            std::lock_guard<std::mutex> g(lock);
+            orphans.erase(std::remove_if(orphans.begin(), orphans.end(),
+                                         [](const completion_t &c) { return c->done(); }), orphans.end());
+            for (auto &w : tokens) {
+                auto c = w.lock();
+                if (c && !c->done()) {
+                    orphans.push_back(std::move(c));
+                }
+            }
+        }
+
+        ~shared_resources() {
+            cache.reset();
+            if (rx_cq)
+                ERRCHK(fi_close(&rx_cq->fid));
+            if (tx_cq)
+                ERRCHK(fi_close(&tx_cq->fid));
+            // No entry can arrive for them any more
+            for (auto &c : orphans) {
+                if (!c->done()) {
+                    c->cancel(FI_ECANCELED);
+                }
+            }
+            if (domain)
+                ERRCHK(fi_close(&domain->fid));
+        }
+    };
+
+    class ThreadContext;
+
+    class SubmitQueue;
+
     /**
      * A basic wrapper around fabric connected communications. Can currently send and receive messages.
+     *
+     * A connection is meant to be used from one thread. Other threads that need the same peer use a
+     * ThreadContext each, and may also post and wait for token based RMA (async_write, async_read and
+     * their blocking versions) concurrently, or hand their requests to a SubmitQueue.
      **/
     class Connection {
+        friend class ThreadContext;
+
+        friend class SubmitQueue;
+
     public:
         /**
          * Creates one side of the connection (either client or server). Must call connect to complete the connection
@@ -61,8 +246,11 @@ namespace cse498 {
          * @param is_server Whether this machine is the server (doesn't matter which one in a connection is the server as long as one is)
          * @param port Port to connection on. Defaults to 8080
          * @param provider provider type to use
+         * @param threadSafe open the endpoint with FI_THREAD_SAFE, which ThreadContext needs. Off by
+         * default since providers may lock every call for it.
          **/
-        Connection(const char *addr, bool is_server, const int port = 8080, ProviderType provider = Sockets) {
+        Connection(const char *addr, bool is_server, const int port = 8080, ProviderType provider = Sockets,
+                   bool threadSafe = false) {
             DO_LOG(INFO) << "Called with params " << addr << " " << is_server << " " << port;
             assert(addr != nullptr);
             hints = nullptr;
@@ -75,6 +263,7 @@ namespace cse498 {
             tx_cq = nullptr;
             pep = nullptr;
             this->is_server = is_server;
+            thread_safe = threadSafe;
 
             create_hints(providerToProtocol(provider));
 
@@ -85,7 +274,7 @@ namespace cse498 {
                                      std::to_string(port).c_str(), FI_SOURCE,
                                      hints, &info));
                 DO_LOG(TRACE) << "Creating fabric";
-                SAFE_CALL(fi_fabric(info->fabric_attr, &fab, nullptr));
+                open_fabric();
                 DO_LOG(DEBUG) << "Using provider: " << info->fabric_attr->prov_name;
 
                 open_eq();
@@ -96,7 +285,7 @@ namespace cse498 {
                                      &info));
                 DO_LOG(DEBUG) << "Using provider: " << info->fabric_attr->prov_name;
 
-                SAFE_CALL(fi_fabric(info->fabric_attr, &fab, nullptr));
+                open_fabric();
 
                 open_eq();
 
@@ -112,6 +301,40 @@ namespace cse498 {
          **/
         Connection(const char *addr, const int port = 8080) : Connection(addr, false, port) {}
 
+        /**
+         * Like the other constructors, but takes the provider discovery result and fabric from a
+         * FabricContext instead of opening them from scratch. Client connections also open their
+         * endpoint on the context's domain, so only the endpoint, event queue and completion queues
+         * are created per connection.
+         *
+         * @param ctx context to take the fabric from, e.g. FabricContext::global()
+         * @param addr address to use on the network, cannot be nullptr
+         * @param is_server Whether this machine is the server
+         * @param port Port to connection on. Defaults to 8080
+         * @param provider provider type to use
+         * @param threadSafe open the endpoint with FI_THREAD_SAFE, see the other constructor
+         **/
+        Connection(FabricContext &ctx, const char *addr, bool is_server, const int port = 8080,
+                   ProviderType provider = Sockets, bool threadSafe = false) : Connection() {
+            DO_LOG(INFO) << "Called with params " << addr << " " << is_server << " " << port;
+            assert(addr != nullptr);
+            this->is_server = is_server;
+            thread_safe = threadSafe;
+
+            create_hints(providerToProtocol(provider));
+            context = ctx.lookup(addr, std::to_string(port).c_str(), is_server ? FI_SOURCE : 0, hints);
+            info = fi_dupinfo(context->info);
+            fab = context->fabric;
+            fabric_ref = std::shared_ptr<fid_fabric>(context, fab);
+            DO_LOG(DEBUG) << "Using provider: " << info->fabric_attr->prov_name;
+
+            open_eq();
+            if (!is_server) {
+                domain = context->get_domain();
+                setup_active_ep();
+            }
+        }
+
         /**
          * Creates null connection.
          */
@@ -137,6 +360,7 @@ namespace cse498 {
         Connection(Connection &&other) {
             msg_sends = other.msg_sends;
             is_server = other.is_server;
+            thread_safe = other.thread_safe;
 
             // These need to be closed by fabric
             hints = other.hints;
@@ -158,8 +382,36 @@ namespace cse498 {
             other.rx_cq = nullptr;
             tx_cq = other.tx_cq;
             other.tx_cq = nullptr;
+            rxq = std::move(other.rxq);
+            txq = std::move(other.txq);
             mrs = other.mrs;
             other.mrs = nullptr;
+            cache = other.cache;
+            other.cache = nullptr;
+            ring = other.ring;
+            other.ring = nullptr;
+            ctrl = other.ctrl;
+            other.ctrl = nullptr;
+            ctrl_mr = other.ctrl_mr;
+            other.ctrl_mr = nullptr;
+            limits = other.limits;
+            eager_max = other.eager_max;
+            policy = other.policy;
+            fabric_ref = std::move(other.fabric_ref);
+            shared = std::move(other.shared);
+            tx_tag = other.tx_tag;
+            other.tx_tag = nullptr;
+            rx_tag = other.rx_tag;
+            other.rx_tag = nullptr;
+            notices = other.notices;
+            other.notices = nullptr;
+            tokens = other.tokens;
+            other.tokens = nullptr;
+            flow = other.flow;
+            other.flow = nullptr;
+            backlog = other.backlog;
+            other.backlog = nullptr;
+            context = std::move(other.context);
         }
 
         ~Connection() {
@@ -176,18 +428,37 @@ namespace cse498 {
                 for (auto &mr : *mrs) {
                     ERRCHK(fi_close(&mr.second->fid));
                 }
+            delete cache;
+            if (ctrl_mr)
+                ERRCHK(fi_close(&ctrl_mr->fid));
             if (ep)
                 ERRCHK(fi_close(&ep->fid));
             if (eq)
                 ERRCHK(fi_close(&eq->fid));
-            if (rx_cq)
-                ERRCHK(fi_close(&rx_cq->fid));
-            if (tx_cq)
-                ERRCHK(fi_close(&tx_cq->fid));
-            if (domain)
-                ERRCHK(fi_close(&domain->fid));
-            if (fab)
-                ERRCHK(fi_close(&fab->fid));
+            if (shared) {
+                if (tokens)
+                    shared->adopt(tokens->live);
+                // Closed with the last connection using them
+                shared.reset();
+            } else {
+                if (rx_cq)
+                    ERRCHK(fi_close(&rx_cq->fid));
+                if (tx_cq)
+                    ERRCHK(fi_close(&tx_cq->fid));
+                cancel_tokens();
+                if (domain && own_domain())
+                    ERRCHK(fi_close(&domain->fid));
+            }
+            // Closed with the last connection using it, or with its FabricContext entry
+            fabric_ref.reset();
+            delete ring;
+            delete ctrl;
+            delete tx_tag;
+            delete rx_tag;
+            delete notices;
+            delete tokens;
+            delete flow;
+            delete backlog;
         }
 
         /**
@@ -211,21 +482,39 @@ namespace cse498 {
                 for (auto &mr : *mrs) {
                     ERRREPORT(fi_close(&mr.second->fid));
                 }
+            delete cache;
+            if (ctrl_mr)
+                ERRREPORT(fi_close(&ctrl_mr->fid));
             if (ep)
                 ERRREPORT(fi_close(&ep->fid));
             if (eq)
                 ERRREPORT(fi_close(&eq->fid));
-            if (rx_cq)
-                ERRREPORT(fi_close(&rx_cq->fid));
-            if (tx_cq)
-                ERRREPORT(fi_close(&tx_cq->fid));
-            if (domain)
-                ERRREPORT(fi_close(&domain->fid));
-            if (fab)
-                ERRREPORT(fi_close(&fab->fid));
+            if (shared) {
+                if (tokens)
+                    shared->adopt(tokens->live);
+                shared.reset();
+            } else {
+                if (rx_cq)
+                    ERRREPORT(fi_close(&rx_cq->fid));
+                if (tx_cq)
+                    ERRREPORT(fi_close(&tx_cq->fid));
+                cancel_tokens();
+                if (domain && own_domain())
+                    ERRREPORT(fi_close(&domain->fid));
+            }
+            fabric_ref.reset();
+            delete ring;
+            delete ctrl;
+            delete tx_tag;
+            delete rx_tag;
+            delete notices;
+            delete tokens;
+            delete flow;
+            delete backlog;
 
             msg_sends = other.msg_sends;
             is_server = other.is_server;
+            thread_safe = other.thread_safe;
 
             hints = other.hints;
             other.hints = nullptr;
@@ -246,8 +535,36 @@ namespace cse498 {
             other.rx_cq = nullptr;
             tx_cq = other.tx_cq;
             other.tx_cq = nullptr;
+            rxq = std::move(other.rxq);
+            txq = std::move(other.txq);
             mrs = other.mrs;
             other.mrs = nullptr;
+            cache = other.cache;
+            other.cache = nullptr;
+            ring = other.ring;
+            other.ring = nullptr;
+            ctrl = other.ctrl;
+            other.ctrl = nullptr;
+            ctrl_mr = other.ctrl_mr;
+            other.ctrl_mr = nullptr;
+            limits = other.limits;
+            eager_max = other.eager_max;
+            policy = other.policy;
+            fabric_ref = std::move(other.fabric_ref);
+            shared = std::move(other.shared);
+            tx_tag = other.tx_tag;
+            other.tx_tag = nullptr;
+            rx_tag = other.rx_tag;
+            other.rx_tag = nullptr;
+            notices = other.notices;
+            other.notices = nullptr;
+            tokens = other.tokens;
+            other.tokens = nullptr;
+            flow = other.flow;
+            other.flow = nullptr;
+            backlog = other.backlog;
+            other.backlog = nullptr;
+            context = std::move(other.context);
             return *this;
         }
 
@@ -259,15 +576,39 @@ namespace cse498 {
          * @return true on success
          */
         inline bool connect() {
+            return connect(nullptr, 0);
+        }
+
+        /**
+         * Like connect, but hands private data to the other side as part of the handshake and returns
+         * what the other side attached. A server only learns the client's data once it has decided what
+         * to send back, so its data cannot depend on it.
+         *
+         * @param data private data to send, may be null
+         * @param len bytes of data, at most cm_data_size
+         * @param peerData set to the private data of the other side if not null. Providers may pad it
+         * (verbs does), so the data should describe its own length.
+         * @return true on success
+         */
+        inline bool connect(const void *data, size_t len, std::vector<char> *peerData = nullptr) {
             assert(!failed);
             if (is_server) {
 
-                createPep();
+                if (!pep) {
+                    createPep();
+                }
+                if (!check_cm_data(len)) {
+                    ERRREPORT(fi_close(&pep->fid));
+                    pep = nullptr;
+                    DO_LOG(DEBUG) << "Close pep";
+                    return false;
+                }
 
                 uint32_t event = 0;
-                struct fi_eq_cm_entry entry = {};
+                cm_event entry = {};
                 DO_LOG(TRACE) << "Waiting for connection request";
-                bool ret = ERRREPORT(fi_eq_sread(eq, &event, &entry, sizeof(entry), -1, 0));
+                ssize_t read = fi_eq_sread(eq, &event, &entry, sizeof(entry), -1, 0);
+                bool ret = ERRREPORT(read);
                 // May want to check that the address is correct.
                 if (!ret) {
                     DO_LOG(ERROR) << "There was an error reading the connection request.";
@@ -285,7 +626,8 @@ namespace cse498 {
                     return false;
                 }
 
-                info = entry.info;
+                info = entry.cm()->info;
+                copy_cm_data(entry, read, peerData);
                 DO_LOG(TRACE) << "Connection request received";
 
                 if (!try_setup_active_ep()) {
@@ -300,24 +642,119 @@ namespace cse498 {
                 DO_LOG(DEBUG) << "Close pep";
 
                 DO_LOG(TRACE) << "Accepting connection request";
-                ret = ERRREPORT(fi_accept(ep, nullptr, 0));
+                ret = ERRREPORT(fi_accept(ep, data, len));
                 if (!ret) {
                     return false;
                 }
 
                 return wait_for_eq_connected();
             } else {
-                DO_LOG(TRACE) << "Sending connection request";
-                bool b = ERRREPORT(fi_connect(ep, info->dest_addr, nullptr, 0));
-                if (!b) {
-                    DO_LOG(TRACE) << "Connection request not successful";
-                    failed = true;
+                if (!check_cm_data(len) || !start_connect(data, len)) {
                     return false;
                 }
-                DO_LOG(TRACE) << "Connection request successfully sent";
+                return wait_for_eq_connected(peerData);
+            }
+        }
 
-                return wait_for_eq_connected();
+        /**
+         * Like connect, but exchanges the regions each side exposes for RMA during the handshake, so
+         * no messages are needed to set up remote access. A server has to register its regions before
+         * connecting, which needs share_resources.
+         *
+         * @param local regions to give the other side, at most (cm_data_size() - 8) / 16 of them
+         * @param remote set to the regions the other side gave
+         * @return true on success
+         */
+        inline bool connect(const std::vector<mr_desc> &local, std::vector<mr_desc> &remote) {
+            std::vector<char> out = encode_regions(local), in;
+            if (is_server && !pep) {
+                createPep();
+            }
+            if (!check_regions(local.size(), out.size())) {
+                return false;
+            }
+            return connect(out.data(), out.size(), &in) && decode_regions(in, remote);
+        }
+
+        /**
+         * Sends the connection request of a client without waiting for the other side to accept it.
+         * Finish with poll_connect; connect_all uses this to bring up many connections at once.
+         *
+         * @param data private data to send with the request, may be null
+         * @param len bytes of data, at most cm_data_size
+         * @return true if the request was sent. Create a new client connection if it fails here.
+         */
+        inline bool start_connect(const void *data = nullptr, size_t len = 0) {
+            assert(!is_server && !failed);
+            DO_LOG(TRACE) << "Sending connection request";
+            bool b = ERRREPORT(fi_connect(ep, info->dest_addr, data, len));
+            if (!b) {
+                DO_LOG(TRACE) << "Connection request not successful";
+                failed = true;
+                return false;
+            }
+            DO_LOG(TRACE) << "Connection request successfully sent";
+            return true;
+        }
+
+        /**
+         * Checks once, without blocking, whether a connection started with start_connect has been
+         * established.
+         *
+         * @return 0 once connected, -FI_EAGAIN while the handshake is in progress, or another negative
+         * fi_errno value if it failed. Create a new client connection if it failed.
+         */
+        inline int poll_connect() {
+            // Room for private data the server may have accepted with
+            cm_event entry = {};
+            uint32_t event = 0;
+            ssize_t ret = fi_eq_read(eq, &event, &entry, sizeof(entry), 0);
+            if (ret == -FI_EAGAIN) {
+                return -FI_EAGAIN;
+            }
+            failed = true;
+            if (ret < 0) {
+                fi_eq_err_entry err_entry = {};
+                if (fi_eq_readerr(eq, &err_entry, 0) < 0) {
+                    return (int) ret;
+                }
+                DO_LOG(DEBUG) << fi_eq_strerror(eq, err_entry.prov_errno, err_entry.err_data, nullptr, 0);
+                return err_entry.err ? -err_entry.err : -FI_ECONNREFUSED;
+            }
+            if (event != FI_CONNECTED) {
+                DO_LOG(ERROR) << "Not a connected event";
+                return -FI_ECONNREFUSED;
             }
+            failed = false;
+            DO_LOG(DEBUG) << "Connected";
+            return 0;
+        }
+
+        /**
+         * Checks without blocking whether the other side has shut the connection down.
+         *
+         * @return true once the connection is closed
+         */
+        inline bool closed() {
+            if (failed || !eq) {
+                return failed;
+            }
+            cm_event entry = {};
+            uint32_t event = 0;
+            ssize_t ret = fi_eq_read(eq, &event, &entry, sizeof(entry), 0);
+            if (ret == -FI_EAGAIN) {
+                return false;
+            }
+            if (ret < 0) {
+                fi_eq_err_entry err_entry = {};
+                fi_eq_readerr(eq, &err_entry, 0);
+                DO_LOG(DEBUG) << "Connection error: " << fi_strerror(err_entry.err);
+                failed = true;
+            } else if (event == FI_SHUTDOWN) {
+                DO_LOG(DEBUG) << "Connection shut down by the other side";
+                failed = true;
+            }
+            return failed;
         }
 
         /**
@@ -325,19 +762,35 @@ namespace cse498 {
          * @return true if sucessful with the object, and false and a null connection if not sucessful
          */
         inline std::pair<bool, Connection> accept() {
+            return accept(nullptr, 0);
+        }
+
+        /**
+         * Like accept, but hands private data to the client as part of the handshake and returns what
+         * the client attached to its request, see connect(const void *, size_t, std::vector<char> *).
+         * @param data private data to send, may be null
+         * @param len bytes of data, at most cm_data_size
+         * @param peerData set to the private data of the client if not null
+         * @return true if sucessful with the object, and false and a null connection if not sucessful
+         */
+        inline std::pair<bool, Connection> accept(const void *data, size_t len, std::vector<char> *peerData = nullptr) {
             if (is_server) {
                 DO_LOG(TRACE) << "Running accept";
 
                 if (!pep) {
                     createPep();
                 }
+                if (!check_cm_data(len)) {
+                    return {false, Connection()};
+                }
 
                 Connection newConn;
 
                 uint32_t event = 0;
-                struct fi_eq_cm_entry entry = {};
+                cm_event entry = {};
                 DO_LOG(TRACE) << "Waiting for connection request";
-                bool ret = ERRREPORT(fi_eq_sread(eq, &event, &entry, sizeof(entry), -1, 0));
+                ssize_t read = fi_eq_sread(eq, &event, &entry, sizeof(entry), -1, 0);
+                bool ret = ERRREPORT(read);
                 // May want to check that the address is correct.
                 if (!ret) {
                     DO_LOG(ERROR) << "There was an error reading the connection request.";
@@ -351,39 +804,81 @@ namespace cse498 {
 
                 auto old_info = info;
 
-                info = entry.info;
+                info = entry.cm()->info;
+                copy_cm_data(entry, read, peerData);
                 DO_LOG(TRACE) << "Connection request received";
 
+                // The new endpoint gets its own event queue so its shutdown is not reported to the listener
+                fid_eq *listen_eq = eq;
+                open_eq();
                 if (!try_setup_active_ep()) {
+                    ERRREPORT(fi_close(&eq->fid));
+                    eq = listen_eq;
                     return {false, Connection()};
                 }
 
                 DO_LOG(TRACE) << "Accepting connection request with ep " << ep;
-                ret = ERRREPORT(fi_accept(ep, nullptr, 0));
+                ret = ERRREPORT(fi_accept(ep, data, len));
                 if (!ret) {
+                    ERRREPORT(fi_close(&ep->fid));
+                    ep = nullptr;
+                    ERRREPORT(fi_close(&eq->fid));
+                    eq = listen_eq;
                     return {false, Connection()};
                 }
 
                 newConn.domain = this->domain;
-                this->domain = nullptr;
+                this->domain = shared ? shared->domain : nullptr;
+                newConn.shared = shared;
                 newConn.ep = this->ep;
                 this->ep = nullptr;
                 newConn.tx_cq = this->tx_cq;
                 this->tx_cq = nullptr;
                 newConn.rx_cq = this->rx_cq;
                 this->rx_cq = nullptr;
+                newConn.txq = std::move(this->txq);
+                newConn.rxq = std::move(this->rxq);
+                newConn.watch_notices();
+                newConn.limits = limits;
+                newConn.policy = policy;
+                newConn.thread_safe = thread_safe;
+                newConn.fab = fab;
+                newConn.fabric_ref = fabric_ref;
                 newConn.eq = eq;
+                eq = listen_eq;
 
                 ret = newConn.wait_for_eq_connected();
 
                 info = old_info;
-                newConn.eq = nullptr;
 
                 return {ret, std::move(newConn)};
             }
             return {false, Connection()};
         }
 
+        /**
+         * Like accept, but exchanges the regions each side exposes for RMA during the handshake, see
+         * connect(const std::vector<mr_desc> &, std::vector<mr_desc> &). The regions must have been
+         * registered on this listener after share_resources.
+         * @param local regions to give the client
+         * @param remote set to the regions the client gave
+         * @return true if sucessful with the object, and false and a null connection if not sucessful
+         */
+        inline std::pair<bool, Connection> accept(const std::vector<mr_desc> &local, std::vector<mr_desc> &remote) {
+            std::vector<char> out = encode_regions(local), in;
+            if (is_server && !pep) {
+                createPep();
+            }
+            if (!check_regions(local.size(), out.size())) {
+                return {false, Connection()};
+            }
+            auto ret = accept(out.data(), out.size(), &in);
+            if (ret.first && !decode_regions(in, remote)) {
+                return {false, Connection()};
+            }
+            return ret;
+        }
+
         /**
          * Like accept but does not block at all.
          * @return
@@ -399,7 +894,7 @@ namespace cse498 {
                 Connection newConn;
 
                 uint32_t event = 0;
-                struct fi_eq_cm_entry entry = {};
+                cm_event entry = {};
                 DO_LOG(TRACE) << "Waiting for connection request";
                 bool ret = ERRREPORT(fi_eq_read(eq, &event, &entry, sizeof(entry), 0));
                 // May want to check that the address is correct.
@@ -415,33 +910,51 @@ namespace cse498 {
 
                 auto old_info = info;
 
-                info = entry.info;
+                info = entry.cm()->info;
                 DO_LOG(TRACE) << "Connection request received";
 
+                // The new endpoint gets its own event queue so its shutdown is not reported to the listener
+                fid_eq *listen_eq = eq;
+                open_eq();
                 if (!try_setup_active_ep()) {
+                    ERRREPORT(fi_close(&eq->fid));
+                    eq = listen_eq;
                     return {false, Connection()};
                 }
 
                 DO_LOG(TRACE) << "Accepting connection request with ep " << ep;
                 ret = ERRREPORT(fi_accept(ep, nullptr, 0));
                 if (!ret) {
+                    ERRREPORT(fi_close(&ep->fid));
+                    ep = nullptr;
+                    ERRREPORT(fi_close(&eq->fid));
+                    eq = listen_eq;
                     return {false, Connection()};
                 }
 
                 newConn.domain = this->domain;
-                this->domain = nullptr;
+                this->domain = shared ? shared->domain : nullptr;
+                newConn.shared = shared;
                 newConn.ep = this->ep;
                 this->ep = nullptr;
                 newConn.tx_cq = this->tx_cq;
                 this->tx_cq = nullptr;
                 newConn.rx_cq = this->rx_cq;
                 this->rx_cq = nullptr;
+                newConn.txq = std::move(this->txq);
+                newConn.rxq = std::move(this->rxq);
+                newConn.watch_notices();
+                newConn.limits = limits;
+                newConn.policy = policy;
+                newConn.thread_safe = thread_safe;
+                newConn.fab = fab;
+                newConn.fabric_ref = fabric_ref;
                 newConn.eq = eq;
+                eq = listen_eq;
 
                 ret = newConn.wait_for_eq_connected();
 
                 info = old_info;
-                newConn.eq = nullptr;
 
                 return {ret, std::move(newConn)};
             }
@@ -460,7 +973,7 @@ namespace cse498 {
          * Sends a message through the endpoint, blocking until completion. This will
          * also block until all previous messages sent by async_send are completed as
          * well (this means you can touch any data buffer from any previous send after
-         * calling this)
+         * calling this). Messages that fit in inject_size() are injected instead.
          *
          * @param data The data to send
          * @param size The size of the data
@@ -468,6 +981,12 @@ namespace cse498 {
          **/
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
         inline void send(buf_t &data, size_t size, size_t offset = 0) {
+            if (size <= limits.inject_size) {
+                SAFE_CALL(inject_msg(data.get() + offset, size));
+                DO_LOG(DEBUG3) << "Injected " << size << " bytes";
+                wait_for_sends();
+                return;
+            }
             async_send(data, size, offset);
             DO_LOG(DEBUG3) << "Sending " << size << " bytes";
             wait_for_sends();
@@ -480,6 +999,9 @@ namespace cse498 {
          * call one of those also before the program completes otherwise messages from
          * async_send may not have been sent).
          *
+         * At most tx_size messages are in flight at once. Messages past that, or without a credit
+         * under flow control, are queued and posted in order by wait_for_sends or progress.
+         *
          * @param data The data to send
          * @param size The size of the data
          * @param offset offset into buffer
@@ -488,12 +1010,12 @@ namespace cse498 {
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
         inline bool async_send(buf_t &data, size_t size, size_t offset = 0) {
             assert(data.isRegistered());
-            if (size + offset > MAX_MSG_SIZE) {
-                DO_LOG(ERROR) << "Too large of a message!";
-                exit(1);
+            if (size > limits.max_msg_size) {
+                DO_LOG(ERROR) << "Too large of a message! Use send_stream instead.";
+                return false;
             }
-            ++msg_sends;
-            return ERRREPORT(fi_send(ep, data.get() + offset, size, data.getDesc(), 0, nullptr));
+            segment s = {data.get() + offset, size, data.getDesc()};
+            return ERRREPORT(submit(&s, 1));
         }
 
         /*[[deprecated("Use with unique_buf instead")]]
@@ -526,6 +1048,76 @@ namespace cse498 {
             return false;
         }*/
 
+        /**
+         * Sends a message small enough to fit in the provider's inject_size. The data is copied
+         * out before this returns and no completion is generated, so the buffer can be reused right
+         * away and does not need to be registered.
+         *
+         * @param data The data to send
+         * @param size The size of the data, at most inject_size()
+         * @param offset offset into buffer
+         * @return true on success
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool inject(buf_t &data, size_t size, size_t offset = 0) {
+            if (size > limits.inject_size) {
+                DO_LOG(ERROR) << "Too large of a message to inject!";
+                return false;
+            }
+            return ERRREPORT(inject_msg(data.get() + offset, size));
+        }
+
+        /**
+         * Largest message send and write will inject instead of posting
+         * @return inject size
+         **/
+        [[nodiscard]] inline size_t inject_size() const {
+            return limits.inject_size;
+        }
+
+        /**
+         * NUMA node local to the NIC the connection uses. Pass it to mem_policy to place registered
+         * buffers next to the NIC.
+         * @return node, or -1 if unknown
+         **/
+        [[nodiscard]] inline int numa_node() const {
+            return limits.numa_node;
+        }
+
+        /**
+         * Sends segments from one or more registered buffers as a single message, blocking until
+         * completion like send. Lets a header and a payload go out without copying them together.
+         *
+         * @param segs segments to send, at most the provider's iov_limit
+         **/
+        inline void sendv(const std::vector<segment> &segs) {
+            async_sendv(segs);
+            DO_LOG(DEBUG3) << "Sending " << segs.size() << " segments";
+            wait_for_sends();
+        }
+
+        /**
+         * Adds a message made of several segments to the queue to be sent, see async_send.
+         *
+         * @param segs segments to send, at most the provider's iov_limit
+         * @return true on success
+         **/
+        inline bool async_sendv(const std::vector<segment> &segs) {
+            if (segs.empty() || segs.size() > limits.iov_limit) {
+                DO_LOG(ERROR) << "Cannot send " << segs.size() << " segments, the limit is " << limits.iov_limit;
+                return false;
+            }
+            size_t total = 0;
+            for (auto &s : segs) {
+                total += s.len;
+            }
+            if (total > limits.max_msg_size) {
+                DO_LOG(ERROR) << "Too large of a message! Use send_stream instead.";
+                return false;
+            }
+            return ERRREPORT(submit(segs.data(), segs.size()));
+        }
+
         /**
          * Ensures all the previous sends were completed. This means after calling this
          * you can modify the data buffer from async_send.
@@ -533,14 +1125,25 @@ namespace cse498 {
          * @return true on success
          **/
         inline bool try_wait_for_sends() {
-            while (msg_sends > 0) {
-                LOG2<DEBUG3>() << "Waiting for " << msg_sends << " message(s) to send.";
-                int ret = ERRREPORT(wait_for_completion(tx_cq));
-                if (ret >= 0) {
-                    msg_sends -= ret;
-                } else {
+            while (msg_sends > 0 || !backlog->empty()) {
+                bool b = ERRREPORT(drain_backlog());
+                if (!b) {
                     return false;
                 }
+                if (msg_sends > 0) {
+                    LOG2<DEBUG3>() << "Waiting for " << msg_sends << " message(s) to send.";
+                    b = ERRREPORT(wait_tx());
+                    if (!b) {
+                        return false;
+                    }
+                    --msg_sends;
+                } else if (!backlog->empty()) {
+                    // Nothing in flight, so the queued messages are waiting for credits
+                    b = ERRREPORT(rxq.poll());
+                    if (!b) {
+                        return false;
+                    }
+                }
             }
             return true;
         }
@@ -550,40 +1153,337 @@ namespace cse498 {
          * you can modify the data buffer from async_send.
          **/
         inline void wait_for_sends() {
-            while (msg_sends > 0) {
-                DO_LOG(DEBUG3) << "Waiting for " << msg_sends << " message(s) to send.";
-                msg_sends -= SAFE_CALL(wait_for_completion(tx_cq));
+            while (msg_sends > 0 || !backlog->empty()) {
+                SAFE_CALL(drain_backlog());
+                if (msg_sends > 0) {
+                    DO_LOG(DEBUG3) << "Waiting for " << msg_sends << " message(s) to send.";
+                    SAFE_CALL(wait_tx());
+                    --msg_sends;
+                } else if (!backlog->empty()) {
+                    // Nothing in flight, so the queued messages are waiting for credits
+                    SAFE_CALL(rxq.poll());
+                }
             }
         }
 
         /**
-         * Blocks until it receives a message from the endpoint.
+         * Sends size bytes of any length, blocking until the whole buffer has been sent. The buffer is
+         * split into chunks no larger than the provider's max_msg_size and up to window chunks are kept
+         * in flight. Must be matched by recv_stream on the other side.
          *
-         * @param buf The buffer to store the message data in
-         * @param max_len The maximum length of the message (should be <= MAX_MSG_SIZE)
+         * @param data The data to send
+         * @param size The size of the data
          * @param offset offset into buffer
+         * @param window maximum chunks in flight
+         * @return true on success
          **/
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
-        inline void recv(buf_t &data, size_t max_len, size_t offset = 0) {
+        inline bool send_stream(buf_t &data, size_t size, size_t offset = 0, size_t window = DEFAULT_STREAM_WINDOW) {
             assert(data.isRegistered());
-            char *buf = data.get() + offset;
-            SAFE_CALL(fi_recv(ep, buf, max_len, data.getDesc(), 0, nullptr));
-            DO_LOG(DEBUG3) << "Receiving up to " << max_len << " bytes";
-            SAFE_CALL(wait_for_completion(rx_cq));
-        }
-
-        /*[[deprecated("Use with unique_buf instead")]]
-        inline void recv(char *buf, size_t max_len) {
-            SAFE_CALL(fi_recv(ep, buf, max_len, nullptr, 0, nullptr));
-            DO_LOG(DEBUG3) << "Receiving up to " << max_len << " bytes";
-            SAFE_CALL(wait_for_completion(rx_cq));
-        }*/
+            window = std::max<size_t>(1, std::min(window, limits.tx_size));
+
+            // Wait for earlier sends so the header in the control buffer is not overwritten in flight
+            if (!try_wait_for_sends()) {
+                return false;
+            }
+
+            const size_t chunk = stream_chunk_size();
+            auto &c = control_buffer();
+            ((uint64_t *) c.get())[0] = size;
+            ((uint64_t *) c.get())[1] = chunk;
+            if (!post_send(c.get(), 2 * sizeof(uint64_t), c.getDesc())) {
+                return false;
+            }
+
+            DO_LOG(DEBUG3) << "Streaming " << size << " bytes in chunks of " << chunk;
+            for (size_t sent = 0; sent < size; sent += chunk) {
+                while (msg_sends >= window) {
+                    bool b = ERRREPORT(wait_tx());
+                    if (!b) {
+                        return false;
+                    }
+                    --msg_sends;
+                }
+                if (!post_send(data.get() + offset + sent, std::min(chunk, size - sent), data.getDesc())) {
+                    return false;
+                }
+            }
+            return try_wait_for_sends();
+        }
+
+        /**
+         * Receives a buffer sent with send_stream, blocking until all of it has arrived. Chunks are
+         * received directly into data, keeping up to window receives posted.
+         *
+         * @param data The buffer to reassemble the message in
+         * @param max_len Space available in data after offset; must fit the whole message
+         * @param offset offset into buffer
+         * @param window maximum receives posted at once
+         * @return number of bytes received (0 for an empty stream), or a negative error: -FI_ETOOSMALL
+         * if the stream does not fit in max_len, otherwise the transport error
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline ssize_t recv_stream(buf_t &data, size_t max_len, size_t offset = 0, size_t window = DEFAULT_STREAM_WINDOW) {
+            assert(data.isRegistered());
+            window = std::max<size_t>(1, std::min(window, limits.rx_size));
+
+            if (!recv_control(2 * sizeof(uint64_t))) {
+                return -FI_EIO;
+            }
+            const size_t size = ((uint64_t *) control_buffer().get())[0];
+            const size_t chunk = ((uint64_t *) control_buffer().get())[1];
+            if (size > max_len) {
+                DO_LOG(ERROR) << "Stream of " << size << " bytes does not fit in " << max_len << " bytes";
+                return -FI_ETOOSMALL;
+            }
+
+            if (ring) {
+                for (size_t recvd = 0; recvd < size;) {
+                    msg_view v;
+                    while (!try_recv_view(v)) {
+                        int err = ring->take_error();
+                        if (err != 0) {
+                            return -err;
+                        }
+                    }
+                    size_t len = v.size;
+                    int ret = take_view(data, v, size - recvd, offset + recvd);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                    recvd += len;
+                }
+                return (ssize_t) size;
+            }
+
+            size_t posted = 0, outstanding = 0;
+            while (posted < size || outstanding > 0) {
+                while (posted < size && outstanding < window) {
+                    size_t len = std::min(chunk, size - posted);
+                    bool b = ERRREPORT(fi_recv(ep, data.get() + offset + posted, len, data.getDesc(), 0, rx_tag));
+                    if (!b) {
+                        break;
+                    }
+                    posted += len;
+                    ++outstanding;
+                }
+                if (outstanding == 0) {
+                    return -FI_EIO;
+                }
+                int ret = wait_rx();
+                if (ret < 0) {
+                    return ret;
+                }
+                --outstanding;
+            }
+            return (ssize_t) size;
+        }
+
+        /**
+         * Size of the chunks send_stream splits a buffer into
+         * @return chunk size
+         */
+        [[nodiscard]] inline size_t stream_chunk_size() const {
+            return std::min(limits.max_msg_size, MAX_STREAM_CHUNK);
+        }
+
+        /**
+         * Sends a message of any length, picking the protocol by size. Messages up to the eager
+         * threshold are copied into the control buffer and sent with one fi_send. Larger messages use a
+         * rendezvous: only a descriptor (address, key, length) is sent and the receiver pulls the data
+         * with RDMA reads straight into its destination buffer, so data must be registered with
+         * FI_REMOTE_READ. Blocks until data can be reused. Must be matched by recv_auto.
+         *
+         * @param data The data to send
+         * @param size The size of the data
+         * @param offset offset into buffer
+         * @return true on success
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool send_auto(buf_t &data, size_t size, size_t offset = 0) {
+            assert(data.isRegistered());
+
+            if (!try_wait_for_sends()) {
+                return false;
+            }
+
+            auto &c = control_buffer();
+            auto *h = (rndv_header *) c.get();
+            h->size = size;
+            if (size <= eager_threshold()) {
+                h->type = EAGER_MSG;
+                c.cpyTo(data.get() + offset, size, sizeof(rndv_header));
+                if (!post_send(c.get(), sizeof(rndv_header) + size, c.getDesc())) {
+                    return false;
+                }
+                return try_wait_for_sends();
+            }
+
+            h->type = RNDV_MSG;
+            h->addr = remote_address(data, offset);
+            h->key = data.key();
+            DO_LOG(DEBUG3) << "Rendezvous for " << size << " bytes at " << h->key << "-" << h->addr;
+            if (!post_send(c.get(), sizeof(rndv_header), c.getDesc()) || !try_wait_for_sends()) {
+                return false;
+            }
+            if (!recv_control(sizeof(rndv_header))) {
+                return false;
+            }
+            return h->type == RNDV_FIN && h->size == size;
+        }
+
+        /**
+         * Receives a message sent with send_auto into data, blocking until it has arrived.
+         *
+         * @param data The buffer to store the message in
+         * @param max_len Space available in data after offset
+         * @param offset offset into buffer
+         * @return number of bytes received (0 for an empty message), -FI_ETOOSMALL if the message does
+         * not fit in max_len, or another negative fi_errno value
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline ssize_t recv_auto(buf_t &data, size_t max_len, size_t offset = 0) {
+            assert(data.isRegistered());
+
+            if (!recv_control(CONTROL_BUF_SIZE)) {
+                return -FI_EIO;
+            }
+            auto &c = control_buffer();
+            rndv_header h = *(rndv_header *) c.get();
+            int err = 0;
+            if (h.size > max_len) {
+                DO_LOG(ERROR) << "Message of " << h.size << " bytes does not fit in " << max_len << " bytes";
+                err = -FI_ETOOSMALL;
+            }
+
+            if (h.type == EAGER_MSG) {
+                if (err < 0) {
+                    return err;
+                }
+                data.cpyTo(c.get() + sizeof(rndv_header), h.size, offset);
+                return (ssize_t) h.size;
+            }
+            assert(h.type == RNDV_MSG);
+
+            // Pull the data in chunks, keeping as many reads in flight as the transmit queue allows.
+            // Nothing is read if it does not fit.
+            const size_t chunk = stream_chunk_size();
+            const size_t size = err < 0 ? 0 : h.size;
+            std::deque<completion_t> reads;
+            for (size_t off = 0; off < size; off += chunk) {
+                if (reads.size() >= limits.tx_size) {
+                    int ret = wait(reads.front());
+                    err = err == 0 ? ret : err;
+                    reads.pop_front();
+                }
+                reads.push_back(async_read(data, std::min(chunk, size - off), h.addr + off, h.key, offset + off));
+            }
+            for (auto &r : reads) {
+                int ret = wait(r);
+                err = err == 0 ? ret : err;
+            }
+
+            // The sender only takes a FIN for the full size as success
+            auto *fin = (rndv_header *) c.get();
+            fin->type = RNDV_FIN;
+            fin->size = err < 0 ? 0 : h.size;
+            if (!post_send(c.get(), sizeof(rndv_header), c.getDesc()) || !try_wait_for_sends()) {
+                return err < 0 ? err : -FI_EIO;
+            }
+            return err < 0 ? err : (ssize_t) h.size;
+        }
+
+        /**
+         * Largest message send_auto sends eagerly
+         * @return threshold in bytes
+         */
+        [[nodiscard]] inline size_t eager_threshold() const {
+            size_t detected = std::min(CONTROL_BUF_SIZE - sizeof(rndv_header), limits.max_msg_size - sizeof(rndv_header));
+            return eager_max ? std::min(eager_max, detected) : detected;
+        }
+
+        /**
+         * Tunes the size at which send_auto switches to a rendezvous. Values above the detected
+         * threshold are clamped to it; 0 restores the detected threshold.
+         * @param threshold largest message to send eagerly
+         */
+        inline void set_eager_threshold(size_t threshold) {
+            eager_max = threshold;
+        }
+
+        /**
+         * Address to give the other side for remote access to data at offset in a buffer registered on
+         * this connection. This is the virtual address for providers using FI_MR_VIRT_ADDR (verbs) and
+         * the offset into the registered region otherwise (sockets).
+         * @param data registered buffer
+         * @param offset offset into buffer
+         * @return remote address
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        [[nodiscard]] inline uint64_t remote_address(buf_t &data, size_t offset = 0) const {
+            return limits.virt_addr ? (uint64_t) (data.get() + offset) : data.regOffset() + offset;
+        }
+
+        /**
+         * Descriptor to give the other side for remote access to data at offset in a buffer registered
+         * on this connection, e.g. to pass to connect or accept
+         * @param data registered buffer
+         * @param offset offset into buffer
+         * @return descriptor
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        [[nodiscard]] inline mr_desc describe(buf_t &data, size_t offset = 0) const {
+            assert(data.isRegistered());
+            return {remote_address(data, offset), data.key()};
+        }
+
+        /**
+         * Most private data the provider carries on a connection request or accept. Needs an
+         * endpoint, or on a server the listening endpoint connect and accept open.
+         * @return bytes
+         */
+        [[nodiscard]] inline size_t cm_data_size() const {
+            size_t size = MAX_CM_DATA_SIZE;
+            size_t len = sizeof(size);
+            fid *f = ep ? &ep->fid : (pep ? &pep->fid : nullptr);
+            if (!f || fi_getopt(f, FI_OPT_ENDPOINT, FI_OPT_CM_DATA_SIZE, &size, &len) < 0) {
+                return MAX_CM_DATA_SIZE;
+            }
+            return std::min(size, MAX_CM_DATA_SIZE);
+        }
 
         /**
          * Blocks until it receives a message from the endpoint.
          *
          * @param buf The buffer to store the message data in
-         * @param max_len The maximum length of the message (should be <= MAX_MSG_SIZE)
+         * @param max_len The maximum length of the message (should be <= the provider's max_msg_size)
+         * @param offset offset into buffer
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void recv(buf_t &data, size_t max_len, size_t offset = 0) {
+            assert(data.isRegistered());
+            if (ring) {
+                SAFE_CALL(take_view(data, recv_view(), max_len, offset));
+                return;
+            }
+            char *buf = data.get() + offset;
+            SAFE_CALL(fi_recv(ep, buf, max_len, data.getDesc(), 0, rx_tag));
+            DO_LOG(DEBUG3) << "Receiving up to " << max_len << " bytes";
+            SAFE_CALL(wait_rx());
+        }
+
+        /*[[deprecated("Use with unique_buf instead")]]
+        inline void recv(char *buf, size_t max_len) {
+            SAFE_CALL(fi_recv(ep, buf, max_len, nullptr, 0, nullptr));
+            DO_LOG(DEBUG3) << "Receiving up to " << max_len << " bytes";
+            SAFE_CALL(wait_for_completion(rx_cq));
+        }*/
+
+        /**
+         * Blocks until it receives a message from the endpoint.
+         *
+         * @param buf The buffer to store the message data in
+         * @param max_len The maximum length of the message (should be <= the provider's max_msg_size)
          * @param offset
          *
          * @return true on success
@@ -591,15 +1491,52 @@ namespace cse498 {
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
         inline bool try_recv(buf_t &data, size_t max_len, size_t offset = 0) {
             assert(data.isRegistered());
+            if (ring) {
+                msg_view v;
+                while (!try_recv_view(v)) {
+                    if (ring->take_error() != 0) {
+                        return false;
+                    }
+                }
+                return ERRREPORT(take_view(data, v, max_len, offset));
+            }
 
             DO_LOG(DEBUG3) << "Receiving up to " << max_len << " bytes";
-            bool b = ERRREPORT(fi_recv(ep, data.get() + offset, max_len, data.getDesc(), 0, nullptr));
+            bool b = ERRREPORT(fi_recv(ep, data.get() + offset, max_len, data.getDesc(), 0, rx_tag));
             if (b) {
-                return ERRREPORT(wait_for_completion(rx_cq));
+                return ERRREPORT(wait_rx());
             }
             return false;
         }
 
+        /**
+         * Posts a receive without waiting for it, so several receives can be outstanding at once. They
+         * are matched with incoming messages in the order they were posted. The buffer cannot be read
+         * until the returned token is done; wait for it with wait_recv. Not available with a receive ring.
+         *
+         * @param data The buffer to store the message data in
+         * @param max_len The maximum length of the message
+         * @param offset offset into buffer
+         * @return completion token; already done with an error if the receive could not be posted
+         * (FI_EAGAIN if the receive queue is full)
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline completion_t async_recv(buf_t &data, size_t max_len, size_t offset = 0) {
+            assert(data.isRegistered());
+            auto c = new_token();
+            if (ring) {
+                DO_LOG(ERROR) << "Cannot post receives next to a receive ring";
+                c->cancel(FI_EINVAL);
+                return c;
+            }
+            ssize_t ret = fi_recv(ep, data.get() + offset, max_len, data.getDesc(), 0, c.get());
+            bool b = ERRREPORT(ret);
+            if (!b) {
+                c->cancel((int) -ret);
+            }
+            return c;
+        }
+
         /*[[deprecated("Use with unique_buf instead")]]
         inline bool try_recv(char *buf, size_t max_len) {
             DO_LOG(DEBUG3) << "Receiving up to " << max_len << " bytes";
@@ -611,6 +1548,210 @@ namespace cse498 {
         }*/
 
 
+        /**
+         * Drops the registration of a buffer registered with register_mr or register_mr_cached. Regions
+         * from the registration cache stay cached until they are evicted unless invalidate is set, which
+         * must be used if the buffer's memory may be freed and reused or unmapped afterwards.
+         *
+         * @param data The registered buffer
+         * @param invalidate close cached regions under the buffer that are no longer used
+         * @return true if the buffer was registered on this connection
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool deregister_mr(buf_t &data, bool invalidate = false) {
+            if (!data.isRegistered()) {
+                return false;
+            }
+            uint64_t key = data.key();
+            MRCache &c = mr_cache();
+            if (c.contains(key)) {
+                c.release(key);
+                if (invalidate) {
+                    c.invalidate(data.get(), data.size());
+                }
+                return true;
+            }
+            auto elem = mrs->find(key);
+            if (elem == mrs->end()) {
+                return false;
+            }
+            SAFE_CALL(fi_close(&elem->second->fid));
+            mrs->erase(elem);
+            return true;
+        }
+
+        /**
+         * Registers a ring of receive slots and posts a receive into every slot, so messages are
+         * received as soon as they arrive. Use recv_view/try_recv_view and release afterwards; recv
+         * and try_recv keep working but copy out of the ring. Can only be called once.
+         *
+         * @param slots number of slots (at most the receive queue size)
+         * @param slotSize largest message that can be received
+         * @param key key to register the ring under, see register_mr
+         */
+        inline void enable_recv_ring(size_t slots, size_t slotSize, uint64_t &key) {
+            assert(ring == nullptr);
+            if (slots > limits.rx_size) {
+                DO_LOG(WARNING) << "Clamping receive ring to " << limits.rx_size << " slots";
+                slots = limits.rx_size;
+            }
+            ring = new RecvRing(slots, slotSize);
+            register_mr(ring->buffer(), FI_RECV, key);
+            ring->post_all(ep);
+        }
+
+        /**
+         * Same as above, but registers the ring under a key reserved from the registration cache so it
+         * cannot collide with keys passed to register_mr
+         *
+         * @param slots number of slots (at most the receive queue size)
+         * @param slotSize largest message that can be received
+         */
+        inline void enable_recv_ring(size_t slots, size_t slotSize) {
+            uint64_t key = mr_cache().reserve_key();
+            enable_recv_ring(slots, slotSize, key);
+        }
+
+        /**
+         * Blocks until a message is in the receive ring and returns a view of it. The view must be
+         * given back with release.
+         * @return view of the message
+         */
+        inline msg_view recv_view() {
+            assert(ring);
+            msg_view v;
+            while (!try_recv_view(v)) {
+                SAFE_CALL(-ring->take_error());
+            }
+            return v;
+        }
+
+        /**
+         * Checks the receive ring for a message without blocking.
+         * @param v set to a view of the message on success; must be given back with release
+         * @return true if there was a message
+         */
+        inline bool try_recv_view(msg_view &v) {
+            assert(ring);
+            if (ring->take(v)) {
+                return true;
+            }
+            ERRREPORT(rxq.poll());
+            return ring->take(v);
+        }
+
+        /**
+         * Gives a slot back to the receive ring so it can receive again.
+         * @param v view from recv_view or try_recv_view
+         */
+        inline void release(const msg_view &v) {
+            assert(ring);
+            ring->release(v);
+            if (flow) {
+                ++flow->released;
+                // Piggybacking on sends usually announces the slot; write it back if there is no traffic
+                if (flow->slots + flow->released - flow->announced >= std::max<uint64_t>(1, flow->slots / 2)) {
+                    announce();
+                }
+            }
+        }
+
+        /**
+         * Turns on credit-based flow control. Posts a receive ring (see enable_recv_ring) and tells the
+         * other side how many slots it has; from then on a message is only posted once the other side
+         * has a free slot for it. Freed slots are granted back as remote CQ data on outgoing messages,
+         * or with a small RDMA write when there is no traffic the other way. Both sides must call this
+         * before sending anything else.
+         *
+         * Messages that cannot be posted yet (no credit, full send window or a full transmit queue) are
+         * queued and posted in order as credits and completions arrive, so async_send never fails just
+         * because the other side is slow.
+         *
+         * @param slots number of slots in the receive ring
+         * @param slotSize largest message that can be received
+         * @param key key to register the ring under, see register_mr
+         * @return true on success
+         */
+        inline bool enable_flow_control(size_t slots, size_t slotSize, uint64_t &key) {
+            assert(!flow);
+            enable_recv_ring(slots, slotSize, key);
+            auto *f = new flow_state();
+            f->slots = ring->slots();
+            uint64_t flowKey = mr_cache().reserve_key();
+            register_mr(f->granted, FI_REMOTE_WRITE, flowKey);
+
+            auto &c = control_buffer();
+            auto *hello = (uint64_t *) c.get();
+            hello[0] = f->slots;
+            hello[1] = remote_address(f->granted);
+            hello[2] = flowKey;
+            if (!post_send(c.get(), 3 * sizeof(uint64_t), c.getDesc()) || !try_wait_for_sends() ||
+                !recv_control(3 * sizeof(uint64_t))) {
+                DO_LOG(ERROR) << "Unable to exchange flow control setup";
+                delete f;
+                return false;
+            }
+            f->peerGranted = hello[0];
+            f->peerAddr = hello[1];
+            f->peerKey = hello[2];
+            // Our setup took a slot on the other side, and theirs was received and given back here
+            f->sent = 1;
+            f->announced = f->slots;
+            f->released = 1;
+            flow = f;
+            DO_LOG(DEBUG) << "Flow control with " << f->peerGranted << " credits";
+            return true;
+        }
+
+        /**
+         * Number of messages that can be posted before the other side grants more. Unlimited without
+         * flow control.
+         * @return credits
+         */
+        inline uint64_t credits() {
+            if (!flow) {
+                return UINT64_MAX;
+            }
+            uint64_t d;
+            if (ring->take_data(d)) {
+                // Only the low bits of the total fit in the CQ data; they never move backwards
+                auto ahead = (uint32_t) ((uint32_t) d - (uint32_t) flow->peerGranted);
+                if (ahead < (1U << 31)) {
+                    flow->peerGranted += ahead;
+                }
+            }
+            uint64_t written = *(volatile uint64_t *) flow->granted.get();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            flow->peerGranted = std::max(flow->peerGranted, written);
+            return flow->peerGranted - flow->sent;
+        }
+
+        /**
+         * Number of messages queued because they could not be posted yet
+         * @return count
+         */
+        [[nodiscard]] inline size_t backlog_size() const {
+            return backlog->size();
+        }
+
+        /**
+         * Retires completions and posts queued messages that now fit, without blocking
+         * @return true on success
+         */
+        inline bool progress() {
+            bool b = ERRREPORT(txq.poll());
+            if (!b) {
+                return false;
+            }
+            if (flow) {
+                b = ERRREPORT(rxq.poll());
+                if (!b) {
+                    return false;
+                }
+            }
+            return ERRREPORT(drain_backlog());
+        }
+
         /**
          * Registers a new memory region which only works for this connection. If there is already
          * a memory region registered with the same key then it will close the previous one and register 
@@ -620,7 +1761,7 @@ namespace cse498 {
          * @param buf The buffer to register
          * @param size The size of the buffer
          * @param access The access flags for the memory region (FI_WRITE, FI_REMOTE_WRITE, FI_READ, and/or FI_REMOTE_READ. Bitwise or for multiple permissions)
-         * @param key The access key for the memory region. The other side of the connection should use the same key (0 works well for this). If the fabric changes it, it will set key.
+         * @param key The access key for the memory region. The other side of the connection should use the same key (0 works well for this). If the fabric changes it, it will set key. Must be below MR_CACHE_KEY_BASE, where the keys of internal buffers start.
          * @return True if there was another region with the same key that needed to be closed. 
          **/
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
@@ -642,6 +1783,43 @@ namespace cse498 {
             }
         }
 
+        /**
+         * Registers a buffer that is only used locally through the registration cache: a buffer inside
+         * a region that is already registered with at least the same access reuses that region instead
+         * of registering again. The registration is held until deregister_mr, which must be passed
+         * invalidate if the buffer's memory may be freed and reused or unmapped afterwards.
+         *
+         * @param data The buffer to register
+         * @param access The access flags for the memory region; no FI_REMOTE_READ or FI_REMOTE_WRITE
+         * @return key of the cached region
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline uint64_t register_mr_cached(buf_t &data, uint64_t access) {
+            assert((access & (FI_REMOTE_READ | FI_REMOTE_WRITE)) == 0);
+            fid_mr *mr = mr_cache().acquire(data.get(), data.size(), access);
+            uint64_t key = fi_mr_key(mr);
+            data.registerMemoryCallback(key, fi_mr_desc(mr));
+            return key;
+        }
+
+        /**
+         * Registers a buffer under a key reserved for it on the domain, so it never replaces a region
+         * registered with register_mr. Meant for buffers internal to protocols built on a connection.
+         * Drop it with deregister_mr.
+         *
+         * @param data The buffer to register
+         * @param access The access flags for the memory region
+         * @return key of the region
+         **/
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline uint64_t register_mr_unique(buf_t &data, uint64_t access) {
+            uint64_t key = mr_cache().reserve_key();
+            fid_mr *mr = create_mr(data.get(), data.size(), access, key);
+            mrs->insert({key, mr});
+            data.registerMemoryCallback(key, fi_mr_desc(mr));
+            return key;
+        }
+
         /*[[deprecated("Use with unique_buf instead")]]
         inline bool register_mr(char *buf, size_t size, uint64_t access, uint64_t &key) {
             auto elem = mrs->find(key);
@@ -671,11 +1849,10 @@ namespace cse498 {
          */
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
         inline void write(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
-            assert(data.isRegistered());
-
-            SAFE_CALL(fi_write(ep, data.get() + offset, size, data.getDesc(), 0, addr, key, nullptr));
+            auto c = async_write(data, size, addr, key, offset);
+            SAFE_CALL(-c->error());
             DO_LOG(DEBUG3) << "Write " << key << "-" << addr << " sent";
-            SAFE_CALL(wait_for_completion(tx_cq));
+            SAFE_CALL(wait(c));
         }
 
         /*[[deprecated("Use with unique_buf instead")]]
@@ -699,14 +1876,12 @@ namespace cse498 {
          */
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
         inline bool try_write(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
-            assert(data.isRegistered());
-
-            auto b = ERRREPORT(fi_write(ep, data.get() + offset, size, data.getDesc(), 0, addr, key, nullptr));
-            if (b) {
-                DO_LOG(DEBUG3) << "Write " << key << "-" << addr << " sent";
-                return ERRREPORT(wait_for_completion(tx_cq));
+            auto c = async_write(data, size, addr, key, offset);
+            if (c->done()) {
+                return false;
             }
-            return false;
+            DO_LOG(DEBUG3) << "Write " << key << "-" << addr << " sent";
+            return ERRREPORT(wait(c));
         }
 
         /*[[deprecated("Use with unique_buf instead")]]
@@ -719,6 +1894,141 @@ namespace cse498 {
             return false;
         }*/
 
+        /**
+         * Write from buf with given size to the addr with the given key without generating a completion.
+         * The data is copied out before this returns, so the buffer can be reused right away and does
+         * not need to be registered, but it may not have been placed remotely yet.
+         * Note addresses start at 0 for sockets, and the virtual address for verbs
+         * @param data
+         * @param size at most inject_size()
+         * @param addr
+         * @param key
+         * @param offset
+         *
+         * @return true on success
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool inject_write(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
+            if (size > limits.inject_size) {
+                DO_LOG(ERROR) << "Too large of a write to inject!";
+                return false;
+            }
+            const char *buf = data.get() + offset;
+            return ERRREPORT(post_inject([&]() { return fi_inject_write(ep, buf, size, 0, addr, key); }));
+        }
+
+        /**
+         * Posts a write from buf with given size to the addr with the given key without waiting for it.
+         * Any number of writes and reads may be outstanding at once, and they may complete in any order.
+         * The buffer cannot be modified until the returned token is done.
+         * Note addresses start at 0 for sockets, and the virtual address for verbs
+         * @param data
+         * @param size
+         * @param addr
+         * @param key
+         * @param offset
+         *
+         * @return completion token; already done with an error if the write could not be posted
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline completion_t async_write(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
+            assert(data.isRegistered());
+
+            auto c = new_token();
+            ssize_t ret = fi_write(ep, data.get() + offset, size, data.getDesc(), 0, addr, key, c.get());
+            bool b = ERRREPORT(ret);
+            if (!b) {
+                c->cancel((int) -ret);
+            }
+            return c;
+        }
+
+        /**
+         * Write from buf with given size to the addr with the given key and notify the other side. Once
+         * the data has landed, the other side gets a write_notice carrying imm from recv_notice, so it
+         * needs neither a separate message nor to poll its memory. Blocks until completion.
+         * Note addresses start at 0 for sockets, and the virtual address for verbs
+         * @param data
+         * @param size
+         * @param addr
+         * @param key
+         * @param imm immediate data; must fit in notice_data_size() bytes (e.g. a region and offset)
+         * @param offset
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void write_notify(buf_t &data, size_t size, uint64_t addr, uint64_t key, uint64_t imm,
+                                 size_t offset = 0) {
+            auto c = async_write_notify(data, size, addr, key, imm, offset);
+            SAFE_CALL(-c->error());
+            DO_LOG(DEBUG3) << "Write " << key << "-" << addr << " with data " << imm << " sent";
+            SAFE_CALL(wait(c));
+        }
+
+        /**
+         * Posts a write_notify without waiting for it. The buffer cannot be modified until the returned
+         * token is done.
+         * @param data
+         * @param size
+         * @param addr
+         * @param key
+         * @param imm immediate data; must fit in notice_data_size() bytes
+         * @param offset
+         *
+         * @return completion token; already done with an error if the write could not be posted
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline completion_t async_write_notify(buf_t &data, size_t size, uint64_t addr, uint64_t key,
+                                               uint64_t imm, size_t offset = 0) {
+            assert(data.isRegistered());
+            assert(limits.cq_data_size >= sizeof(uint64_t) || imm >> (8 * limits.cq_data_size) == 0);
+
+            auto c = new_token();
+            ssize_t ret = fi_writedata(ep, data.get() + offset, size, data.getDesc(), imm, 0, addr, key,
+                                       c.get());
+            bool b = ERRREPORT(ret);
+            if (!b) {
+                c->cancel((int) -ret);
+            }
+            return c;
+        }
+
+        /**
+         * Blocks until a write posted with write_notify by the other side has landed. With shared
+         * resources, notices are delivered to whichever connection polls the shared queue.
+         * @return notice for the write
+         */
+        inline write_notice recv_notice() {
+            SAFE_CALL(rxq.wait_until([this]() { return !notices->empty(); }));
+            write_notice n = notices->front();
+            notices->pop_front();
+            return n;
+        }
+
+        /**
+         * Checks for a write posted with write_notify by the other side without blocking
+         * @param n set to the notice if one arrived
+         * @return true if a notice was returned
+         */
+        inline bool try_recv_notice(write_notice &n) {
+            if (notices->empty()) {
+                bool b = ERRREPORT(rxq.poll());
+                if (!b || notices->empty()) {
+                    return false;
+                }
+            }
+            n = notices->front();
+            notices->pop_front();
+            return true;
+        }
+
+        /**
+         * Bytes of immediate data a write_notify can carry
+         * @return size
+         */
+        [[nodiscard]] inline size_t notice_data_size() const {
+            return limits.cq_data_size;
+        }
+
         /**
          * Read size bytes from the addr with the given key into buf. 
          * @param buf
@@ -729,11 +2039,10 @@ namespace cse498 {
          */
         template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
         inline void read(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
-            assert(data.isRegistered());
-
-            SAFE_CALL(fi_read(ep, data.get() + offset, size, data.getDesc(), 0, addr, key, nullptr));
+            auto c = async_read(data, size, addr, key, offset);
+            SAFE_CALL(-c->error());
             DO_LOG(DEBUG3) << "Read " << key << "-" << addr << " sent";
-            SAFE_CALL(wait_for_completion(tx_cq));
+            SAFE_CALL(wait(c));
         }
 
         /*[[deprecated("Use with unique_buf instead")]]
@@ -755,34 +2064,382 @@ namespace cse498 {
          *
          * @return true on success
          */
-        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
-        inline bool try_read(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
-            assert(data.isRegistered());
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool try_read(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
+            DO_LOG(DEBUG3) << "Read " << key << "-" << addr << " sent";
+            auto c = async_read(data, size, addr, key, offset);
+            if (c->done()) {
+                return false;
+            }
+            return ERRREPORT(wait(c));
+        }
+
+        /*[[deprecated("Use with unique_buf instead")]]
+        inline bool try_read(char *buf, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
+            //SAFE_CALL(fi_read(ep, buf, size, nullptr, 0, addr, key, nullptr));
+            DO_LOG(DEBUG3) << "Read " << key << "-" << addr << " sent";
+            bool b = ERRREPORT(fi_read(ep, buf, size, nullptr, 0, addr, key, nullptr));
+            if (b) {
+                return ERRREPORT(wait_for_completion(tx_cq));
+            }
+            return false;
+        }*/
+
+        /**
+         * Posts a read of size bytes from the addr with the given key into buf without waiting for it.
+         * Any number of writes and reads may be outstanding at once, and they may complete in any order.
+         * The buffer cannot be used until the returned token is done.
+         * @param data
+         * @param size
+         * @param addr
+         * @param key
+         * @param offset
+         *
+         * @return completion token; already done with an error if the read could not be posted
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline completion_t async_read(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
+            assert(data.isRegistered());
+
+            auto c = new_token();
+            ssize_t ret = fi_read(ep, data.get() + offset, size, data.getDesc(), 0, addr, key, c.get());
+            bool b = ERRREPORT(ret);
+            if (!b) {
+                c->cancel((int) -ret);
+            }
+            return c;
+        }
+
+        /**
+         * Checks that the provider can run every remote atomic offered here (fetch_add,
+         * compare_and_swap, atomic_load and atomic_store) on T. Those exit on a provider error, so
+         * check first when T may not be supported.
+         * @return true if all of them are supported
+         */
+        template<typename T>
+        [[nodiscard]] inline bool supports_atomics() {
+            const fi_datatype dt = atomic_datatype<T>::value;
+            size_t count = 0;
+            return fi_fetch_atomicvalid(ep, dt, FI_SUM, &count) == 0 && count > 0 &&
+                   fi_fetch_atomicvalid(ep, dt, FI_ATOMIC_READ, &count) == 0 && count > 0 &&
+                   fi_atomicvalid(ep, dt, FI_ATOMIC_WRITE, &count) == 0 && count > 0 &&
+                   fi_compare_atomicvalid(ep, dt, FI_CSWAP, &count) == 0 && count > 0;
+        }
+
+        /**
+         * Atomically adds value to the remote T at addr with the given key. Blocks until completion.
+         * The remote memory must be registered with FI_REMOTE_READ | FI_REMOTE_WRITE.
+         * Note addresses start at 0 for sockets, and the virtual address for verbs
+         * @param value value to add
+         * @param addr
+         * @param key
+         * @return value before the add
+         */
+        template<typename T>
+        inline T fetch_add(T value, uint64_t addr, uint64_t key) {
+            return fetch_atomic(FI_SUM, value, addr, key);
+        }
+
+        /**
+         * Atomically replaces the remote T at addr with desired if it equals expected. Blocks until
+         * completion.
+         * @param expected value the remote T must have
+         * @param desired value to store
+         * @param addr
+         * @param key
+         * @return value read; the swap happened if it equals expected
+         */
+        template<typename T>
+        inline T compare_and_swap(T expected, T desired, uint64_t addr, uint64_t key) {
+            auto &c = control_buffer();
+            T *scratch = atomic_scratch<T>();
+            scratch[0] = desired;
+            scratch[1] = expected;
+            auto comp = new_token();
+            SAFE_CALL(fi_compare_atomic(ep, &scratch[0], 1, c.getDesc(), &scratch[1], c.getDesc(), &scratch[2],
+                                        c.getDesc(), 0, addr, key, atomic_datatype<T>::value, FI_CSWAP,
+                                        comp.get()));
+            DO_LOG(DEBUG3) << "Compare and swap " << key << "-" << addr << " sent";
+            SAFE_CALL(wait(comp));
+            return scratch[2];
+        }
+
+        /**
+         * Atomically reads the remote T at addr with the given key. Blocks until completion.
+         * @param addr
+         * @param key
+         * @return value read
+         */
+        template<typename T>
+        inline T atomic_load(uint64_t addr, uint64_t key) {
+            return fetch_atomic(FI_ATOMIC_READ, T(), addr, key);
+        }
+
+        /**
+         * Atomically writes value to the remote T at addr with the given key. Blocks until completion.
+         * @param value value to store
+         * @param addr
+         * @param key
+         */
+        template<typename T>
+        inline void atomic_store(T value, uint64_t addr, uint64_t key) {
+            auto &c = control_buffer();
+            T *scratch = atomic_scratch<T>();
+            scratch[0] = value;
+            auto comp = new_token();
+            SAFE_CALL(fi_atomic(ep, &scratch[0], 1, c.getDesc(), 0, addr, key, atomic_datatype<T>::value,
+                                FI_ATOMIC_WRITE, comp.get()));
+            DO_LOG(DEBUG3) << "Atomic store " << key << "-" << addr << " sent";
+            SAFE_CALL(wait(comp));
+        }
+
+        /**
+         * Write segments from one or more registered buffers to one contiguous remote region starting at
+         * addr with the given key. Blocks until completion.
+         * @param segs segments to write, at most the provider's iov_limit
+         * @param addr
+         * @param key
+         */
+        inline void writev(const std::vector<segment> &segs, uint64_t addr, uint64_t key) {
+            auto c = async_writev(segs, addr, key);
+            SAFE_CALL(-c->error());
+            DO_LOG(DEBUG3) << "Write " << key << "-" << addr << " sent";
+            SAFE_CALL(wait(c));
+        }
+
+        /**
+         * Posts a write of several segments to one contiguous remote region without waiting for it.
+         * @param segs segments to write, at most the provider's iov_limit
+         * @param addr
+         * @param key
+         * @return completion token; already done with an error if the write could not be posted
+         */
+        inline completion_t async_writev(const std::vector<segment> &segs, uint64_t addr, uint64_t key) {
+            return post_rmav(true, segs, addr, key);
+        }
+
+        /**
+         * Read one contiguous remote region starting at addr with the given key into segments of one or
+         * more registered buffers. Blocks until completion.
+         * @param segs segments to read into, at most the provider's iov_limit
+         * @param addr
+         * @param key
+         */
+        inline void readv(const std::vector<segment> &segs, uint64_t addr, uint64_t key) {
+            auto c = async_readv(segs, addr, key);
+            SAFE_CALL(-c->error());
+            DO_LOG(DEBUG3) << "Read " << key << "-" << addr << " sent";
+            SAFE_CALL(wait(c));
+        }
+
+        /**
+         * Posts a read of one contiguous remote region into several segments without waiting for it.
+         * @param segs segments to read into, at most the provider's iov_limit
+         * @param addr
+         * @param key
+         * @return completion token; already done with an error if the read could not be posted
+         */
+        inline completion_t async_readv(const std::vector<segment> &segs, uint64_t addr, uint64_t key) {
+            return post_rmav(false, segs, addr, key);
+        }
+
+        /**
+         * Checks once for completions and returns if the operation has finished.
+         * @param c completion token from an async call on this connection
+         * @return true if the operation is done
+         */
+        inline bool test(const completion_t &c) {
+            if (!c->done()) {
+                ERRREPORT(txq.poll());
+            }
+            return c->done();
+        }
+
+        /**
+         * Blocks until the operation has finished.
+         * @param c completion token from an async call on this connection
+         * @return 0 on success and a negative fi_errno value on failure
+         */
+        inline int wait(const completion_t &c) {
+            int ret = txq.wait_until([&c]() { return c->done(); });
+            if (ret < 0) {
+                return ret;
+            }
+            return -c->error();
+        }
+
+        /**
+         * Blocks until a receive posted with async_recv has finished.
+         * @param c completion token from async_recv on this connection
+         * @return 0 on success and a negative fi_errno value on failure
+         */
+        inline int wait_recv(const completion_t &c) {
+            int ret = rxq.wait_until([&c]() { return c->done(); });
+            if (ret < 0) {
+                return ret;
+            }
+            return -c->error();
+        }
+
+        /**
+         * Makes connections accepted from now on share one domain and one pair of completion queues
+         * with this listener instead of each opening their own. Memory registered on the listener can
+         * then be used on every accepted connection, and polling any of them retires completions for
+         * all of them (each connection still only sees its own). Since they share queues, those
+         * connections must be driven from one thread. Call before accepting.
+         * @param cqSize size of each shared completion queue, 0 for the provider default
+         */
+        inline void share_resources(size_t cqSize = 0) {
+            assert(is_server && !shared && !domain);
+            shared = std::make_shared<shared_resources>();
+            DO_LOG(TRACE) << "Creating shared domain";
+            SAFE_CALL(fi_domain(fab, info, &domain, nullptr));
+            shared->domain = domain;
+            shared->wait_obj = open_cqs(cqSize, cqSize);
+            shared->tx_cq = tx_cq;
+            shared->rx_cq = rx_cq;
+            tx_cq = nullptr;
+            rx_cq = nullptr;
+        }
+
+        /**
+         * Returns if this connection shares its domain and completion queues with other connections
+         * @return true if shared
+         */
+        [[nodiscard]] inline bool is_shared() const {
+            return (bool) shared;
+        }
+
+        /**
+         * Sets how every blocking call on this connection waits for completions. The default spins;
+         * wait_policy::hybrid spins for a while and then sleeps, which suits mostly idle connections.
+         * Connections returned by accept inherit the policy.
+         * @param p policy
+         */
+        inline void set_wait_policy(wait_policy p) {
+            policy = p;
+            txq.set_wait_policy(p);
+            rxq.set_wait_policy(p);
+        }
+
+        /**
+         * File descriptors of the transmit and receive completion queues, which become readable when
+         * completions arrive. Call try_wait before sleeping on them.
+         * @return {tx fd, rx fd}, -1 where the provider has no fd wait object
+         */
+        [[nodiscard]] inline std::pair<int, int> wait_fds() const {
+            return {txq.fd(), rxq.fd()};
+        }
+
+        /**
+         * Checks if it is safe to sleep on the fds from wait_fds. If this returns false there may
+         * already be completions to read, so poll the connection (e.g. try_recv or test) instead.
+         * @return true if it is safe to sleep
+         */
+        inline bool try_wait() {
+            fid *fids[2] = {&tx_cq->fid, &rx_cq->fid};
+            return fi_trywait(fab, fids, 2) == FI_SUCCESS;
+        }
 
-            //SAFE_CALL(fi_read(ep, buf, size, nullptr, 0, addr, key, nullptr));
-            DO_LOG(DEBUG3) << "Read " << key << "-" << addr << " sent";
-            bool b = ERRREPORT(fi_read(ep, data.get() + offset, size, data.getDesc(), 0, addr, key, nullptr));
-            if (b) {
-                return ERRREPORT(wait_for_completion(tx_cq));
-            }
-            return false;
+        /**
+         * Whether the endpoint was opened with FI_THREAD_SAFE, see the constructor
+         * @return true if several threads may post to it at once
+         */
+        [[nodiscard]] inline bool is_thread_safe() const {
+            return thread_safe;
         }
 
-        /*[[deprecated("Use with unique_buf instead")]]
-        inline bool try_read(char *buf, size_t size, uint64_t addr, uint64_t key, size_t offset = 0) {
-            //SAFE_CALL(fi_read(ep, buf, size, nullptr, 0, addr, key, nullptr));
-            DO_LOG(DEBUG3) << "Read " << key << "-" << addr << " sent";
-            bool b = ERRREPORT(fi_read(ep, buf, size, nullptr, 0, addr, key, nullptr));
-            if (b) {
-                return ERRREPORT(wait_for_completion(tx_cq));
-            }
-            return false;
-        }*/
+        /**
+         * Domain memory is registered on. Connections with the same domain can use each other's
+         * registrations.
+         * @return domain, null until the connection has one
+         */
+        [[nodiscard]] inline fid_domain *get_domain() const {
+            return domain;
+        }
 
     private:
         bool is_server;
         bool failed = false;
-        const size_t MAX_MSG_SIZE = 4096;
+        bool thread_safe = false;
+
+        // Limits reported by the provider for the active endpoint
+        struct {
+            size_t max_msg_size = 4096;
+            size_t inject_size = 0;
+            size_t tx_size = 1;
+            size_t rx_size = 1;
+            size_t iov_limit = 1;
+            bool virt_addr = false;
+            int numa_node = -1;
+            size_t cq_data_size = 0;
+        } limits;
+
+        // Header of every message sent by send_auto/recv_auto
+        struct rndv_header {
+            uint64_t type;
+            uint64_t size;
+            uint64_t addr;
+            uint64_t key;
+        };
+
+        enum : uint64_t {
+            EAGER_MSG = 1,
+            RNDV_MSG = 2,
+            RNDV_FIN = 3
+        };
+
+        size_t eager_max = 0;
+
+        wait_policy policy;
+        // Keeps fab open while this connection or any connection accepted from it still uses it
+        std::shared_ptr<fid_fabric> fabric_ref;
+
+        std::shared_ptr<shared_resources> shared;
+        // Provider discovery result, fabric and (for clients) domain this connection was created against
+        std::shared_ptr<fabric_entry> context;
+        // Writes posted with write_notify by the other side that have not been handed out
+        std::deque<write_notice> *notices = new std::deque<write_notice>();
+        // Tokens handed out for operations on this endpoint, so teardown can finish the ones in flight
+        struct token_list {
+            // ThreadContexts may post token based RMA from several threads
+            std::mutex lock;
+            std::vector<std::weak_ptr<Completion>> live;
+            // Size after the last sweep of finished tokens
+            size_t pruned = 0;
+        };
+        token_list *tokens = new token_list();
+
+        // Credits for the other side's receive ring, see enable_flow_control. Totals only grow; a
+        // credit is a slot of the other side's ring that is known to be free.
+        struct flow_state {
+            // The other side writes its granted total here
+            unique_buf granted{sizeof(uint64_t)};
+            uint64_t peerAddr = 0;
+            uint64_t peerKey = 0;
+            // Highest total granted by the other side
+            uint64_t peerGranted = 0;
+            // Messages sent to the other side
+            uint64_t sent = 0;
+            // Slots in our ring and how many were given back since
+            uint64_t slots = 0;
+            uint64_t released = 0;
+            // Granted total the other side has been told about
+            uint64_t announced = 0;
+        };
+
+        flow_state *flow = nullptr;
+
+        // Message waiting for room in the send window or for credits
+        struct pending_send {
+            segment segs[MAX_SEGMENTS];
+            size_t count;
+        };
+
+        std::deque<pending_send> *backlog = new std::deque<pending_send>();
+        // Contexts for sends and receives posted without a token
+        CompletionCounter *tx_tag = new CompletionCounter();
+        CompletionCounter *rx_tag = new CompletionCounter();
         uint64_t msg_sends = 0;
 
         // These need to be closed by fabric
@@ -793,30 +2450,39 @@ namespace cse498 {
         fid_eq *eq;
         fid_ep *ep;
         fid_cq *rx_cq, *tx_cq;
+        CompletionQueue rxq, txq;
         std::map<uint64_t, fid_mr *> *mrs = new std::map<uint64_t, fid_mr *>();
+        MRCache *cache = nullptr;
+        RecvRing *ring = nullptr;
+        unique_buf *ctrl = nullptr;
+        fid_mr *ctrl_mr = nullptr;
 
-        // Based on connectionless.hh, but not identical. This returns the value from fi_cq_read. 
-        inline int wait_for_completion(struct fid_cq *cq) {
-            fi_cq_msg_entry entry = {};
-            int ret;
-            while (1) {
-                ret = fi_cq_read(cq, &entry,
-                                 1); // TODO an rma write will likely cause the rx_cq to receive something, so I have to be careful about that.
-                if (ret > 0) {
-                    DO_LOG(TRACE) << "Entry flags " << entry.flags;
-                    DO_LOG(TRACE) << "Entry rma " << (entry.flags & FI_RMA);
-                    DO_LOG(TRACE) << "Entry len " << entry.len;
-                    DO_LOG(TRACE) << "Entry ops " << entry.op_context;
-                    return ret;
-                }
-                if (ret != -FI_EAGAIN) {
-                    // New error on queue
-                    struct fi_cq_err_entry err_entry = {};
-                    fi_cq_readerr(cq, &err_entry, 0);
-                    DO_LOG(ERROR) << fi_cq_strerror(cq, err_entry.prov_errno, err_entry.err_data, nullptr, 0);
-                    return ret;
+        /**
+         * Registration cache for this connection's domain, created on first use. Shared with every
+         * connection on a shared domain or created from the same FabricContext entry.
+         **/
+        inline MRCache &mr_cache() {
+            if (!own_domain()) {
+                return context->get_cache();
+            }
+            if (shared) {
+                if (!shared->cache) {
+                    shared->cache.reset(new MRCache(shared->domain));
                 }
+                return *shared->cache;
+            }
+            if (!cache) {
+                cache = new MRCache(domain);
             }
+            return *cache;
+        }
+
+        /**
+         * Whether the domain is this connection's to close. Clients created from a FabricContext use
+         * its domain; servers always open their own.
+         **/
+        [[nodiscard]] inline bool own_domain() const {
+            return !context || is_server;
         }
 
         inline fid_mr *create_mr(char *buf, size_t size, uint64_t access, uint64_t &key) {
@@ -840,6 +2506,21 @@ namespace cse498 {
             hints->ep_attr->type = FI_EP_MSG;
             hints->ep_attr->protocol = protocol;
             hints->domain_attr->mr_mode = FI_MR_LOCAL | FI_MR_ALLOCATED | FI_MR_PROV_KEY | FI_MR_VIRT_ADDR;
+            if (thread_safe) {
+                // Lets ThreadContexts on several threads post to the endpoint without a lock around it
+                hints->domain_attr->threading = FI_THREAD_SAFE;
+            }
+        }
+
+        /**
+         * Opens the fabric described by info, owned by this connection and any connection accepted
+         * from it. Requires info to be set.
+         **/
+        inline void open_fabric() {
+            SAFE_CALL(fi_fabric(info->fabric_attr, &fab, nullptr));
+            fabric_ref = std::shared_ptr<fid_fabric>(fab, [](fid_fabric *f) {
+                ERRCHK(fi_close(&f->fid));
+            });
         }
 
         /**
@@ -861,28 +2542,424 @@ namespace cse498 {
          * Requires domain, info, ep to be set. 
          **/
         inline void setup_cqs() {
-            fi_cq_attr cq_attr = {};
-            cq_attr.wait_obj = FI_WAIT_NONE;
-            cq_attr.size = info->tx_attr->size;
-            cq_attr.format = FI_CQ_FORMAT_MSG;
-            DO_LOG(TRACE) << "Creating tx completion queue";
-            SAFE_CALL(fi_cq_open(domain, &cq_attr, &tx_cq, NULL));
-            cq_attr.size = info->rx_attr->size;
-            DO_LOG(TRACE) << "Creating rx completion queue";
-            SAFE_CALL(fi_cq_open(domain, &cq_attr, &rx_cq, NULL));
+            fi_wait_obj waitObj;
+            if (shared) {
+                tx_cq = shared->tx_cq;
+                rx_cq = shared->rx_cq;
+                waitObj = shared->wait_obj;
+            } else {
+                waitObj = open_cqs(info->tx_attr->size, info->rx_attr->size);
+            }
             DO_LOG(TRACE) << "Binding TX CQ to EP";
             SAFE_CALL(fi_ep_bind(ep, &tx_cq->fid, FI_TRANSMIT));
             DO_LOG(TRACE) << "Binding RX CQ to EP";
             SAFE_CALL(fi_ep_bind(ep, &rx_cq->fid, FI_RECV));
+            bool waitable = waitObj == FI_WAIT_FD;
+            // The data format carries the immediate data of writes posted with write_notify
+            txq = CompletionQueue(tx_cq, FI_CQ_FORMAT_DATA, DEFAULT_CQ_BATCH, waitable);
+            rxq = CompletionQueue(rx_cq, FI_CQ_FORMAT_DATA, DEFAULT_CQ_BATCH, waitable);
+            watch_notices();
+            txq.set_wait_policy(policy);
+            rxq.set_wait_policy(policy);
+
+            limits.max_msg_size = info->ep_attr->max_msg_size;
+            limits.inject_size = info->tx_attr->inject_size;
+            limits.tx_size = info->tx_attr->size;
+            limits.rx_size = info->rx_attr->size;
+            limits.iov_limit = std::min(info->tx_attr->iov_limit, MAX_SEGMENTS);
+            limits.virt_addr = (info->domain_attr->mr_mode & FI_MR_VIRT_ADDR) != 0;
+            limits.numa_node = numa_node_of(info);
+            limits.cq_data_size = info->domain_attr->cq_data_size;
+        }
+
+        /**
+         * Makes rxq queue notices for remote writes carrying data on this connection. Called again
+         * whenever rxq is handed to another connection.
+         **/
+        inline void watch_notices() {
+            auto *n = notices;
+            rxq.on(FI_REMOTE_CQ_DATA, [n](const fi_cq_tagged_entry &entry) {
+                n->push_back({entry.data, entry.len});
+            });
+        }
+
+        /**
+         * Opens tx_cq and rx_cq on domain
+         * @return wait object the queues were opened with
+         **/
+        inline fi_wait_obj open_cqs(size_t txSize, size_t rxSize) {
+            fi_cq_attr cq_attr = {};
+            // An fd wait object lets waits sleep and lets the queues go into epoll; reading
+            // the queues without waiting works the same either way
+            cq_attr.wait_obj = FI_WAIT_FD;
+            cq_attr.size = txSize;
+            cq_attr.format = FI_CQ_FORMAT_DATA;
+            DO_LOG(TRACE) << "Creating tx completion queue";
+            int ret = fi_cq_open(domain, &cq_attr, &tx_cq, NULL);
+            if (ret != 0) {
+                DO_LOG(DEBUG) << "No fd wait object available, waits will only spin";
+                cq_attr.wait_obj = FI_WAIT_NONE;
+                SAFE_CALL(fi_cq_open(domain, &cq_attr, &tx_cq, NULL));
+            }
+            cq_attr.size = rxSize;
+            DO_LOG(TRACE) << "Creating rx completion queue";
+            SAFE_CALL(fi_cq_open(domain, &cq_attr, &rx_cq, NULL));
+            return cq_attr.wait_obj;
+        }
+
+        /**
+         * Waits for one send posted without a token
+         * @return 0 on success, or a negative fi_errno value
+         **/
+        inline int wait_tx() {
+            int ret = txq.wait_until([this]() { return tx_tag->ready() > 0; });
+            if (ret < 0) {
+                return ret;
+            }
+            return tx_tag->take();
+        }
+
+        /**
+         * Waits for one receive posted without a token
+         * @return 0 on success, or a negative fi_errno value
+         **/
+        inline int wait_rx() {
+            int ret = rxq.wait_until([this]() { return rx_tag->ready() > 0; });
+            if (ret < 0) {
+                return ret;
+            }
+            return rx_tag->take();
+        }
+
+        /**
+         * Creates a token for an operation about to be posted on this endpoint
+         * @return token, already marked as posted
+         **/
+        inline completion_t new_token() {
+            auto c = std::make_shared<Completion>();
+            c->posted(c);
+            std::lock_guard<std::mutex> g(tokens->lock);
+            auto &live = tokens->live;
+            // Forget tokens that finished, so the list only grows with what is in flight
+            if (live.size() >= std::max<size_t>(64, 2 * tokens->pruned)) {
+                live.erase(std::remove_if(live.begin(), live.end(), [](const std::weak_ptr<Completion> &w) {
+                    auto t = w.lock();
+                    return !t || t->done();
+                }), live.end());
+                tokens->pruned = live.size();
+            }
+            live.push_back(c);
+            return c;
+        }
+
+        /**
+         * Fails the tokens of operations still in flight with FI_ECANCELED, releasing the reference
+         * each keeps to itself. Only safe once no completion queue can hand them back.
+         **/
+        inline void cancel_tokens() {
+            if (!tokens) {
+                return;
+            }
+            for (auto &w : tokens->live) {
+                auto c = w.lock();
+                if (c && !c->done()) {
+                    c->cancel(FI_ECANCELED);
+                }
+            }
+            tokens->live.clear();
+        }
+
+        /**
+         * Posts a scatter-gather write or read against one contiguous remote region
+         **/
+        inline completion_t post_rmav(bool isWrite, const std::vector<segment> &segs, uint64_t addr, uint64_t key) {
+            iovec iov[MAX_SEGMENTS];
+            void *desc[MAX_SEGMENTS];
+            auto c = new_token();
+
+            ssize_t total = to_iov(segs, limits.iov_limit, iov, desc);
+            if (total < 0) {
+                DO_LOG(ERROR) << "Cannot post " << segs.size() << " segments, the limit is " << limits.iov_limit;
+                c->cancel((int) -total);
+                return c;
+            }
+            fi_rma_iov rma_iov = {};
+            rma_iov.addr = addr;
+            rma_iov.len = (size_t) total;
+            rma_iov.key = key;
+
+            fi_msg_rma msg = {};
+            msg.msg_iov = iov;
+            msg.desc = desc;
+            msg.iov_count = segs.size();
+            msg.rma_iov = &rma_iov;
+            msg.rma_iov_count = 1;
+            msg.context = c.get();
+
+            ssize_t ret = isWrite ? fi_writemsg(ep, &msg, 0) : fi_readmsg(ep, &msg, 0);
+            bool b = ERRREPORT(ret);
+            if (!b) {
+                c->cancel((int) -ret);
+            }
+            return c;
+        }
+
+        /**
+         * Returns the control buffer, allocating and registering it on first use. Used for small
+         * protocol messages that cannot live in a caller's buffer.
+         **/
+        inline unique_buf &control_buffer() {
+            if (!ctrl) {
+                ctrl = new unique_buf(CONTROL_BUF_SIZE + ATOMIC_SCRATCH_SIZE);
+                // Connections on a shared domain each need their own key
+                uint64_t key = mr_cache().reserve_key();
+                ctrl_mr = create_mr(ctrl->get(), ctrl->size(), FI_SEND | FI_RECV | FI_READ | FI_WRITE, key);
+                ctrl->registerMemoryCallback(key, fi_mr_desc(ctrl_mr));
+            }
+            return *ctrl;
+        }
+
+        /**
+         * Operand, compare and result slots for remote atomics, past the end of the control buffer
+         **/
+        template<typename T>
+        inline T *atomic_scratch() {
+            static_assert(3 * sizeof(T) <= ATOMIC_SCRATCH_SIZE, "Type too large for remote atomics");
+            return (T *) (control_buffer().get() + CONTROL_BUF_SIZE);
+        }
+
+        template<typename T>
+        inline T fetch_atomic(fi_op op, T operand, uint64_t addr, uint64_t key) {
+            auto &c = control_buffer();
+            T *scratch = atomic_scratch<T>();
+            scratch[0] = operand;
+            auto comp = new_token();
+            SAFE_CALL(fi_fetch_atomic(ep, &scratch[0], 1, c.getDesc(), &scratch[2], c.getDesc(), 0, addr, key,
+                                      atomic_datatype<T>::value, op, comp.get()));
+            DO_LOG(DEBUG3) << "Atomic " << op << " " << key << "-" << addr << " sent";
+            SAFE_CALL(wait(comp));
+            return scratch[2];
+        }
+
+        /**
+         * Copies a message out of the receive ring and gives its slot back. Like a posted receive, a
+         * message longer than max_len is truncated to max_len bytes and reported as -FI_ETRUNC.
+         * @param data buffer to copy into
+         * @param v view from recv_view or try_recv_view
+         * @param max_len space available in data after offset
+         * @param offset offset into data
+         * @return 0 on success, -FI_ETRUNC if the message did not fit
+         **/
+        template<typename buf_t>
+        inline int take_view(buf_t &data, const msg_view &v, size_t max_len, size_t offset = 0) {
+            int ret = 0;
+            size_t len = v.size;
+            if (len > max_len) {
+                DO_LOG(ERROR) << "Message of " << len << " bytes does not fit in " << max_len << " bytes";
+                len = max_len;
+                ret = -FI_ETRUNC;
+            }
+            data.cpyTo(v.data, len, offset);
+            release(v);
+            return ret;
+        }
+
+        /**
+         * Receives the next message into the control buffer
+         * @return true on success
+         **/
+        inline bool recv_control(size_t max_len) {
+            auto &c = control_buffer();
+            if (ring) {
+                msg_view v;
+                while (!try_recv_view(v)) {
+                    if (ring->take_error() != 0) {
+                        return false;
+                    }
+                }
+                return ERRREPORT(take_view(c, v, max_len));
+            }
+            bool b = ERRREPORT(fi_recv(ep, c.get(), max_len, c.getDesc(), 0, rx_tag));
+            if (b) {
+                return ERRREPORT(wait_rx());
+            }
+            return false;
+        }
+
+        /**
+         * Posts a send, or queues it if there is no room for it yet
+         * @return true on success
+         **/
+        inline bool post_send(const char *buf, size_t size, void *desc) {
+            if (size <= limits.inject_size) {
+                return ERRREPORT(inject_msg(buf, size));
+            }
+            segment s = {(char *) buf, size, desc};
+            return ERRREPORT(submit(&s, 1));
+        }
+
+        /**
+         * Room to post one more message right now: the send window is not full and, under flow
+         * control, the other side has a free slot
+         **/
+        inline bool can_post() {
+            return msg_sends - tx_tag->ready() < limits.tx_size && (!flow || credits() > 0);
+        }
+
+        /**
+         * Posts a message made of segments, piggybacking our granted total under flow control
+         * @return 0 on success, or a negative fi_errno value
+         **/
+        inline ssize_t post_msg(const segment *segs, size_t count) {
+            const bool piggyback = flow && limits.cq_data_size >= sizeof(uint32_t);
+            ssize_t ret;
+            uint64_t total = 0;
+            if (count == 1 && !piggyback) {
+                ret = fi_send(ep, segs[0].addr, segs[0].len, segs[0].desc, 0, tx_tag);
+            } else {
+                iovec iov[MAX_SEGMENTS];
+                void *desc[MAX_SEGMENTS];
+                for (size_t i = 0; i < count; i++) {
+                    iov[i].iov_base = segs[i].addr;
+                    iov[i].iov_len = segs[i].len;
+                    desc[i] = segs[i].desc;
+                }
+                fi_msg msg = {};
+                msg.msg_iov = iov;
+                msg.desc = desc;
+                msg.iov_count = count;
+                msg.context = tx_tag;
+                if (piggyback) {
+                    total = flow->slots + flow->released;
+                    msg.data = total;
+                }
+                ret = fi_sendmsg(ep, &msg, piggyback ? FI_REMOTE_CQ_DATA : 0);
+            }
+            if (ret == 0) {
+                ++msg_sends;
+                if (flow) {
+                    ++flow->sent;
+                    if (piggyback) {
+                        flow->announced = total;
+                    }
+                }
+            }
+            return ret;
+        }
+
+        /**
+         * Posts a message, or queues it behind earlier ones if it cannot be posted yet
+         * @return 0 on success, or a negative fi_errno value
+         **/
+        inline ssize_t submit(const segment *segs, size_t count) {
+            assert(count > 0 && count <= MAX_SEGMENTS);
+            if (backlog->empty() && can_post()) {
+                ssize_t ret = post_msg(segs, count);
+                if (ret != -FI_EAGAIN) {
+                    return ret;
+                }
+            }
+            DO_LOG(TRACE) << "Queueing message behind " << backlog->size() << " other(s)";
+            pending_send p;
+            std::copy(segs, segs + count, p.segs);
+            p.count = count;
+            backlog->push_back(p);
+            return 0;
+        }
+
+        /**
+         * Posts queued messages in order until one does not fit
+         * @return 0 on success, or a negative fi_errno value
+         **/
+        inline ssize_t drain_backlog() {
+            while (!backlog->empty() && can_post()) {
+                auto &p = backlog->front();
+                ssize_t ret = post_msg(p.segs, p.count);
+                if (ret == -FI_EAGAIN) {
+                    return 0;
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+                backlog->pop_front();
+            }
+            return 0;
+        }
+
+        /**
+         * Injects a message. Waits for queued messages first so it cannot overtake them, and under
+         * flow control for a credit too.
+         * @return 0 on success, or a negative fi_errno value
+         **/
+        inline ssize_t inject_msg(const char *buf, size_t size) {
+            while (!backlog->empty() || (flow && credits() == 0)) {
+                ssize_t ret = txq.poll();
+                // Credits come back on the receive side
+                if (ret >= 0 && flow) {
+                    ret = rxq.poll();
+                }
+                if (ret >= 0) {
+                    ret = drain_backlog();
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            if (!flow) {
+                return post_inject([&]() { return fi_inject(ep, buf, size, 0); });
+            }
+            const bool piggyback = limits.cq_data_size >= sizeof(uint32_t);
+            uint64_t total = flow->slots + flow->released;
+            ssize_t ret = post_inject([&]() {
+                return piggyback ? fi_injectdata(ep, buf, size, total, 0) : fi_inject(ep, buf, size, 0);
+            });
+            if (ret == 0) {
+                ++flow->sent;
+                if (piggyback) {
+                    flow->announced = total;
+                }
+            }
+            return ret;
+        }
+
+        /**
+         * Tells the other side about every slot given back so far with a write into its credit word
+         **/
+        inline void announce() {
+            uint64_t total = flow->slots + flow->released;
+            // The atomic scratch past the control buffer is free outside of remote atomics
+            auto &c = control_buffer();
+            memcpy(c.get() + CONTROL_BUF_SIZE, &total, sizeof(total));
+            write(c, sizeof(total), flow->peerAddr, flow->peerKey, CONTROL_BUF_SIZE);
+            flow->announced = total;
+        }
+
+        /**
+         * Posts an inject, driving the transmit queue while the provider has no room for it
+         * @return 0 on success, or a negative fi_errno value
+         **/
+        template<typename post_t>
+        inline ssize_t post_inject(post_t post) {
+            while (true) {
+                ssize_t ret = post();
+                if (ret != -FI_EAGAIN) {
+                    return ret;
+                }
+                int polled = txq.poll();
+                if (polled < 0) {
+                    return polled;
+                }
+            }
         }
 
         /**
          * Performs a blocking read of the event queue until an FI_CONNECTED event is triggered.
          *
+         * @param peerData set to the private data the server accepted with if not null
          * @return true on success
          **/
-        inline bool wait_for_eq_connected() {
-            struct fi_eq_cm_entry entry = {};
+        inline bool wait_for_eq_connected(std::vector<char> *peerData = nullptr) {
+            cm_event entry = {};
             uint32_t event = 0;
             DO_LOG(TRACE) << "Reading eq for FI_CONNECTED event";
             ssize_t addr_len = fi_eq_sread(eq, &event, &entry, sizeof(entry), -1, 0);
@@ -896,10 +2973,93 @@ namespace cse498 {
                 DO_LOG(ERROR) << "Not a connected event";
                 return false;
             }
+            copy_cm_data(entry, addr_len, peerData);
             DO_LOG(DEBUG) << "Connected";
             return true;
         }
 
+        /**
+         * Connection management event with room for the private data attached to it
+         */
+        struct cm_event {
+            alignas(fi_eq_cm_entry) char raw[sizeof(fi_eq_cm_entry) + MAX_CM_DATA_SIZE];
+
+            inline fi_eq_cm_entry *cm() {
+                return reinterpret_cast<fi_eq_cm_entry *>(raw);
+            }
+        };
+
+        static inline void copy_cm_data(const cm_event &entry, ssize_t read, std::vector<char> *out) {
+            if (!out) {
+                return;
+            }
+            size_t len = read > (ssize_t) sizeof(fi_eq_cm_entry) ? read - sizeof(fi_eq_cm_entry) : 0;
+            const char *data = entry.raw + sizeof(fi_eq_cm_entry);
+            out->assign(data, data + std::min(len, MAX_CM_DATA_SIZE));
+        }
+
+        /**
+         * Checks that len bytes of private data fit in what the provider carries with a connection
+         * request or accept (cm_data_size), logging an error if not
+         * @return true if it fits
+         */
+        inline bool check_cm_data(size_t len) const {
+            size_t max = cm_data_size();
+            if (len > max) {
+                DO_LOG(ERROR) << "Private data of " << len << " bytes does not fit the " << max
+                              << " bytes the provider carries";
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Same as check_cm_data for an encoded table of count regions, reporting how many would fit
+         * @return true if it fits
+         */
+        inline bool check_regions(size_t count, size_t len) const {
+            size_t max = cm_data_size();
+            if (len > max) {
+                size_t fits = max > sizeof(uint64_t) ? (max - sizeof(uint64_t)) / sizeof(mr_desc) : 0;
+                DO_LOG(ERROR) << "A table of " << count << " regions needs " << len << " bytes of private data, but the "
+                              << "provider carries " << max << " (at most " << fits << " regions)";
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Lays out a region table as private data: a count followed by the descriptors
+         */
+        static inline std::vector<char> encode_regions(const std::vector<mr_desc> &regions) {
+            uint64_t count = regions.size();
+            std::vector<char> out(sizeof(count) + count * sizeof(mr_desc));
+            memcpy(out.data(), &count, sizeof(count));
+            if (count > 0) {
+                memcpy(out.data() + sizeof(count), regions.data(), count * sizeof(mr_desc));
+            }
+            return out;
+        }
+
+        static inline bool decode_regions(const std::vector<char> &in, std::vector<mr_desc> &regions) {
+            regions.clear();
+            uint64_t count = 0;
+            if (in.size() < sizeof(count)) {
+                // The other side sent no table
+                return true;
+            }
+            memcpy(&count, in.data(), sizeof(count));
+            if (count > (in.size() - sizeof(count)) / sizeof(mr_desc)) {
+                DO_LOG(ERROR) << "Region table of " << count << " entries does not fit the private data";
+                return false;
+            }
+            regions.resize(count);
+            if (count > 0) {
+                memcpy(regions.data(), in.data() + sizeof(count), count * sizeof(mr_desc));
+            }
+            return true;
+        }
+
         /**
          * Creates the domain, endpoint, counters, binds the event queue, and enables the ep.
          *
@@ -908,10 +3068,15 @@ namespace cse498 {
          * @return true on success
          **/
         inline bool try_setup_active_ep() {
-            DO_LOG(TRACE) << "Creating domain";
-            int ret = ERRREPORT(fi_domain(fab, info, &domain, nullptr));
-            if (ret < 0) {
-                return false;
+            int ret;
+            if (shared) {
+                domain = shared->domain;
+            } else {
+                DO_LOG(TRACE) << "Creating domain";
+                ret = ERRREPORT(fi_domain(fab, info, &domain, nullptr));
+                if (ret < 0) {
+                    return false;
+                }
             }
 
             DO_LOG(TRACE) << "Creating active endpoint";
@@ -938,13 +3103,16 @@ namespace cse498 {
         }
 
         /**
-         * Creates the domain, endpoint, counters, binds the event queue, and enables the ep.
+         * Creates the domain (unless one is already set), endpoint, counters, binds the event queue,
+         * and enables the ep.
          *
          * Requires fab, info to be set.
          **/
         inline void setup_active_ep() {
-            DO_LOG(TRACE) << "Creating domain";
-            SAFE_CALL(fi_domain(fab, info, &domain, nullptr));
+            if (!domain) {
+                DO_LOG(TRACE) << "Creating domain";
+                SAFE_CALL(fi_domain(fab, info, &domain, nullptr));
+            }
 
             DO_LOG(TRACE) << "Creating active endpoint";
             SAFE_CALL(fi_endpoint(domain, info, &ep, nullptr));
@@ -972,6 +3140,92 @@ namespace cse498 {
     };
 
 
+    /**
+     * Peer for connect_all
+     */
+    struct peer_addr {
+        /**
+         * Address of the peer
+         */
+        std::string addr;
+        /**
+         * Port the peer listens on
+         */
+        int port;
+    };
+
+    /**
+     * Connections established by connect_all and the peers it could not reach
+     */
+    struct connect_result {
+        /**
+         * Established connections, with the index of their peer
+         */
+        std::vector<std::pair<size_t, Connection>> connected;
+        /**
+         * Index of every peer that could not be reached
+         */
+        std::vector<size_t> failed;
+    };
+
+    /**
+     * Connects to many peers at once. Every connection request is sent before any answer is waited
+     * for, and the event queues of all of them are polled together, so bringing up N connections
+     * takes about as long as the slowest handshake instead of N handshakes in a row.
+     *
+     * Peers that refuse (e.g. because they are not listening yet) end up in failed; pass them to
+     * connect_all again to retry.
+     *
+     * @param peers peers to connect to
+     * @param provider provider type to use
+     * @param timeout milliseconds to wait for the handshakes, or -1 to wait until every one finishes
+     * @return established connections and the peers that failed
+     */
+    inline connect_result connect_all(const std::vector<peer_addr> &peers, ProviderType provider = Sockets,
+                                      int timeout = -1) {
+        connect_result result;
+        std::vector<std::pair<size_t, Connection>> pending;
+        pending.reserve(peers.size());
+        for (size_t i = 0; i < peers.size(); i++) {
+            Connection c(peers[i].addr.c_str(), false, peers[i].port, provider);
+            if (c.start_connect()) {
+                pending.emplace_back(i, std::move(c));
+            } else {
+                result.failed.push_back(i);
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        while (!pending.empty()) {
+            for (size_t i = 0; i < pending.size();) {
+                int ret = pending[i].second.poll_connect();
+                if (ret == -FI_EAGAIN) {
+                    i++;
+                    continue;
+                }
+                if (ret == 0) {
+                    result.connected.push_back(std::move(pending[i]));
+                } else {
+                    result.failed.push_back(pending[i].first);
+                }
+                // Order does not matter, so the last pending connection takes this slot
+                if (i + 1 < pending.size()) {
+                    std::swap(pending[i], pending.back());
+                }
+                pending.pop_back();
+            }
+            if (timeout >= 0 && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(timeout)) {
+                DO_LOG(DEBUG) << pending.size() << " connection(s) timed out";
+                for (auto &p : pending) {
+                    result.failed.push_back(p.first);
+                }
+                break;
+            }
+            std::this_thread::yield();
+        }
+        return result;
+    }
+
     /*
      * Performs best effort broadcast
      * @param clients clients to send to
@@ -0,0 +1,381 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_CONNECTION_POOL_HH
+#define NETWORKLAYER_CONNECTION_POOL_HH
+
+#include "connection.hh"
+#include "fabric_context.hh"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+
+namespace cse498 {
+
+    /**
+     * Times a pool tries to connect before giving up on a new connection
+     */
+    const int POOL_CONNECT_ATTEMPTS = 3;
+
+    /**
+     * Settings of a ConnectionPool, shared by every backend it connects to
+     */
+    struct pool_options {
+        /**
+         * Idle connections kept ready for each backend; refilled in the background
+         */
+        size_t min = 1;
+        /**
+         * Most connections, leased or idle, open to each backend
+         */
+        size_t max = 8;
+        /**
+         * Size of the buffer registered with every connection, 0 for none
+         */
+        size_t bufSize = 0;
+        /**
+         * Access the buffer is registered with
+         */
+        uint64_t bufAccess = FI_SEND | FI_RECV;
+    };
+
+    /**
+     * Connection held by a ConnectionPool, with the buffer registered on it
+     */
+    struct pooled_connection {
+        pooled_connection(FabricContext &ctx, const std::string &addr, int port, ProviderType provider,
+                          size_t bufSize) : conn(ctx, addr.c_str(), false, port, provider), buf(bufSize) {}
+
+        /**
+         * Connected connection
+         */
+        Connection conn;
+        /**
+         * Buffer registered on conn (empty if the pool has no buffers)
+         */
+        unique_buf buf;
+    };
+
+    class ConnectionPool;
+
+    /**
+     * A connection leased from a ConnectionPool. Goes back to the pool when destroyed.
+     */
+    class Lease {
+    public:
+        Lease() = default;
+
+        Lease(const Lease &) = delete;
+
+        Lease &operator=(const Lease &) = delete;
+
+        Lease(Lease &&other) noexcept : pool(other.pool), key(std::move(other.key)), c(std::move(other.c)) {
+            other.pool = nullptr;
+        }
+
+        Lease &operator=(Lease &&other) noexcept;
+
+        ~Lease();
+
+        /**
+         * Returns if the lease holds a connection
+         * @return false if the pool could not connect
+         */
+        explicit operator bool() const {
+            return c != nullptr;
+        }
+
+        /**
+         * Leased connection
+         * @return connection
+         */
+        inline Connection &conn() {
+            return c->conn;
+        }
+
+        inline Connection *operator->() {
+            return &c->conn;
+        }
+
+        /**
+         * Buffer registered on the connection
+         * @return buffer
+         */
+        inline unique_buf &buf() {
+            return c->buf;
+        }
+
+        /**
+         * Gives the connection back to the pool early
+         */
+        inline void release();
+
+        /**
+         * Closes the connection instead of giving it back, e.g. after an error left it unusable
+         */
+        inline void discard();
+
+    private:
+        friend class ConnectionPool;
+
+        using key_t = std::tuple<std::string, int, ProviderType>;
+
+        Lease(ConnectionPool *pool, key_t key, std::unique_ptr<pooled_connection> c) : pool(pool),
+                                                                                         key(std::move(key)),
+                                                                                         c(std::move(c)) {}
+
+        ConnectionPool *pool = nullptr;
+        key_t key;
+        std::unique_ptr<pooled_connection> c;
+    };
+
+    /**
+     * Pool of warm client connections by (address, port, provider). Handlers lease a connected
+     * connection, with its registered buffer, and give it back when done, so connection setup stays
+     * off the request path. A background thread keeps min idle connections ready for every backend
+     * that has been leased from or warmed.
+     *
+     * Connections are created against a FabricContext, so even the ones opened on demand skip
+     * provider discovery. Safe to use from several threads; the pool must outlive its leases.
+     */
+    class ConnectionPool {
+    public:
+        /**
+         * Starts the refill thread
+         * @param opts pool settings
+         * @param ctx context to create connections against
+         */
+        explicit ConnectionPool(const pool_options &opts = {}, FabricContext &ctx = FabricContext::global())
+                : opts(opts), ctx(ctx), refiller([this]() { refill_loop(); }) {
+            assert(opts.min <= opts.max && opts.max > 0);
+        }
+
+        ConnectionPool(const ConnectionPool &) = delete;
+
+        ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+        ~ConnectionPool() {
+            {
+                std::lock_guard<std::mutex> g(lock);
+                stopping = true;
+            }
+            refill.notify_all();
+            refiller.join();
+        }
+
+        /**
+         * Takes an idle connection to a backend. Idle connections the backend has shut down are closed
+         * instead of handed out. Connects a new one if there is none and the backend has fewer than
+         * max connections, otherwise waits for one to be given back.
+         * @param addr address of the backend
+         * @param port port of the backend
+         * @param provider provider type to use
+         * @return lease; empty if a new connection was needed and could not be made
+         */
+        inline Lease lease(const std::string &addr, int port, ProviderType provider = Sockets) {
+            Lease::key_t k(addr, port, provider);
+            std::unique_lock<std::mutex> g(lock);
+            backend &b = pools[k];
+            while (true) {
+                while (b.idle.empty() && b.total >= opts.max) {
+                    returned.wait(g);
+                }
+                if (b.idle.empty() || !b.idle.front()->conn.closed()) {
+                    break;
+                }
+                DO_LOG(DEBUG) << "Dropping closed connection to " << addr << ":" << port;
+                b.idle.pop_front();
+                --b.total;
+                refill.notify_one();
+            }
+            if (!b.idle.empty()) {
+                auto c = std::move(b.idle.front());
+                b.idle.pop_front();
+                if (b.idle.size() < opts.min) {
+                    refill.notify_one();
+                }
+                return Lease(this, k, std::move(c));
+            }
+            ++b.total;
+            g.unlock();
+            DO_LOG(DEBUG) << "No idle connection to " << addr << ":" << port << ", connecting";
+            auto c = open(k);
+            if (!c) {
+                g.lock();
+                --b.total;
+                returned.notify_one();
+                return Lease();
+            }
+            refill.notify_one();
+            return Lease(this, k, std::move(c));
+        }
+
+        /**
+         * Opens min idle connections to a backend now and keeps them refilled from then on
+         * @param addr address of the backend
+         * @param port port of the backend
+         * @param provider provider type to use
+         * @return true if the backend has min idle connections
+         */
+        inline bool warm(const std::string &addr, int port, ProviderType provider = Sockets) {
+            Lease::key_t k(addr, port, provider);
+            std::unique_lock<std::mutex> g(lock);
+            backend &b = pools[k];
+            while (b.idle.size() < opts.min && b.total < opts.max) {
+                ++b.total;
+                g.unlock();
+                auto c = open(k);
+                g.lock();
+                if (!c) {
+                    --b.total;
+                    return false;
+                }
+                b.idle.push_back(std::move(c));
+                returned.notify_one();
+            }
+            return b.idle.size() >= opts.min;
+        }
+
+        /**
+         * Number of idle connections to a backend
+         * @return count
+         */
+        inline size_t idle(const std::string &addr, int port, ProviderType provider = Sockets) {
+            std::lock_guard<std::mutex> g(lock);
+            auto elem = pools.find(Lease::key_t(addr, port, provider));
+            return elem == pools.end() ? 0 : elem->second.idle.size();
+        }
+
+        /**
+         * Number of connections to a backend, leased or idle
+         * @return count
+         */
+        inline size_t size(const std::string &addr, int port, ProviderType provider = Sockets) {
+            std::lock_guard<std::mutex> g(lock);
+            auto elem = pools.find(Lease::key_t(addr, port, provider));
+            return elem == pools.end() ? 0 : elem->second.total;
+        }
+
+    private:
+        friend class Lease;
+
+        struct backend {
+            std::deque<std::unique_ptr<pooled_connection>> idle;
+            // Idle, leased and being connected
+            size_t total = 0;
+        };
+
+        inline std::unique_ptr<pooled_connection> open(const Lease::key_t &k) {
+            const std::string &addr = std::get<0>(k);
+            for (int i = 0; i < POOL_CONNECT_ATTEMPTS; i++) {
+                std::unique_ptr<pooled_connection> c(
+                        new pooled_connection(ctx, addr, std::get<1>(k), std::get<2>(k), opts.bufSize));
+                if (!c->conn.connect()) {
+                    continue;
+                }
+                if (opts.bufSize > 0) {
+                    // Connections share a domain through the context, so each buffer needs its own key
+                    c->conn.register_mr_unique(c->buf, opts.bufAccess);
+                }
+                return c;
+            }
+            DO_LOG(ERROR) << "Unable to connect to " << addr << ":" << std::get<1>(k);
+            return nullptr;
+        }
+
+        inline void give_back(const Lease::key_t &k, std::unique_ptr<pooled_connection> c, bool keep) {
+            std::lock_guard<std::mutex> g(lock);
+            backend &b = pools[k];
+            if (keep) {
+                b.idle.push_back(std::move(c));
+            } else {
+                --b.total;
+                refill.notify_one();
+            }
+            returned.notify_one();
+        }
+
+        inline void refill_loop() {
+            std::unique_lock<std::mutex> g(lock);
+            while (!stopping) {
+                bool opened = false;
+                for (auto &p : pools) {
+                    backend &b = p.second;
+                    if (b.idle.size() >= opts.min || b.total >= opts.max) {
+                        continue;
+                    }
+                    ++b.total;
+                    auto k = p.first;
+                    g.unlock();
+                    auto c = open(k);
+                    g.lock();
+                    // pools only grows, so b is still valid
+                    if (c) {
+                        b.idle.push_back(std::move(c));
+                        returned.notify_one();
+                        opened = true;
+                    } else {
+                        --b.total;
+                    }
+                    if (stopping) {
+                        break;
+                    }
+                }
+                if (!opened && !stopping) {
+                    // Wait for a lease, or back off after a failed connect
+                    refill.wait_for(g, std::chrono::milliseconds(100));
+                }
+            }
+        }
+
+        const pool_options opts;
+        FabricContext &ctx;
+        std::mutex lock;
+        std::condition_variable returned;
+        std::condition_variable refill;
+        std::map<Lease::key_t, backend> pools;
+        bool stopping = false;
+        std::thread refiller;
+    };
+
+    inline Lease &Lease::operator=(Lease &&other) noexcept {
+        if (&other != this) {
+            release();
+            pool = other.pool;
+            key = std::move(other.key);
+            c = std::move(other.c);
+            other.pool = nullptr;
+        }
+        return *this;
+    }
+
+    inline Lease::~Lease() {
+        release();
+    }
+
+    inline void Lease::release() {
+        if (pool && c) {
+            pool->give_back(key, std::move(c), true);
+        }
+        pool = nullptr;
+    }
+
+    inline void Lease::discard() {
+        if (pool && c) {
+            c.reset();
+            pool->give_back(key, nullptr, false);
+        }
+        pool = nullptr;
+    }
+
+}
+
+#endif //NETWORKLAYER_CONNECTION_POOL_HH
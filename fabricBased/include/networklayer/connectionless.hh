@@ -3,6 +3,8 @@
  */
 
 #include "unique_buf.hh"
+#include "completion.hh"
+#include "segment.hh"
 #include "Macros.hh"
 
 #include <unistd.h>
@@ -15,6 +17,8 @@
 #include <rdma/fi_rma.h>
 #include <rdma/fi_errno.h>
 #include <atomic>
+#include <deque>
+#include <memory>
 #include <vector>
 #include <functional>
 
@@ -45,6 +49,38 @@ namespace cse498 {
         ERRCHK(fi_close(&x->fid));
     }
 
+    /**
+     * Default size of each buffer in a multi-receive area
+     */
+    const size_t DEFAULT_MULTI_RECV_SIZE = 1 << 20;
+
+    /**
+     * Default number of buffers in a multi-receive area; one keeps filling while another is recycled
+     */
+    const size_t DEFAULT_MULTI_RECV_BUFFERS = 2;
+
+    /**
+     * Message read from a multi-receive area
+     */
+    struct multi_recv_msg {
+        /**
+         * Sender, as returned by accept
+         */
+        addr_t src;
+        /**
+         * Tag the sender passed to ConnectionlessClient::send_multi
+         */
+        uint64_t tag;
+        /**
+         * Message inside the receive area; valid until the next call to recv_multi or try_recv_multi
+         */
+        char *data;
+        /**
+         * Length of the message
+         */
+        size_t len;
+    };
+
     /**
      * ConnectionlessServer
      */
@@ -54,14 +90,19 @@ namespace cse498 {
          * Constructor
          * @param fabricAddress address of server
          * @param port port to use
+         * @param multiRecv true to allow enable_multi_recv
          */
-        ConnectionlessServer(const char *fabricAddress, int port, uint32_t protocol = FI_PROTO_SOCK_TCP) {
+        ConnectionlessServer(const char *fabricAddress, int port, uint32_t protocol = FI_PROTO_SOCK_TCP,
+                             bool multiRecv = false) {
 
             done = false;
 
             DO_LOG(TRACE) << "Getting fi provider";
             hints = fi_allocinfo();
             hints->caps = FI_MSG | FI_TAGGED | FI_DIRECTED_RECV;
+            if (multiRecv) {
+                hints->caps |= FI_MULTI_RECV | FI_SOURCE;
+            }
             hints->ep_attr->type = FI_EP_RDM;
             hints->ep_attr->protocol = protocol;
 
@@ -82,6 +123,8 @@ namespace cse498 {
             DO_LOG(TRACE) << "Creating rx completion queue";
             cq_attr.size = fi->rx_attr->size;
             ERRCHK(fi_cq_open(domain, &cq_attr, &rx_cq, NULL));
+            txq = CompletionQueue(tx_cq, FI_CQ_FORMAT_TAGGED);
+            rxq = CompletionQueue(rx_cq, FI_CQ_FORMAT_TAGGED);
 
             // Create an address vector. This allows connectionless endpoints to communicate
             // without having to resolve addresses, such as IPv4, during data transfers.
@@ -123,6 +166,9 @@ namespace cse498 {
             ERRCHK(fi_close(&ep->fid));
             ERRCHK(fi_close(&tx_cq->fid));
             ERRCHK(fi_close(&rx_cq->fid));
+            for (auto &b : areas) {
+                free_mr(b->mr);
+            }
             ERRCHK(fi_close(&av->fid));
             ERRCHK(fi_close(&domain->fid));
             ERRCHK(fi_close(&fabric->fid));
@@ -144,7 +190,7 @@ namespace cse498 {
                 b = ERRREPORT(fi_trecv(ep, buf, size, nullptr, FI_ADDR_UNSPEC, 1, 0, nullptr));
             } while (!b);
 
-            ERRCHK(wait_for_completion(rx_cq));
+            ERRCHK(rxq.wait_for_completion());
             uint64_t sizeOfAddress = *(uint64_t *) buf;
 
             DO_LOG(TRACE) << "Server: Adding client to AV";
@@ -180,7 +226,7 @@ namespace cse498 {
          * @return address
          */
         inline addr_t wait_accept(char *buf, size_t size) {
-            ERRCHK(wait_for_completion(rx_cq));
+            ERRCHK(rxq.wait_for_completion());
             uint64_t sizeOfAddress = *(uint64_t *) buf;
 
             DO_LOG(TRACE) << "Server: Adding client to AV";
@@ -238,7 +284,7 @@ namespace cse498 {
         inline void recv(addr_t remote_addr, char *buf, size_t size) {
             DO_LOG(TRACE) << "Server: Posting recv";
             ERRCHK(fi_trecv(ep, buf, size, nullptr, remote_addr, 2, 0, nullptr));
-            ERRCHK(wait_for_completion(rx_cq));
+            ERRCHK(rxq.wait_for_completion());
         }
 
         /**
@@ -252,7 +298,7 @@ namespace cse498 {
             DO_LOG(TRACE) << "Server: Posting recv";
             bool b = ERRREPORT(fi_trecv(ep, buf, size, nullptr, remote_addr, 2, 0, nullptr));
             if (b) {
-                ERRCHK(wait_for_completion(rx_cq));
+                ERRCHK(rxq.wait_for_completion());
                 return true;
             }
             return false;
@@ -266,8 +312,12 @@ namespace cse498 {
          */
         inline void send(addr_t remote_addr, char *buf, size_t size) {
             DO_LOG(TRACE) << "Server: Posting send";
+            if (size <= fi->tx_attr->inject_size) {
+                ERRCHK(inject_tag(remote_addr, buf, size, 2));
+                return;
+            }
             ERRCHK(fi_tsend(ep, buf, size, nullptr, remote_addr, 2, nullptr));
-            ERRCHK(wait_for_completion(tx_cq));
+            ERRCHK(txq.wait_for_completion());
         }
 
         /**
@@ -279,9 +329,12 @@ namespace cse498 {
          */
         inline bool try_send(addr_t remote_addr, char *buf, size_t size) {
             DO_LOG(TRACE) << "Server: Posting send";
+            if (size <= fi->tx_attr->inject_size) {
+                return ERRREPORT(inject_tag(remote_addr, buf, size, 2));
+            }
             bool b = ERRREPORT(fi_tsend(ep, buf, size, nullptr, remote_addr, 2, nullptr));
             if (b) {
-                ERRCHK(wait_for_completion(tx_cq));
+                ERRCHK(txq.wait_for_completion());
                 DO_LOG(TRACE) << "Server: message sent";
                 return true;
             }
@@ -301,11 +354,33 @@ namespace cse498 {
             return ERRREPORT(fi_tsend(ep, buf, size, nullptr, remote_addr, 2, nullptr));
         }
 
+        /**
+         * Send one message made of several segments; crashes on failure
+         * @param remote_addr remote address
+         * @param segs segments to send (at most MAX_SEGMENTS and the provider's iov_limit)
+         */
+        inline void sendv(addr_t remote_addr, const std::vector<segment> &segs) {
+            DO_LOG(TRACE) << "Server: Posting send";
+            ERRCHK(post_sendv(remote_addr, segs));
+            ERRCHK(txq.wait_for_completion());
+        }
+
+        /**
+         * Asynchronously send one message made of several segments
+         * @param remote_addr remote address
+         * @param segs segments to send (at most MAX_SEGMENTS and the provider's iov_limit)
+         * @return true on success, false on failure
+         */
+        inline bool async_sendv(addr_t remote_addr, const std::vector<segment> &segs) {
+            DO_LOG(TRACE) << "Server: Posting send";
+            return ERRREPORT(post_sendv(remote_addr, segs));
+        }
+
         /**
          * Wait for successful send to complete
          */
         inline void wait_send() {
-            ERRCHK(wait_for_completion(tx_cq));
+            ERRCHK(txq.wait_for_completion());
             DO_LOG(TRACE) << "Server: Posting sent";
         }
 
@@ -321,6 +396,69 @@ namespace cse498 {
                              0, 0, &mr, NULL));
         }
 
+        /**
+         * Posts a multi-receive area: a few large registered buffers that the provider fills with
+         * consecutive messages sent by ConnectionlessClient::send_multi, so one posted receive absorbs
+         * a whole burst of requests. Read them with recv_multi; a buffer is posted again once the
+         * provider has released it and every message in it has been handed out. The server must have
+         * been created with multiRecv.
+         * @param size size of each buffer
+         * @param count number of buffers
+         */
+        inline void enable_multi_recv(size_t size = DEFAULT_MULTI_RECV_SIZE,
+                                      size_t count = DEFAULT_MULTI_RECV_BUFFERS) {
+            assert(areas.empty() && (fi->caps & FI_MULTI_RECV) && size > max_msg_size && count > 0);
+            rxq.track_sources();
+            // Release a buffer once the largest message might not fit, so none is ever truncated
+            size_t minFree = max_msg_size;
+            ERRCHK(fi_setopt(&ep->fid, FI_OPT_ENDPOINT, FI_OPT_MIN_MULTI_RECV, &minFree, sizeof(minFree)));
+            for (size_t i = 0; i < count; i++) {
+                std::unique_ptr<multi_recv_buf> b(new multi_recv_buf());
+                b->on_complete = &ConnectionlessServer::multi_recv_cb;
+                b->server = this;
+                b->data.reset(new char[size]);
+                b->size = size;
+                ERRCHK(fi_mr_reg(domain, b->data.get(), size, FI_RECV, 0, 0, 0, &b->mr, NULL));
+                post_multi_recv(*b);
+                areas.push_back(std::move(b));
+            }
+        }
+
+        /**
+         * Takes the next message from the multi-receive area without blocking
+         * @param msg set to the message
+         * @return true if there was a message
+         */
+        inline bool try_recv_multi(multi_recv_msg &msg) {
+            assert(!areas.empty());
+            // The message handed out last time is done with, so its buffer may be reused
+            for (auto &b : areas) {
+                if (b->released && b->queued == 0) {
+                    post_multi_recv(*b);
+                }
+            }
+            if (arrived.empty()) {
+                ERRCHK(rxq.poll());
+            }
+            if (arrived.empty()) {
+                return false;
+            }
+            msg = arrived.front().first;
+            --arrived.front().second->queued;
+            arrived.pop_front();
+            return true;
+        }
+
+        /**
+         * Blocks until a message is in the multi-receive area and takes it
+         * @return message
+         */
+        inline multi_recv_msg recv_multi() {
+            multi_recv_msg msg = {};
+            while (!try_recv_multi(msg));
+            return msg;
+        }
+
         friend inline void
         bestEffortBroadcast(ConnectionlessServer &c, const std::vector<addr_t> &addresses, char *message,
                             size_t messageSize);
@@ -336,29 +474,88 @@ namespace cse498 {
 
     private:
 
-        inline int wait_for_completion(struct fid_cq *cq) {
-            fi_cq_entry entry;
-            int ret;
-            while (1) {
-                ret = fi_cq_read(cq, &entry, 1);
-                if (ret > 0) return 0;
+        // Buffer of the multi-receive area; its completions all carry it as their context
+        struct multi_recv_buf : public op_context {
+            ConnectionlessServer *server = nullptr;
+            std::unique_ptr<char[]> data;
+            size_t size = 0;
+            mr_t mr = nullptr;
+            // The provider is done filling it
+            bool released = true;
+            // Messages in it not handed out yet
+            size_t queued = 0;
+        };
+
+        static void multi_recv_cb(op_context *ctx, const fi_cq_tagged_entry &entry) {
+            auto *b = static_cast<multi_recv_buf *>(ctx);
+            // The entry releasing the buffer may carry the last message or nothing at all
+            if ((entry.flags & FI_RECV) && (entry.len > 0 || !(entry.flags & FI_MULTI_RECV))) {
+                uint64_t tag = (entry.flags & FI_REMOTE_CQ_DATA) ? entry.data : 0;
+                b->server->arrived.emplace_back(multi_recv_msg{b->server->rxq.source(), tag, (char *) entry.buf,
+                                                               entry.len}, b);
+                ++b->queued;
+            }
+            if (entry.flags & FI_MULTI_RECV) {
+                DO_LOG(TRACE) << "Server: multi-receive buffer released";
+                b->released = true;
+            }
+        }
+
+        inline void post_multi_recv(multi_recv_buf &b) {
+            iovec iov = {b.data.get(), b.size};
+            void *desc = fi_mr_desc(b.mr);
+            fi_msg msg = {};
+            msg.msg_iov = &iov;
+            msg.desc = &desc;
+            msg.iov_count = 1;
+            msg.addr = FI_ADDR_UNSPEC;
+            msg.context = &b;
+            b.released = false;
+            while (true) {
+                ssize_t ret = fi_recvmsg(ep, &msg, FI_MULTI_RECV);
+                if (ret != -FI_EAGAIN) {
+                    ERRCHK(ret);
+                    return;
+                }
+                ERRCHK(rxq.poll());
+            }
+        }
+
+        // Injects a tagged message; no completion is generated and buf can be reused on return
+        inline ssize_t inject_tag(addr_t dest, char *buf, size_t size, uint64_t tag) {
+            while (true) {
+                ssize_t ret = fi_tinject(ep, buf, size, dest, tag);
                 if (ret != -FI_EAGAIN) {
-                    // New error on queue
-                    struct fi_cq_err_entry err_entry;
-                    fi_cq_readerr(cq, &err_entry, 0);
-                    DO_LOG(TRACE) << ("{0} {1}", fi_strerror(err_entry.err),
-                            fi_cq_strerror(cq, err_entry.prov_errno,
-                                           err_entry.err_data, NULL, 0));
                     return ret;
                 }
+                int polled = txq.poll();
+                if (polled < 0) {
+                    return polled;
+                }
+            }
+        }
+
+        inline ssize_t post_sendv(addr_t dest, const std::vector<segment> &segs) {
+            iovec iov[MAX_SEGMENTS];
+            void *desc[MAX_SEGMENTS];
+            ssize_t total = to_iov(segs, fi->tx_attr->iov_limit, iov, desc);
+            if (total < 0) {
+                return total;
             }
+            fi_msg_tagged msg = {};
+            msg.msg_iov = iov;
+            msg.desc = desc;
+            msg.iov_count = segs.size();
+            msg.addr = dest;
+            msg.tag = 2;
+            return fi_tsendmsg(ep, &msg, 0);
         }
 
         inline bool try_recv_tag(addr_t remote_addr, char *buf, size_t size, uint64_t tag) {
             DO_LOG(TRACE) << "Server: Posting recv";
             bool b = ERRREPORT(fi_trecv(ep, buf, size, nullptr, remote_addr, tag, 0, nullptr));
             if (b) {
-                ERRCHK(wait_for_completion(rx_cq));
+                ERRCHK(rxq.wait_for_completion());
                 return true;
             }
             return false;
@@ -366,9 +563,12 @@ namespace cse498 {
 
         inline bool try_send_tag(addr_t remote_addr, char *buf, size_t size, uint64_t tag) {
             DO_LOG(TRACE) << "Server: Posting send";
+            if (size <= fi->tx_attr->inject_size) {
+                return ERRREPORT(inject_tag(remote_addr, buf, size, tag));
+            }
             bool b = ERRREPORT(fi_tsend(ep, buf, size, nullptr, remote_addr, tag, nullptr));
             if (b) {
-                ERRCHK(wait_for_completion(tx_cq));
+                ERRCHK(txq.wait_for_completion());
                 DO_LOG(TRACE) << "Server: message sent";
                 return true;
             }
@@ -383,9 +583,12 @@ namespace cse498 {
         fi_av_attr av_attr;
         fid_av *av;
         fid_cq *tx_cq, *rx_cq;
+        CompletionQueue txq, rxq;
         fid_ep *ep;
         size_t max_msg_size = 4096;
         std::atomic_bool done;
+        std::vector<std::unique_ptr<multi_recv_buf>> areas;
+        std::deque<std::pair<multi_recv_msg, multi_recv_buf *>> arrived;
     };
 
     /**
@@ -421,6 +624,8 @@ namespace cse498 {
             DO_LOG(TRACE) << "Creating rx completion queue";
             cq_attr.size = fi->rx_attr->size;
             ERRCHK(fi_cq_open(domain, &cq_attr, &rx_cq, NULL));
+            txq = CompletionQueue(tx_cq, FI_CQ_FORMAT_TAGGED);
+            rxq = CompletionQueue(rx_cq, FI_CQ_FORMAT_TAGGED);
 
             // Create an address vector. This allows connectionless endpoints to communicate
             // without having to resolve addresses, such as IPv4, during data transfers.
@@ -489,7 +694,7 @@ namespace cse498 {
             do {
                 b = ERRREPORT(fi_tsend(ep, buf, sizeof(uint64_t) + addrlen, nullptr, remote_addr, 1, nullptr));
             } while (!b);
-            ERRCHK(wait_for_completion(tx_cq));
+            ERRCHK(txq.wait_for_completion());
             delete[] addr;
         }
 
@@ -522,7 +727,7 @@ namespace cse498 {
          * @param size
          */
         inline void wait_connect(char *buf, size_t size) {
-            ERRCHK(wait_for_completion(tx_cq));
+            ERRCHK(txq.wait_for_completion());
         }
 
 
@@ -564,7 +769,7 @@ namespace cse498 {
         [[deprecated("Use wait_connect instead")]]
         inline void async_wait_send_addr(char *buf, size_t size, void *&state) {
             char *addr = (char *) state;
-            ERRCHK(wait_for_completion(tx_cq));
+            ERRCHK(txq.wait_for_completion());
             delete[] addr;
         }
 
@@ -575,7 +780,7 @@ namespace cse498 {
          */
         inline void recv(char *buf, size_t size) {
             ERRCHK(fi_trecv(ep, buf, size, nullptr, remote_addr, 2, 0, nullptr));
-            ERRCHK(wait_for_completion(rx_cq));
+            ERRCHK(rxq.wait_for_completion());
         }
 
         /**
@@ -584,8 +789,12 @@ namespace cse498 {
          * @param size size of buffer
          */
         inline void send(char *buf, size_t size) {
+            if (size <= fi->tx_attr->inject_size) {
+                ERRCHK(inject_tag(remote_addr, buf, size, 2));
+                return;
+            }
             ERRCHK(fi_tsend(ep, buf, size, nullptr, remote_addr, 2, nullptr));
-            ERRCHK(wait_for_completion(tx_cq));
+            ERRCHK(txq.wait_for_completion());
         }
 
         inline bool async_send(char *buf, size_t size) {
@@ -593,8 +802,42 @@ namespace cse498 {
             return ERRREPORT(fi_tsend(ep, buf, size, nullptr, remote_addr, 2, nullptr));
         }
 
+        /**
+         * Send message into the server's multi-receive area (see ConnectionlessServer::enable_multi_recv)
+         * @param buf any buffer
+         * @param size size of buffer, at most the server's max message size
+         * @param tag handed to the server with the message
+         */
+        inline void send_multi(char *buf, size_t size, uint64_t tag = 0) {
+            if (size <= fi->tx_attr->inject_size) {
+                ERRCHK(inject_data(remote_addr, buf, size, tag));
+                return;
+            }
+            ERRCHK(fi_senddata(ep, buf, size, nullptr, tag, remote_addr, nullptr));
+            ERRCHK(txq.wait_for_completion());
+        }
+
+        /**
+         * Send one message made of several segments
+         * @param segs segments to send (at most MAX_SEGMENTS and the provider's iov_limit)
+         */
+        inline void sendv(const std::vector<segment> &segs) {
+            ERRCHK(post_sendv(remote_addr, segs));
+            ERRCHK(txq.wait_for_completion());
+        }
+
+        /**
+         * Asynchronously send one message made of several segments
+         * @param segs segments to send (at most MAX_SEGMENTS and the provider's iov_limit)
+         * @return true on success, false on failure
+         */
+        inline bool async_sendv(const std::vector<segment> &segs) {
+            DO_LOG(TRACE) << "Client: Posting send";
+            return ERRREPORT(post_sendv(remote_addr, segs));
+        }
+
         inline void wait_send() {
-            ERRCHK(wait_for_completion(tx_cq));
+            ERRCHK(txq.wait_for_completion());
             DO_LOG(TRACE) << "Client: Posting sent";
         }
 
@@ -623,29 +866,55 @@ namespace cse498 {
 
     private:
 
-        static inline int wait_for_completion(struct fid_cq *cq) {
-            fi_cq_entry entry;
-            int ret;
-            while (1) {
-                ret = fi_cq_read(cq, &entry, 1);
-                if (ret > 0) return 0;
+        // Injects a tagged message; no completion is generated and buf can be reused on return
+        inline ssize_t inject_tag(addr_t dest, char *buf, size_t size, uint64_t tag) {
+            while (true) {
+                ssize_t ret = fi_tinject(ep, buf, size, dest, tag);
                 if (ret != -FI_EAGAIN) {
-                    // New error on queue
-                    struct fi_cq_err_entry err_entry;
-                    fi_cq_readerr(cq, &err_entry, 0);
-                    DO_LOG(TRACE) << fi_strerror(err_entry.err) << " " <<
-                                  fi_cq_strerror(cq, err_entry.prov_errno,
-                                                 err_entry.err_data, NULL, 0);
                     return ret;
                 }
+                int polled = txq.poll();
+                if (polled < 0) {
+                    return polled;
+                }
+            }
+        }
+
+        // Injects an untagged message carrying data as remote CQ data
+        inline ssize_t inject_data(addr_t dest, char *buf, size_t size, uint64_t data) {
+            while (true) {
+                ssize_t ret = fi_injectdata(ep, buf, size, data, dest);
+                if (ret != -FI_EAGAIN) {
+                    return ret;
+                }
+                int polled = txq.poll();
+                if (polled < 0) {
+                    return polled;
+                }
+            }
+        }
+
+        inline ssize_t post_sendv(addr_t dest, const std::vector<segment> &segs) {
+            iovec iov[MAX_SEGMENTS];
+            void *desc[MAX_SEGMENTS];
+            ssize_t total = to_iov(segs, fi->tx_attr->iov_limit, iov, desc);
+            if (total < 0) {
+                return total;
             }
+            fi_msg_tagged msg = {};
+            msg.msg_iov = iov;
+            msg.desc = desc;
+            msg.iov_count = segs.size();
+            msg.addr = dest;
+            msg.tag = 2;
+            return fi_tsendmsg(ep, &msg, 0);
         }
 
         inline bool try_recv_tag(char *buf, size_t size, uint64_t tag) {
             DO_LOG(TRACE) << "Client: Posting recv";
             bool b = ERRREPORT(fi_trecv(ep, buf, size, nullptr, remote_addr, tag, 0, nullptr));
             if (b) {
-                ERRCHK(wait_for_completion(rx_cq));
+                ERRCHK(rxq.wait_for_completion());
                 DO_LOG(TRACE) << "Client: message recv";
                 return true;
             }
@@ -654,9 +923,12 @@ namespace cse498 {
 
         inline bool try_send_tag(char *buf, size_t size, uint64_t tag) {
             DO_LOG(TRACE) << "Client: Posting send";
+            if (size <= fi->tx_attr->inject_size) {
+                return ERRREPORT(inject_tag(remote_addr, buf, size, tag));
+            }
             bool b = ERRREPORT(fi_tsend(ep, buf, size, nullptr, remote_addr, tag, nullptr));
             if (b) {
-                ERRCHK(wait_for_completion(tx_cq));
+                ERRCHK(txq.wait_for_completion());
                 DO_LOG(TRACE) << "Client: message sent";
                 return true;
             }
@@ -672,6 +944,7 @@ namespace cse498 {
         fi_av_attr av_attr;
         fid_av *av;
         fid_cq *tx_cq, *rx_cq;
+        CompletionQueue txq, rxq;
         fid_ep *ep;
         size_t max_msg_size = 4096;
     };
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "unique_buf.hh"
+#include "completion.hh"
 #include "Macros.hh"
 
 #include <networklayer/RPC.hh>
@@ -21,6 +22,8 @@
 #include <rdma/fi_errno.h>
 #include <atomic>
 #include <unordered_map>
+#include <string>
+#include <algorithm>
 
 
 static_assert(FI_MAJOR_VERSION == MAJOR_VERSION_USED && FI_MINOR_VERSION >= MINOR_VERSION_USED,
@@ -37,17 +40,25 @@ namespace cse498 {
      */
     const int DEFAULT_PORT = 8080;
 
+    /**
+     * Largest RPC message, even if the provider allows larger messages. Larger arguments and
+     * results are split into several messages.
+     */
+    const size_t MAX_RPC_MSG_SIZE = 1 << 22;
+
     /*
-     * Protocol:
-     * Client Sends:
+     * Protocol (payloads that do not fit in one message are sent as several chunks, in order):
+     * Client Sends, per chunk:
      * uint64_t addrlen
      * bytes of addr
      * Header
-     * bytes of payload
+     * bytes of chunk
      *
-     * Server Sends:
+     * Server Sends, per chunk:
      * uint64_t size of payload
-     * bytes of payload
+     * uint64_t offset of chunk
+     * uint64_t size of chunk
+     * bytes of chunk
      */
 
     /**
@@ -62,28 +73,16 @@ namespace cse498 {
          * Size of argument to be sent
          */
         uint64_t sizeOfArg;
+        /**
+         * Offset of this chunk in the argument
+         */
+        uint64_t offset;
+        /**
+         * Size of this chunk
+         */
+        uint64_t sizeOfChunk;
     };
 
-    /**
-     * Waits for something to happen in the cq.
-     * @param cq The CQ we are waiting on
-     * @return error
-     */
-    inline int wait_for_completion(struct fid_cq *cq) {
-        fi_cq_entry entry;
-        int ret;
-        while (1) {
-            ret = fi_cq_read(cq, &entry, 1);
-            if (ret > 0) return 0;
-            if (ret != -FI_EAGAIN) {
-                // New error on queue
-                struct fi_cq_err_entry err_entry;
-                fi_cq_readerr(cq, &err_entry, 0);
-                return ret;
-            }
-        }
-    }
-
 
     /**
      * FabricRPC class. Currently a connectionless server.
@@ -116,11 +115,13 @@ namespace cse498 {
             ERRCHK(fi_domain(fabric, fi, &domain, NULL));
             memset(&cq_attr, 0, sizeof(cq_attr));
             cq_attr.wait_obj = FI_WAIT_NONE;
-            //cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+            cq_attr.format = FI_CQ_FORMAT_CONTEXT;
             cq_attr.size = fi->tx_attr->size;
             ERRCHK(fi_cq_open(domain, &cq_attr, &tx_cq, NULL));
             cq_attr.size = fi->rx_attr->size;
             ERRCHK(fi_cq_open(domain, &cq_attr, &rx_cq, NULL));
+            txq = CompletionQueue(tx_cq, FI_CQ_FORMAT_CONTEXT);
+            rxq = CompletionQueue(rx_cq, FI_CQ_FORMAT_CONTEXT);
 
             // Create an address vector. This allows connectionless endpoints to communicate
             // without having to resolve addresses, such as IPv4, during data transfers.
@@ -135,6 +136,9 @@ namespace cse498 {
 
             // Could create multiple endpoints, especially if there are multiple NICs available.
 
+            // size buffers for the largest message the provider accepts
+            max_msg_size = std::min(fi->ep_attr->max_msg_size, MAX_RPC_MSG_SIZE);
+
             // malloc buffers
             local_buf = new char[max_msg_size];
             remote_buf = new char[max_msg_size];
@@ -194,20 +198,62 @@ namespace cse498 {
         inline void start() {
             while (!done) {
 
-                ERRCHK(fi_recv(ep, remote_buf, max_msg_size, nullptr, 0, nullptr));
-                ERRCHK(wait_for_completion(rx_cq));
+                // Received with a token to learn how many bytes actually arrived
+                auto c = std::make_shared<Completion>();
+                c->posted(c);
+                ERRCHK(fi_recv(ep, remote_buf, max_msg_size, nullptr, 0, c.get()));
+                ERRCHK(rxq.wait_until([&c]() { return c->done(); }));
+                if (!c->ok()) {
+                    DO_LOG(ERROR) << "Dropping a call that failed to arrive: " << fi_strerror(c->error());
+                    continue;
+                }
+                const size_t len = c->length();
+
+                // Everything below comes off the wire, so nothing is indexed before it is checked
+                // against len
+                uint64_t sizeOfAddress = 0;
+                if (len < sizeof(uint64_t) + sizeof(Header)) {
+                    DO_LOG(ERROR) << "Dropping a call of only " << len << " bytes";
+                    continue;
+                }
+                memcpy(&sizeOfAddress, remote_buf, sizeof(uint64_t));
+                if (sizeOfAddress > len - sizeof(uint64_t) - sizeof(Header)) {
+                    DO_LOG(ERROR) << "Dropping a call with an address of " << sizeOfAddress << " bytes";
+                    continue;
+                }
+                const size_t prefix = sizeof(uint64_t) + sizeOfAddress + sizeof(Header);
+
+                Header h = {};
+                memcpy(&h, remote_buf + sizeof(uint64_t) + sizeOfAddress, sizeof(Header));
+                if (h.sizeOfChunk > len - prefix || h.offset > h.sizeOfArg ||
+                    h.sizeOfChunk > h.sizeOfArg - h.offset) {
+                    DO_LOG(ERROR) << "Dropping a malformed chunk of a call to " << h.fnID;
+                    continue;
+                }
 
-                uint64_t sizeOfAddress = *(uint64_t *) remote_buf;
+                // Reassemble the argument; chunks from different clients may interleave
+                std::string source(remote_buf + sizeof(uint64_t), sizeOfAddress);
+                auto &call = pending[source];
+                if (call.received == 0 || call.arg.size() != h.sizeOfArg) {
+                    call.arg.assign(h.sizeOfArg, 0);
+                    call.received = 0;
+                }
+                memcpy(call.arg.data() + h.offset, remote_buf + prefix, h.sizeOfChunk);
+                call.received += h.sizeOfChunk;
+                if (call.received < h.sizeOfArg) {
+                    continue;
+                }
+                pack_t p = std::move(call.arg);
+                pending.erase(source);
 
                 fi_addr_t remote_addr;
 
-                if (1 != fi_av_insert(av, remote_buf + sizeof(uint64_t), 1, &remote_addr, 0, NULL)) {
+                if (1 != fi_av_insert(av, source.data(), 1, &remote_addr, 0, NULL)) {
                     std::cerr << "ERROR - fi_av_insert did not return 1" << std::endl;
                     perror("Error");
                     exit(1);
                 }
 
-                Header h = *(Header *) (remote_buf + sizeof(uint64_t) + sizeOfAddress);
                 auto fnRes = fnMap->find(h.fnID);
 
                 DO_LOG(DEBUG) << "Getting fn " << h.fnID;
@@ -216,27 +262,37 @@ namespace cse498 {
 
                 assert(fnRes != fnMap->end());
 
-                pack_t p(h.sizeOfArg);
-
-                memcpy(p.data(), remote_buf + sizeof(uint64_t) + sizeOfAddress + sizeof(Header), h.sizeOfArg);
-
                 auto res = fnRes->second(p);
 
-                uint64_t size = res.size();
-
-                memcpy(local_buf, (char *) &size, sizeof(uint64_t));
-                memcpy(local_buf + sizeof(uint64_t), res.data(), size);
-
-                ERRCHK(fi_send(ep, local_buf, res.size() + sizeof(uint64_t), nullptr, remote_addr, nullptr));
-                ERRCHK(wait_for_completion(tx_cq));
+                const uint64_t size = res.size();
+                uint64_t sent = 0;
+                do {
+                    uint64_t chunk = std::min<uint64_t>(size - sent, max_msg_size - 3 * sizeof(uint64_t));
+                    memcpy(local_buf, (char *) &size, sizeof(uint64_t));
+                    memcpy(local_buf + sizeof(uint64_t), (char *) &sent, sizeof(uint64_t));
+                    memcpy(local_buf + 2 * sizeof(uint64_t), (char *) &chunk, sizeof(uint64_t));
+                    memcpy(local_buf + 3 * sizeof(uint64_t), res.data() + sent, chunk);
+
+                    ERRCHK(fi_send(ep, local_buf, chunk + 3 * sizeof(uint64_t), nullptr, remote_addr, nullptr));
+                    ERRCHK(txq.wait_for_completion());
+                    sent += chunk;
+                } while (sent < size);
                 ERRCHK(fi_av_remove(av, &remote_addr, 1, 0));
             }
         }
 
     private:
 
+        /**
+         * Argument of a call whose chunks have not all arrived yet
+         */
+        struct pending_call {
+            pack_t arg;
+            uint64_t received = 0;
+        };
 
         std::unordered_map<uint64_t, std::function<pack_t(pack_t)>> *fnMap;
+        std::unordered_map<std::string, pending_call> pending;
 
         fi_info *fi, *hints;
         fid_fabric *fabric;
@@ -245,6 +301,7 @@ namespace cse498 {
         fi_av_attr av_attr;
         fid_av *av;
         fid_cq *tx_cq, *rx_cq;
+        CompletionQueue txq, rxq;
         fid_ep *ep;
         size_t max_msg_size = 4096;
         fid_mr *mr;
@@ -275,11 +332,13 @@ namespace cse498 {
             ERRCHK(fi_domain(fabric, fi, &domain, NULL));
             memset(&cq_attr, 0, sizeof(cq_attr));
             cq_attr.wait_obj = FI_WAIT_NONE;
-            //cq_attr.format = FI_CQ_FORMAT_CONTEXT;
+            cq_attr.format = FI_CQ_FORMAT_CONTEXT;
             cq_attr.size = fi->tx_attr->size;
             ERRCHK(fi_cq_open(domain, &cq_attr, &tx_cq, NULL));
             cq_attr.size = fi->rx_attr->size;
             ERRCHK(fi_cq_open(domain, &cq_attr, &rx_cq, NULL));
+            txq = CompletionQueue(tx_cq, FI_CQ_FORMAT_CONTEXT);
+            rxq = CompletionQueue(rx_cq, FI_CQ_FORMAT_CONTEXT);
 
             // Create an address vector. This allows connectionless endpoints to communicate
             // without having to resolve addresses, such as IPv4, during data transfers.
@@ -292,6 +351,9 @@ namespace cse498 {
 
             // Could create multiple endpoints, especially if there are multiple NICs available.
 
+            // size buffers for the largest message the provider accepts
+            max_msg_size = std::min(fi->ep_attr->max_msg_size, MAX_RPC_MSG_SIZE);
+
             // malloc buffers
             remote_buf = new char[max_msg_size];
             local_buf = new char[max_msg_size];
@@ -336,44 +398,91 @@ namespace cse498 {
         }
 
         /**
-         * Call remote function by sending data
+         * Call remote function by sending data; crashes on failure
          * @param fnID RPC id number
          * @param data data to send
          * @return pack_t returned by remote function
          */
         inline pack_t callRemote(uint64_t fnID, pack_t data) {
+            pack_t p;
+            if (!tryCallRemote(fnID, data, p)) {
+                DO_LOG(ERROR) << "Call to " << fnID << " failed";
+                exit(1);
+            }
+            return p;
+        }
+
+        /**
+         * Call remote function by sending data. Arguments and results that do not fit in one
+         * message are sent as several chunks and reassembled.
+         * @param fnID RPC id number
+         * @param data data to send
+         * @param result set to the pack_t returned by remote function
+         * @return true on success, false if the call could not be sent or its result received
+         */
+        inline bool tryCallRemote(uint64_t fnID, const pack_t &data, pack_t &result) {
 
             assert(sizeof(size_t) == sizeof(uint64_t));
 
             size_t addrlen = 0;
             fi_getname(&ep->fid, nullptr, &addrlen);
-            char *addr = new char[addrlen];
-            ERRCHK(fi_getname(&ep->fid, addr, &addrlen));
-
+            const size_t prefix = sizeof(uint64_t) + addrlen + sizeof(Header);
+            if (prefix >= max_msg_size) {
+                DO_LOG(ERROR) << "Address of " << addrlen << " bytes leaves no room in " << max_msg_size << " bytes";
+                return false;
+            }
             memcpy(local_buf, &addrlen, sizeof(uint64_t));
-            memcpy(local_buf + sizeof(uint64_t), addr, addrlen);
+            bool b = ERRREPORT(fi_getname(&ep->fid, local_buf + sizeof(uint64_t), &addrlen));
+            if (!b) {
+                return false;
+            }
 
             Header h;
-            h.sizeOfArg = data.size();
             h.fnID = fnID;
-            memcpy(local_buf + sizeof(uint64_t) + addrlen, (char *) &h, sizeof(Header));
-            if (sizeof(uint64_t) + addrlen + data.size() + sizeof(Header) > max_msg_size) {
-                exit(1);
-            }
-            memcpy(local_buf + sizeof(uint64_t) + addrlen + sizeof(Header), data.data(), data.size());
-
-            ERRCHK(fi_send(ep, local_buf, data.size() + sizeof(uint64_t) + addrlen + data.size() + sizeof(Header),
-                           nullptr, remote_addr, nullptr));
-            ERRCHK(wait_for_completion(tx_cq));
-
-            ERRCHK(fi_recv(ep, remote_buf, max_msg_size, nullptr, 0, nullptr));
-            ERRCHK(wait_for_completion(rx_cq));
-
-            uint64_t size = *(uint64_t *) remote_buf;
+            h.sizeOfArg = data.size();
+            h.offset = 0;
+            do {
+                h.sizeOfChunk = std::min<uint64_t>(h.sizeOfArg - h.offset, max_msg_size - prefix);
+                memcpy(local_buf + sizeof(uint64_t) + addrlen, (char *) &h, sizeof(Header));
+                memcpy(local_buf + prefix, data.data() + h.offset, h.sizeOfChunk);
+
+                b = ERRREPORT(fi_send(ep, local_buf, prefix + h.sizeOfChunk, nullptr, remote_addr, nullptr));
+                if (!b) {
+                    return false;
+                }
+                b = ERRREPORT(txq.wait_for_completion());
+                if (!b) {
+                    return false;
+                }
+                h.offset += h.sizeOfChunk;
+            } while (h.offset < h.sizeOfArg);
+
+            uint64_t size = 0, received = 0;
+            do {
+                b = ERRREPORT(fi_recv(ep, remote_buf, max_msg_size, nullptr, 0, nullptr));
+                if (!b) {
+                    return false;
+                }
+                b = ERRREPORT(rxq.wait_for_completion());
+                if (!b) {
+                    return false;
+                }
 
-            pack_t p(remote_buf + sizeof(uint64_t), remote_buf + sizeof(uint64_t) + size);
+                auto *r = (uint64_t *) remote_buf;
+                if (received == 0) {
+                    size = r[0];
+                    result.assign(size, 0);
+                }
+                if (r[0] != size || r[1] > size || r[2] > size - r[1] ||
+                    r[2] > max_msg_size - 3 * sizeof(uint64_t)) {
+                    DO_LOG(ERROR) << "Malformed result chunk for a call to " << fnID;
+                    return false;
+                }
+                memcpy(result.data() + r[1], remote_buf + 3 * sizeof(uint64_t), r[2]);
+                received += r[2];
+            } while (received < size);
 
-            return p;
+            return true;
         }
 
     private:
@@ -385,6 +494,7 @@ namespace cse498 {
         fi_av_attr av_attr;
         fid_av *av;
         fid_cq *tx_cq, *rx_cq;
+        CompletionQueue txq, rxq;
         fid_ep *ep;
         size_t max_msg_size = 4096;
         fid_mr *mr;
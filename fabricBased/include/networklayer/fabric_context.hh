@@ -0,0 +1,177 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_FABRIC_CONTEXT_HH
+#define NETWORKLAYER_FABRIC_CONTEXT_HH
+
+#include "Macros.hh"
+#include "mr_cache.hh"
+
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+namespace cse498 {
+
+    /**
+     * Result of one provider discovery, with the fabric and domain opened on it. Shared by every
+     * endpoint created from the same FabricContext entry and closed once the last of them is gone.
+     */
+    struct fabric_entry {
+        /**
+         * fi_getinfo result. Endpoints take a copy with fi_dupinfo.
+         */
+        fi_info *info = nullptr;
+        /**
+         * Fabric opened on info
+         */
+        fid_fabric *fabric = nullptr;
+
+        fabric_entry() = default;
+
+        fabric_entry(const fabric_entry &) = delete;
+
+        fabric_entry &operator=(const fabric_entry &) = delete;
+
+        ~fabric_entry() {
+            cache.reset();
+            if (domain)
+                ERRCHK(fi_close(&domain->fid));
+            if (fabric)
+                ERRCHK(fi_close(&fabric->fid));
+            if (info)
+                fi_freeinfo(info);
+        }
+
+        /**
+         * Domain opened on info, opened on first use
+         * @return domain
+         */
+        inline fid_domain *get_domain() {
+            std::lock_guard<std::mutex> g(lock);
+            if (!domain) {
+                DO_LOG(TRACE) << "Creating shared domain";
+                SAFE_CALL(fi_domain(fabric, info, &domain, nullptr));
+            }
+            return domain;
+        }
+
+        /**
+         * Registration cache of the domain, shared by every connection on it so that cached regions and
+         * the keys of internal buffers are unique within the domain
+         * @return cache
+         */
+        inline MRCache &get_cache() {
+            fid_domain *d = get_domain();
+            std::lock_guard<std::mutex> g(lock);
+            if (!cache) {
+                cache.reset(new MRCache(d));
+            }
+            return *cache;
+        }
+
+    private:
+        fid_domain *domain = nullptr;
+        std::unique_ptr<MRCache> cache;
+        std::mutex lock;
+    };
+
+    /**
+     * Cache of provider discovery results and of the fabric and domain handles opened on them, by
+     * address, service, flags and hints. fi_getinfo, fi_fabric and fi_domain run once per distinct
+     * tuple; every later endpoint is created against the cached handles, which makes short-lived
+     * connections much cheaper to open.
+     *
+     * Safe to use from several threads.
+     */
+    class FabricContext {
+    public:
+        FabricContext() = default;
+
+        FabricContext(const FabricContext &) = delete;
+
+        FabricContext &operator=(const FabricContext &) = delete;
+
+        /**
+         * Context shared by the whole process
+         * @return context
+         */
+        static inline FabricContext &global() {
+            static FabricContext ctx;
+            return ctx;
+        }
+
+        /**
+         * Finds the entry for a tuple, running fi_getinfo and opening the fabric on a miss
+         * @param node address passed to fi_getinfo
+         * @param service port passed to fi_getinfo
+         * @param flags flags passed to fi_getinfo (e.g. FI_SOURCE)
+         * @param hints hints passed to fi_getinfo
+         * @return entry
+         */
+        inline std::shared_ptr<fabric_entry> lookup(const char *node, const char *service, uint64_t flags,
+                                                    const fi_info *hints) {
+            std::string k = key(node, service, flags, hints);
+            std::lock_guard<std::mutex> g(lock);
+            auto elem = entries.find(k);
+            if (elem != entries.end()) {
+                return elem->second;
+            }
+            auto e = std::make_shared<fabric_entry>();
+            SAFE_CALL(fi_getinfo(FI_VERSION(MAJOR_VERSION_USED, MINOR_VERSION_USED), node, service, flags, hints,
+                                 &e->info));
+            DO_LOG(TRACE) << "Creating fabric";
+            SAFE_CALL(fi_fabric(e->info->fabric_attr, &e->fabric, nullptr));
+            DO_LOG(DEBUG) << "Cached provider " << e->info->fabric_attr->prov_name << " for " << k;
+            entries.emplace(k, e);
+            return e;
+        }
+
+        /**
+         * Drops every cached entry. Entries still in use stay open until their last user is gone.
+         */
+        inline void clear() {
+            std::lock_guard<std::mutex> g(lock);
+            entries.clear();
+        }
+
+        /**
+         * Number of cached entries
+         * @return count
+         */
+        inline size_t size() {
+            std::lock_guard<std::mutex> g(lock);
+            return entries.size();
+        }
+
+    private:
+        static inline std::string key(const char *node, const char *service, uint64_t flags, const fi_info *hints) {
+            std::ostringstream s;
+            s << (node ? node : "") << ":" << (service ? service : "") << "/" << flags;
+            if (hints) {
+                s << "/" << hints->caps << "/" << hints->mode;
+                if (hints->ep_attr) {
+                    s << "/" << hints->ep_attr->type << "/" << hints->ep_attr->protocol;
+                }
+                if (hints->domain_attr) {
+                    s << "/" << hints->domain_attr->mr_mode << "/" << hints->domain_attr->threading;
+                }
+                if (hints->fabric_attr && hints->fabric_attr->prov_name) {
+                    s << "/" << hints->fabric_attr->prov_name;
+                }
+            }
+            return s.str();
+        }
+
+        std::mutex lock;
+        std::map<std::string, std::shared_ptr<fabric_entry>> entries;
+    };
+
+}
+
+#endif //NETWORKLAYER_FABRIC_CONTEXT_HH
@@ -0,0 +1,215 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_MEM_POLICY_HH
+#define NETWORKLAYER_MEM_POLICY_HH
+
+#include "unique_buf.hh"
+#include "shared_buf.hh"
+#include "Macros.hh"
+
+#include <rdma/fabric.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace cse498 {
+
+    /**
+     * Pages backing memory allocated with a mem_policy
+     */
+    enum PageSize {
+        StandardPages,
+        HugePages2M,
+        HugePages1G
+    };
+
+    /**
+     * How memory for registered buffers is allocated. The default policy is a plain heap allocation.
+     */
+    struct mem_policy {
+        /**
+         * Pages to back the memory with. Falls back to smaller pages when none are available.
+         */
+        PageSize pages = StandardPages;
+        /**
+         * Alignment of the start of the memory (a power of two), 0 for no requirement
+         */
+        size_t align = 0;
+        /**
+         * NUMA node to place the memory on, -1 for no preference
+         */
+        int node = -1;
+
+        /**
+         * Hugepage-backed memory
+         * @param pages size of the hugepages
+         * @param node NUMA node to place the memory on, -1 for no preference
+         * @return policy
+         */
+        static inline mem_policy huge(PageSize pages = HugePages2M, int node = -1) {
+            return {pages, 0, node};
+        }
+
+        /**
+         * Page-aligned memory placed on a NUMA node
+         * @param node NUMA node, -1 for no preference
+         * @return policy
+         */
+        static inline mem_policy on_node(int node) {
+            return {StandardPages, 0, node};
+        }
+    };
+
+    /**
+     * Finds the NUMA node local to the NIC of a fi_getinfo result
+     * @param info
+     * @return node, or -1 if the provider does not report a PCI device or the node is unknown
+     */
+    inline int numa_node_of(const fi_info *info) {
+        if (!info || !info->nic || !info->nic->bus_attr || info->nic->bus_attr->bus_type != FI_BUS_PCI) {
+            return -1;
+        }
+        const fi_pci_attr &pci = info->nic->bus_attr->attr.pci;
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node", pci.domain_id,
+                 pci.bus_id, pci.device_id, pci.function_id);
+        int node = -1;
+        std::ifstream f(path);
+        if (!(f >> node)) {
+            return -1;
+        }
+        return node;
+    }
+
+    namespace detail {
+
+        static const size_t PAGE_SIZE_4K = 4096;
+
+        inline size_t page_bytes(PageSize pages) {
+            switch (pages) {
+                case HugePages1G:
+                    return 1UL << 30;
+                case HugePages2M:
+                    return 1UL << 21;
+                default:
+                    return PAGE_SIZE_4K;
+            }
+        }
+
+        inline int page_flags(PageSize pages) {
+            switch (pages) {
+                case HugePages1G:
+                    return MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+                case HugePages2M:
+                    return MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+                default:
+                    return 0;
+            }
+        }
+
+        // The owner of a mapping is its length, so nothing else has to be allocated to free it
+        inline void unmap(void *owner, char *buf) {
+            if (buf) {
+                munmap(buf, (size_t) (uintptr_t) owner);
+            }
+        }
+
+        /**
+         * Maps size bytes with the policy, trying smaller pages when the requested ones are not
+         * available.
+         * @param size bytes needed
+         * @param policy
+         * @param mapped set to the length of the mapping
+         * @return memory or nullptr
+         */
+        inline char *map(size_t size, const mem_policy &policy, size_t &mapped) {
+            for (int p = policy.pages; p >= StandardPages; p--) {
+                auto pages = (PageSize) p;
+                size_t page = page_bytes(pages);
+                // Map extra to trim down to the alignment when it is larger than a page
+                size_t extra = policy.align > page ? policy.align : 0;
+                size_t len = (size + page - 1) / page * page;
+                void *m = mmap(nullptr, len + extra, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | page_flags(pages), -1, 0);
+                if (m == MAP_FAILED) {
+                    DO_LOG(DEBUG) << "Unable to map " << len << " bytes with " << page << " byte pages";
+                    continue;
+                }
+                auto start = (uintptr_t) m;
+                if (extra) {
+                    uintptr_t aligned = (start + policy.align - 1) / policy.align * policy.align;
+                    if (aligned > start) {
+                        munmap(m, aligned - start);
+                    }
+                    if (start + extra > aligned) {
+                        munmap((void *) (aligned + len), start + extra - aligned);
+                    }
+                    start = aligned;
+                }
+                if (pages == StandardPages && size >= page_bytes(HugePages2M)) {
+                    // Transparent hugepages are the last resort for large regions
+                    madvise((void *) start, len, MADV_HUGEPAGE);
+                }
+                if (policy.node >= 0 && policy.node < 64) {
+                    // MPOL_PREFERRED: fall back to other nodes rather than failing page faults
+                    unsigned long mask = 1UL << policy.node;
+                    if (syscall(SYS_mbind, start, len, 1, &mask, sizeof(mask) * 8, 0) != 0) {
+                        DO_LOG(DEBUG) << "Unable to bind memory to NUMA node " << policy.node;
+                    }
+                }
+                mapped = len;
+                return (char *) start;
+            }
+            return nullptr;
+        }
+
+        inline bool is_default(const mem_policy &policy) {
+            return policy.pages == StandardPages && policy.align <= alignof(std::max_align_t) && policy.node < 0;
+        }
+
+    }
+
+    /**
+     * Allocate a buffer with a policy. Falls back to smaller pages and then to the heap, so this
+     * always returns a buffer of size bytes.
+     * @param size size of the buffer
+     * @param policy
+     * @return buffer
+     */
+    inline unique_buf allocate(size_t size, const mem_policy &policy) {
+        size_t mapped = 0;
+        char *mem = detail::is_default(policy) ? nullptr : detail::map(size, policy, mapped);
+        if (!mem) {
+            return unique_buf(size);
+        }
+        return unique_buf(mem, size, (void *) (uintptr_t) mapped, &detail::unmap);
+    }
+
+    /**
+     * Like allocate, but with the semantics of shared_buf
+     * @param size size of the buffer
+     * @param policy
+     * @return buffer
+     */
+    inline shared_buf allocate_shared(size_t size, const mem_policy &policy) {
+        size_t mapped = 0;
+        char *mem = detail::is_default(policy) ? nullptr : detail::map(size, policy, mapped);
+        if (!mem) {
+            return shared_buf(size);
+        }
+        return shared_buf(mem, size, (void *) (uintptr_t) mapped, &detail::unmap);
+    }
+
+}
+
+#endif //NETWORKLAYER_MEM_POLICY_HH
@@ -0,0 +1,246 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_MR_CACHE_HH
+#define NETWORKLAYER_MR_CACHE_HH
+
+#include "Macros.hh"
+
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+namespace cse498 {
+
+    /**
+     * Default number of registrations a cache keeps
+     */
+    const size_t DEFAULT_MR_CACHE_SIZE = 256;
+
+    /**
+     * First key a cache hands out on its domain, for its own registrations and through reserve_key.
+     * Keys picked by callers must stay below it.
+     */
+    const uint64_t MR_CACHE_KEY_BASE = 1ULL << 48;
+
+    /**
+     * Cache of memory registrations on one domain keyed by address range. Acquiring any range inside
+     * an already registered region with at least the same access reuses that registration instead of
+     * calling fi_mr_reg. Registrations are reference counted; ones nobody holds stay cached and the
+     * least recently used are closed once the cache is over capacity.
+     *
+     * Like any registration cache it assumes cached memory stays mapped at the same address. Memory
+     * that may be unmapped (e.g. large heap blocks) must be invalidated before it is freed.
+     *
+     * Safe to use from several threads, since connections on one domain may run on different threads.
+     */
+    class MRCache {
+    public:
+        /**
+         * Create a cache
+         * @param domain domain to register on
+         * @param capacity registrations kept before unused ones are closed
+         */
+        explicit MRCache(fid_domain *domain, size_t capacity = DEFAULT_MR_CACHE_SIZE) : domain(domain),
+                                                                                        capacity(capacity) {
+            assert(capacity > 0);
+        }
+
+        MRCache(const MRCache &) = delete;
+
+        MRCache &operator=(const MRCache &) = delete;
+
+        ~MRCache() {
+            for (auto &e : byKey) {
+                ERRCHK(fi_close(&e.second.mr->fid));
+            }
+        }
+
+        /**
+         * Finds or creates a registration covering [addr, addr + len) and takes a reference to it
+         * @param addr start of the range
+         * @param len length of the range
+         * @param access access flags the registration needs
+         * @return registration
+         */
+        inline fid_mr *acquire(const char *addr, size_t len, uint64_t access) {
+            std::lock_guard<std::mutex> g(lock);
+            entry *e = find((uintptr_t) addr, (uintptr_t) addr + len, access);
+            if (e) {
+                DO_LOG(TRACE) << "MR cache hit for " << (void *) addr;
+                ++hits;
+            } else {
+                e = insert((uintptr_t) addr, (uintptr_t) addr + len, access);
+            }
+            if (e->refs++ == 0 && e->lruPos != lru.end()) {
+                lru.erase(e->lruPos);
+                e->lruPos = lru.end();
+            }
+            evict();
+            return e->mr;
+        }
+
+        /**
+         * Drops a reference taken by acquire
+         * @param key key of the registration
+         */
+        inline void release(uint64_t key) {
+            std::lock_guard<std::mutex> g(lock);
+            auto it = byKey.find(key);
+            assert(it != byKey.end());
+            entry &e = it->second;
+            assert(e.refs > 0);
+            if (--e.refs == 0) {
+                e.lruPos = lru.insert(lru.end(), key);
+                evict();
+            }
+        }
+
+        /**
+         * Closes every unused registration overlapping [addr, addr + len)
+         * @param addr start of the range
+         * @param len length of the range
+         */
+        inline void invalidate(const char *addr, size_t len) {
+            std::lock_guard<std::mutex> g(lock);
+            auto start = (uintptr_t) addr;
+            auto end = start + len;
+            for (auto it = lru.begin(); it != lru.end();) {
+                entry &e = byKey.at(*it);
+                if (e.start < end && start < e.end) {
+                    uint64_t key = *it;
+                    it = lru.erase(it);
+                    close(key);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        /**
+         * Reserves a key no other registration on the domain requests, for internal buffers that are
+         * registered outside the cache
+         * @return key
+         */
+        inline uint64_t reserve_key() {
+            std::lock_guard<std::mutex> g(lock);
+            return nextKey++;
+        }
+
+        /**
+         * Returns if key belongs to a registration made by this cache
+         * @param key
+         * @return true if cached
+         */
+        [[nodiscard]] inline bool contains(uint64_t key) const {
+            std::lock_guard<std::mutex> g(lock);
+            return byKey.count(key) != 0;
+        }
+
+        /**
+         * Number of registrations in the cache
+         * @return count
+         */
+        [[nodiscard]] inline size_t size() const {
+            std::lock_guard<std::mutex> g(lock);
+            return byKey.size();
+        }
+
+        /**
+         * Number of acquires served without registering
+         * @return count
+         */
+        [[nodiscard]] inline uint64_t hit_count() const {
+            std::lock_guard<std::mutex> g(lock);
+            return hits;
+        }
+
+    private:
+        struct entry {
+            uintptr_t start;
+            uintptr_t end;
+            uint64_t access;
+            fid_mr *mr;
+            size_t refs;
+            std::list<uint64_t>::iterator lruPos;
+        };
+
+        static const uintptr_t PAGE = 4096;
+
+        inline entry *find(uintptr_t start, uintptr_t end, uint64_t access) {
+            // Walk back over every region starting at or before start that could still reach end
+            auto it = byStart.upper_bound(start);
+            while (it != byStart.begin()) {
+                --it;
+                if (it->first + maxLen < start) {
+                    break;
+                }
+                entry &e = byKey.at(it->second);
+                if (e.end >= end && (e.access & access) == access) {
+                    return &e;
+                }
+            }
+            return nullptr;
+        }
+
+        inline entry *insert(uintptr_t start, uintptr_t end, uint64_t access) {
+            // Register whole pages so neighbouring buffers hit
+            start &= ~(PAGE - 1);
+            end = (end + PAGE - 1) & ~(PAGE - 1);
+
+            fid_mr *mr = nullptr;
+            DO_LOG(TRACE) << "MR cache registering " << (void *) start << " - " << (void *) end;
+            SAFE_CALL(fi_mr_reg(domain, (void *) start, end - start, access, 0, nextKey++, 0, &mr, nullptr));
+            uint64_t key = fi_mr_key(mr);
+
+            entry &e = byKey[key];
+            e = {start, end, access, mr, 0, lru.end()};
+            byStart.emplace(start, key);
+            maxLen = std::max<uintptr_t>(maxLen, end - start);
+            return &e;
+        }
+
+        inline void evict() {
+            while (byKey.size() > capacity && !lru.empty()) {
+                uint64_t key = lru.front();
+                lru.pop_front();
+                close(key);
+            }
+        }
+
+        inline void close(uint64_t key) {
+            entry &e = byKey.at(key);
+            assert(e.refs == 0);
+            auto range = byStart.equal_range(e.start);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == key) {
+                    byStart.erase(it);
+                    break;
+                }
+            }
+            DO_LOG(TRACE) << "MR cache closing " << (void *) e.start;
+            ERRREPORT(fi_close(&e.mr->fid));
+            byKey.erase(key);
+        }
+
+        fid_domain *domain;
+        const size_t capacity;
+        std::unordered_map<uint64_t, entry> byKey;
+        std::multimap<uintptr_t, uint64_t> byStart;
+        std::list<uint64_t> lru;
+        uintptr_t maxLen = 0;
+        uint64_t nextKey = MR_CACHE_KEY_BASE;
+        uint64_t hits = 0;
+        mutable std::mutex lock;
+    };
+
+}
+
+#endif //NETWORKLAYER_MR_CACHE_HH
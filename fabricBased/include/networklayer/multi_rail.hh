@@ -0,0 +1,451 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_MULTI_RAIL_HH
+#define NETWORKLAYER_MULTI_RAIL_HH
+
+#include "connection.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cse498 {
+
+    /**
+     * Most rails a MultiRail can stripe over
+     */
+    const size_t MAX_RAILS = 4;
+
+    /**
+     * Transfers smaller than this per rail are not split, they go over a single rail
+     */
+    const size_t MIN_STRIPE_SIZE = 1 << 16;
+
+    /**
+     * Where a region registered with MultiRail::register_mr lives on each rail. It is plain data, so
+     * it can be sent to the other side as is.
+     */
+    struct rail_region {
+        uint64_t rails;
+        uint64_t addr[MAX_RAILS];
+        uint64_t key[MAX_RAILS];
+    };
+
+    /**
+     * Completion of a striped transfer: one token per stripe and the rail it was posted on
+     */
+    using rail_completion_t = std::vector<std::pair<size_t, completion_t>>;
+
+    /**
+     * Connection made of several endpoints ("rails") to the same peer, each on its own port and
+     * possibly its own NIC. Large writes, reads and sends are split into stripes that are posted on
+     * every rail at once, and a transfer is done once all of its stripes are. Small transfers use a
+     * single rail, so there is no reason to avoid this for mixed traffic.
+     *
+     * Rail i listens on (or connects to) port + i. Both sides must use the same number of rails.
+     */
+    class MultiRail {
+    public:
+        /**
+         * One rail per address; give the address of each NIC to use
+         * @param addrs address of each rail (local address for the server, peer address for the client)
+         * @param is_server
+         * @param port port of the first rail
+         * @param provider
+         */
+        MultiRail(const std::vector<std::string> &addrs, bool is_server, int port = 8080,
+                  ProviderType provider = Sockets) : addrs(addrs), is_server(is_server), port(port),
+                                                      provider(provider), connected(addrs.size(), false) {
+            assert(!addrs.empty() && addrs.size() <= MAX_RAILS);
+            for (size_t i = 0; i < addrs.size(); i++) {
+                rails.emplace_back(new Connection(addrs[i].c_str(), is_server, port + (int) i, provider));
+            }
+        }
+
+        /**
+         * Several rails through the same NIC, which still helps when one endpoint cannot keep the
+         * link busy
+         * @param addr
+         * @param count number of rails
+         * @param is_server
+         * @param port port of the first rail
+         * @param provider
+         */
+        MultiRail(const char *addr, size_t count, bool is_server, int port = 8080, ProviderType provider = Sockets)
+                : MultiRail(std::vector<std::string>(count, addr), is_server, port, provider) {}
+
+        MultiRail(const MultiRail &) = delete;
+
+        MultiRail &operator=(const MultiRail &) = delete;
+
+        ~MultiRail() {
+            for (auto &elem : views) {
+                for (size_t i = 0; i < rails.size(); i++) {
+                    rails[i]->deregister_mr(*elem.second[i], true);
+                }
+            }
+            if (headerBuf) {
+                rails[0]->deregister_mr(*headerBuf, true);
+            }
+            for (size_t i = 0; i < discard.size(); i++) {
+                if (discard[i]) {
+                    rails[i]->deregister_mr(*discard[i], true);
+                }
+            }
+        }
+
+        /**
+         * Connects every rail that is not connected yet, blocking like Connection::connect. Call
+         * again until it returns true; failed client rails are recreated.
+         * @return true once every rail is connected
+         */
+        inline bool connect() {
+            for (size_t i = 0; i < rails.size(); i++) {
+                if (connected[i]) {
+                    continue;
+                }
+                if (!rails[i]->connect()) {
+                    if (!is_server) {
+                        rails[i].reset(new Connection(addrs[i].c_str(), is_server, port + (int) i, provider));
+                    }
+                    return false;
+                }
+                connected[i] = true;
+            }
+            return true;
+        }
+
+        /**
+         * Number of rails
+         * @return count
+         */
+        [[nodiscard]] inline size_t size() const {
+            return rails.size();
+        }
+
+        /**
+         * A single rail, for anything that is not worth striping
+         * @param i index
+         * @return connection
+         */
+        inline Connection &rail(size_t i) {
+            return *rails[i];
+        }
+
+        /**
+         * Registers a buffer on every rail. Each rail has its own registration, so send the returned
+         * region to the other side for it to write or read the buffer.
+         * @param data buffer; must stay alive until deregistered
+         * @param access see Connection::register_mr
+         * @param key key to register under on each rail
+         * @return where the buffer lives on each rail
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline rail_region register_mr(buf_t &data, uint64_t access, uint64_t key) {
+            deregister_mr(data);
+            rail_region region = {rails.size(), {}, {}};
+            auto &v = views[data.get()];
+            for (size_t i = 0; i < rails.size(); i++) {
+                // The views only borrow the memory, so each rail gets its own key and descriptor
+                v.emplace_back(new unique_buf(data.get(), data.size(), nullptr, &MultiRail::borrowed));
+                uint64_t k = key;
+                rails[i]->register_mr(*v[i], access, k);
+                region.addr[i] = rails[i]->remote_address(*v[i]);
+                region.key[i] = k;
+            }
+            return region;
+        }
+
+        /**
+         * Removes the registrations of a buffer from every rail
+         * @param data buffer registered with register_mr
+         * @return true if the buffer was registered
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool deregister_mr(buf_t &data) {
+            auto elem = views.find(data.get());
+            if (elem == views.end()) {
+                return false;
+            }
+            for (size_t i = 0; i < rails.size(); i++) {
+                // The memory belongs to the caller and may be freed next
+                rails[i]->deregister_mr(*elem->second[i], true);
+            }
+            views.erase(elem);
+            return true;
+        }
+
+        /**
+         * Writes size bytes to a region on the other side, striped across the rails. Blocks until
+         * every stripe has completed.
+         * @param data buffer registered with register_mr
+         * @param size
+         * @param remote region registered on the other side
+         * @param offset offset into data
+         * @param remoteOffset offset into the remote region
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void write(buf_t &data, size_t size, const rail_region &remote, size_t offset = 0,
+                          size_t remoteOffset = 0) {
+            SAFE_CALL(wait(async_write(data, size, remote, offset, remoteOffset)));
+        }
+
+        /**
+         * Like write, but returns once every stripe is posted. data cannot be modified until the
+         * transfer is done.
+         * @param data buffer registered with register_mr
+         * @param size
+         * @param remote region registered on the other side
+         * @param offset offset into data
+         * @param remoteOffset offset into the remote region
+         * @return completion of the transfer
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline rail_completion_t async_write(buf_t &data, size_t size, const rail_region &remote, size_t offset = 0,
+                                             size_t remoteOffset = 0) {
+            return stripe_rma(data, size, remote, offset, remoteOffset, true);
+        }
+
+        /**
+         * Reads size bytes from a region on the other side, striped across the rails. Blocks until
+         * every stripe has completed.
+         * @param data buffer registered with register_mr
+         * @param size
+         * @param remote region registered on the other side
+         * @param offset offset into data
+         * @param remoteOffset offset into the remote region
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void read(buf_t &data, size_t size, const rail_region &remote, size_t offset = 0,
+                         size_t remoteOffset = 0) {
+            SAFE_CALL(wait(async_read(data, size, remote, offset, remoteOffset)));
+        }
+
+        /**
+         * Like read, but returns once every stripe is posted
+         * @param data buffer registered with register_mr
+         * @param size
+         * @param remote region registered on the other side
+         * @param offset offset into data
+         * @param remoteOffset offset into the remote region
+         * @return completion of the transfer
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline rail_completion_t async_read(buf_t &data, size_t size, const rail_region &remote, size_t offset = 0,
+                                            size_t remoteOffset = 0) {
+            return stripe_rma(data, size, remote, offset, remoteOffset, false);
+        }
+
+        /**
+         * Checks once whether every stripe of a transfer is done
+         * @param c completion of the transfer
+         * @return true if done
+         */
+        inline bool test(const rail_completion_t &c) {
+            bool done = true;
+            for (auto &s : c) {
+                done = rails[s.first]->test(s.second) && done;
+            }
+            return done;
+        }
+
+        /**
+         * Blocks until every stripe of a transfer is done
+         * @param c completion of the transfer
+         * @return 0 on success, otherwise the error of the first stripe that failed
+         */
+        inline int wait(const rail_completion_t &c) {
+            int ret = 0;
+            for (auto &s : c) {
+                int r = rails[s.first]->wait(s.second);
+                if (ret == 0) {
+                    ret = r;
+                }
+            }
+            return ret;
+        }
+
+        /**
+         * Sends a message of any size, striped across the rails. The other side has to receive it
+         * with MultiRail::recv. Blocks until every stripe is sent.
+         * @param data buffer registered with register_mr, with at least FI_SEND
+         * @param size
+         * @param offset offset into data
+         * @return true on success
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool send(buf_t &data, size_t size, size_t offset = 0) {
+            auto &v = view_of(data);
+            stripe_header h = {size, chunk_for(size, rails[0]->stream_chunk_size())};
+            header().cpyTo((const char *) &h, sizeof(h));
+            rails[0]->send(header(), sizeof(h));
+            for (size_t pos = 0, k = 0; pos < size; pos += h.chunk, k++) {
+                size_t r = k % rails.size();
+                if (!rails[r]->async_send(*v[r], std::min(h.chunk, size - pos), offset + pos)) {
+                    return false;
+                }
+            }
+            bool ok = true;
+            for (auto &r : rails) {
+                ok = r->try_wait_for_sends() && ok;
+            }
+            return ok;
+        }
+
+        /**
+         * Receives a message sent with MultiRail::send. The receive for every stripe is posted on its
+         * rail before waiting, so all the rails receive at once.
+         * @param data buffer registered with register_mr, with at least FI_RECV
+         * @param max_len size of the largest message that fits
+         * @param offset offset into data
+         * @return size of the message, -FI_ETOOSMALL if it is larger than max_len (its stripes are
+         * received and dropped, so the next message can still be received), or another negative
+         * fi_errno value
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline ssize_t recv(buf_t &data, size_t max_len, size_t offset = 0) {
+            auto &v = view_of(data);
+            rails[0]->recv(header(), sizeof(stripe_header));
+            stripe_header h = {};
+            memcpy(&h, header().get(), sizeof(h));
+            if (h.size > 0 && (h.chunk == 0 || h.chunk > rails[0]->stream_chunk_size())) {
+                DO_LOG(ERROR) << "Bad stripe size " << h.chunk;
+                return -FI_EIO;
+            }
+            const bool fits = h.size <= max_len;
+            if (!fits) {
+                DO_LOG(ERROR) << "Message of " << h.size << " bytes does not fit in " << max_len;
+            }
+
+            // Receives still outstanding on each rail, oldest first
+            std::vector<std::deque<completion_t>> outstanding(rails.size());
+            int ret = 0;
+            for (size_t pos = 0, k = 0; pos < h.size; pos += h.chunk, k++) {
+                size_t r = k % rails.size();
+                size_t len = std::min(h.chunk, h.size - pos);
+                while (true) {
+                    auto c = fits ? rails[r]->async_recv(*v[r], len, offset + pos)
+                                  : rails[r]->async_recv(scratch(r, h.chunk), len);
+                    if (!c->done() || c->error() != FI_EAGAIN || outstanding[r].empty()) {
+                        outstanding[r].push_back(std::move(c));
+                        break;
+                    }
+                    // The rail's receive queue is full, so make room by waiting for its oldest stripe
+                    int err = rails[r]->wait_recv(outstanding[r].front());
+                    ret = ret == 0 ? err : ret;
+                    outstanding[r].pop_front();
+                }
+            }
+            for (size_t r = 0; r < rails.size(); r++) {
+                for (auto &c : outstanding[r]) {
+                    int err = rails[r]->wait_recv(c);
+                    ret = ret == 0 ? err : ret;
+                }
+            }
+            if (ret < 0) {
+                return ret;
+            }
+            return fits ? (ssize_t) h.size : -FI_ETOOSMALL;
+        }
+
+    private:
+        struct stripe_header {
+            uint64_t size;
+            uint64_t chunk;
+        };
+
+        static void borrowed(void *, char *) {}
+
+        /**
+         * Size of each stripe: the transfer split evenly across the rails, unless that makes the
+         * stripes too small to be worth it or too large for one operation
+         */
+        inline size_t chunk_for(size_t size, size_t maxChunk) const {
+            if (size < 2 * MIN_STRIPE_SIZE) {
+                return std::max<size_t>(std::min(size, maxChunk), 1);
+            }
+            size_t per = (size + rails.size() - 1) / rails.size();
+            per = std::max(per, MIN_STRIPE_SIZE);
+            // Keep stripes cache line aligned
+            per = (per + 63) / 64 * 64;
+            return std::min(per, maxChunk);
+        }
+
+        template<typename buf_t>
+        inline std::vector<std::unique_ptr<unique_buf>> &view_of(buf_t &data) {
+            auto elem = views.find(data.get());
+            assert(elem != views.end());
+            return elem->second;
+        }
+
+        template<typename buf_t>
+        inline rail_completion_t stripe_rma(buf_t &data, size_t size, const rail_region &remote, size_t offset,
+                                            size_t remoteOffset, bool write) {
+            assert(remote.rails == rails.size());
+            auto &v = view_of(data);
+            size_t chunk = chunk_for(size, rails[0]->stream_chunk_size());
+            rail_completion_t c;
+            for (size_t pos = 0, k = 0; pos < size; pos += chunk, k++) {
+                // Small transfers take turns across the rails instead of all landing on the first
+                size_t r = (k + (chunk >= size ? next++ : 0)) % rails.size();
+                size_t len = std::min(chunk, size - pos);
+                uint64_t addr = remote.addr[r] + remoteOffset + pos;
+                auto token = write ? rails[r]->async_write(*v[r], len, addr, remote.key[r], offset + pos)
+                                   : rails[r]->async_read(*v[r], len, addr, remote.key[r], offset + pos);
+                c.emplace_back(r, std::move(token));
+            }
+            return c;
+        }
+
+        inline unique_buf &header() {
+            if (!headerBuf) {
+                headerBuf.reset(new unique_buf(sizeof(stripe_header)));
+                // Never takes over a key the caller registered on rail 0
+                rails[0]->register_mr_unique(*headerBuf, FI_SEND | FI_RECV);
+            }
+            return *headerBuf;
+        }
+
+        /**
+         * Buffer on rail r that stripes of a message too large to receive are dropped into
+         */
+        inline unique_buf &scratch(size_t r, size_t size) {
+            if (discard.size() < rails.size()) {
+                discard.resize(rails.size());
+            }
+            auto &s = discard[r];
+            if (s && s->size() < size) {
+                rails[r]->deregister_mr(*s, true);
+                s.reset();
+            }
+            if (!s) {
+                s.reset(new unique_buf(size));
+                rails[r]->register_mr_unique(*s, FI_RECV);
+            }
+            return *s;
+        }
+
+        std::vector<std::string> addrs;
+        bool is_server;
+        int port;
+        ProviderType provider;
+        std::vector<std::unique_ptr<Connection>> rails;
+        std::vector<bool> connected;
+        // Per-rail registrations of each buffer, by start of the buffer
+        std::map<const char *, std::vector<std::unique_ptr<unique_buf>>> views;
+        std::unique_ptr<unique_buf> headerBuf;
+        // Scratch buffer of each rail, see scratch
+        std::vector<std::unique_ptr<unique_buf>> discard;
+        size_t next = 0;
+    };
+
+}
+
+#endif //NETWORKLAYER_MULTI_RAIL_HH
@@ -0,0 +1,286 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_REACTOR_HH
+#define NETWORKLAYER_REACTOR_HH
+
+#include "connection.hh"
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cse498 {
+
+    /**
+     * Default number of receive slots posted for every connection a Reactor accepts
+     */
+    const size_t DEFAULT_REACTOR_SLOTS = 64;
+
+    /**
+     * Default size of each receive slot (largest message a Reactor can receive)
+     */
+    const size_t DEFAULT_REACTOR_SLOT_SIZE = 4096;
+
+    /**
+     * Serves many connections without a thread per connection. Owns the listening connection, accepts
+     * new peers without blocking and polls the receive ring of every accepted connection from one loop
+     * (or from several loops, each pinned to a core), calling the message handler for each arrival.
+     *
+     * Every connection is served by exactly one loop, so handlers for the same connection never run
+     * concurrently and may send on it. Connections the other side shut down, or that failed, are
+     * dropped once their last messages have been handled.
+     */
+    class Reactor {
+    public:
+        /**
+         * Called for each message. The view is released once the handler returns.
+         */
+        using message_handler_t = std::function<void(Connection &, const msg_view &)>;
+
+        /**
+         * Called once for each accepted connection before any of its messages, and once more before
+         * it is dropped if set with on_disconnect
+         */
+        using connect_handler_t = std::function<void(Connection &)>;
+
+        /**
+         * Creates the listening connection
+         * @param addr address to listen on
+         * @param port port to listen on
+         * @param provider provider type to use
+         * @param slots receive slots posted per connection
+         * @param slotSize size of each receive slot
+         */
+        Reactor(const char *addr, int port = 8080, ProviderType provider = Sockets,
+                size_t slots = DEFAULT_REACTOR_SLOTS, size_t slotSize = DEFAULT_REACTOR_SLOT_SIZE)
+                : listener(addr, true, port, provider), slots(slots), slotSize(slotSize) {
+            loops.emplace_back(new loop());
+        }
+
+        Reactor(const Reactor &) = delete;
+
+        Reactor &operator=(const Reactor &) = delete;
+
+        ~Reactor() {
+            stop();
+        }
+
+        /**
+         * Sets the handler called for each message
+         * @param handler
+         */
+        inline void on_message(message_handler_t handler) {
+            msgHandler = std::move(handler);
+        }
+
+        /**
+         * Sets the handler called for each accepted connection
+         * @param handler
+         */
+        inline void on_connect(connect_handler_t handler) {
+            connHandler = std::move(handler);
+        }
+
+        /**
+         * Sets the handler called for each connection that is dropped because it was shut down or
+         * failed. Runs on the loop serving the connection.
+         * @param handler
+         */
+        inline void on_disconnect(connect_handler_t handler) {
+            disconnHandler = std::move(handler);
+        }
+
+        /**
+         * Makes every connection accepted from now on share the listener's domain and completion
+         * queues, see Connection::share_resources. Buffers registered with register_mr can then be
+         * used on any connection. Connections sharing queues must be served by a single loop.
+         * @param cqSize size of each shared completion queue, 0 for the provider default
+         */
+        inline void share_resources(size_t cqSize = 0) {
+            listener.share_resources(cqSize);
+            sharing = true;
+        }
+
+        /**
+         * Registers a buffer on the listener. Once resources are shared it can be used on every
+         * connection.
+         * @param data buffer
+         * @param access access flags
+         * @param key requested key, set to the key given by the provider
+         * @return true if an old registration with this key was replaced
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool register_mr(buf_t &data, uint64_t access, uint64_t &key) {
+            return listener.register_mr(data, access, key);
+        }
+
+        /**
+         * Accepts at most one pending peer and drains every connection of the first loop once. Lets
+         * the reactor be driven from an existing event loop instead of run.
+         * @return number of messages handled
+         */
+        inline size_t poll() {
+            accept_pending();
+            return drain(*loops[0]);
+        }
+
+        /**
+         * Serves connections until stop is called. The calling thread accepts peers and runs the first
+         * loop; the other loops get their own threads. Connections are spread over loops round-robin.
+         * @param nloops number of loops
+         * @param cores core to pin each loop to; loops past the end are not pinned
+         */
+        inline void run(size_t nloops = 1, const std::vector<int> &cores = {}) {
+            assert(nloops > 0);
+            assert(!sharing || nloops == 1);
+            while (loops.size() < nloops) {
+                loops.emplace_back(new loop());
+            }
+            running = true;
+
+            std::vector<std::thread> threads;
+            for (size_t i = 1; i < loops.size(); i++) {
+                threads.emplace_back([this, i, &cores]() {
+                    if (i < cores.size()) {
+                        pin(cores[i]);
+                    }
+                    while (running) {
+                        drain(*loops[i]);
+                    }
+                });
+            }
+
+            if (!cores.empty()) {
+                pin(cores[0]);
+            }
+            while (running) {
+                poll();
+            }
+
+            for (auto &t : threads) {
+                t.join();
+            }
+        }
+
+        /**
+         * Makes run return. May be called from a handler or from another thread.
+         */
+        inline void stop() {
+            running = false;
+        }
+
+        /**
+         * Number of connections accepted so far
+         * @return count
+         */
+        [[nodiscard]] inline size_t size() const {
+            return accepted;
+        }
+
+        /**
+         * Number of accepted connections that have not been dropped yet
+         * @return count
+         */
+        [[nodiscard]] inline size_t connections() const {
+            return open;
+        }
+
+    private:
+        struct loop {
+            std::vector<std::unique_ptr<Connection>> conns;
+            std::mutex m;
+            std::vector<std::unique_ptr<Connection>> incoming;
+            std::atomic_bool hasIncoming{false};
+        };
+
+        static inline void pin(int core) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(core, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                DO_LOG(WARNING) << "Unable to pin reactor loop to core " << core;
+            }
+        }
+
+        inline void accept_pending() {
+            auto p = listener.nonblockingAccept();
+            if (!p.first) {
+                return;
+            }
+            auto conn = std::make_unique<Connection>(std::move(p.second));
+            conn->enable_recv_ring(slots, slotSize);
+            if (connHandler) {
+                connHandler(*conn);
+            }
+            ++open;
+
+            loop &l = *loops[accepted++ % loops.size()];
+            if (&l == loops[0].get()) {
+                l.conns.push_back(std::move(conn));
+                return;
+            }
+            std::lock_guard<std::mutex> lock(l.m);
+            l.incoming.push_back(std::move(conn));
+            l.hasIncoming = true;
+        }
+
+        inline size_t drain(loop &l) {
+            if (l.hasIncoming) {
+                std::lock_guard<std::mutex> lock(l.m);
+                for (auto &c : l.incoming) {
+                    l.conns.push_back(std::move(c));
+                }
+                l.incoming.clear();
+                l.hasIncoming = false;
+            }
+
+            size_t handled = 0;
+            msg_view v;
+            for (auto it = l.conns.begin(); it != l.conns.end();) {
+                auto &c = *it;
+                // Checked first so messages that arrived before the shutdown are still handled
+                bool gone = c->closed();
+                while (c->try_recv_view(v)) {
+                    if (msgHandler) {
+                        msgHandler(*c, v);
+                    }
+                    c->release(v);
+                    ++handled;
+                }
+                if (!gone) {
+                    ++it;
+                    continue;
+                }
+                DO_LOG(DEBUG) << "Dropping closed connection";
+                if (disconnHandler) {
+                    disconnHandler(*c);
+                }
+                it = l.conns.erase(it);
+                --open;
+            }
+            return handled;
+        }
+
+        Connection listener;
+        const size_t slots;
+        const size_t slotSize;
+        std::vector<std::unique_ptr<loop>> loops;
+        message_handler_t msgHandler;
+        connect_handler_t connHandler;
+        connect_handler_t disconnHandler;
+        std::atomic_bool running{false};
+        bool sharing = false;
+        size_t accepted = 0;
+        std::atomic_size_t open{0};
+    };
+
+}
+
+#endif //NETWORKLAYER_REACTOR_HH
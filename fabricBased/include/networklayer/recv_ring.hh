@@ -0,0 +1,189 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_RECV_RING_HH
+#define NETWORKLAYER_RECV_RING_HH
+
+#include "unique_buf.hh"
+#include "completion.hh"
+#include "Macros.hh"
+
+#include <rdma/fabric.h>
+#include <rdma/fi_endpoint.h>
+#include <deque>
+#include <vector>
+
+namespace cse498 {
+
+    /**
+     * View of a message sitting in a receive ring slot. Valid until it is released.
+     */
+    struct msg_view {
+        /**
+         * Start of the message
+         */
+        const char *data = nullptr;
+        /**
+         * Length of the message
+         */
+        size_t size = 0;
+        /**
+         * Slot holding the message
+         */
+        size_t slot = 0;
+    };
+
+    /**
+     * Ring of receive slots carved out of one registered buffer. Every slot has a receive posted
+     * ahead of time; a completed slot is handed out as a msg_view and posted again once released.
+     */
+    class RecvRing {
+    public:
+        /**
+         * Allocate the ring. The buffer still needs to be registered before calling post_all.
+         * @param slots number of slots
+         * @param slotSize size of each slot (largest message that can be received)
+         */
+        RecvRing(size_t slots, size_t slotSize) : buf(slots * slotSize), slotSize(slotSize), ctxs(slots) {
+            assert(slots > 0);
+            for (size_t i = 0; i < slots; i++) {
+                ctxs[i].ring = this;
+                ctxs[i].index = i;
+                ctxs[i].on_complete = &RecvRing::complete_cb;
+                ctxs[i].on_error = &RecvRing::error_cb;
+            }
+        }
+
+        RecvRing(const RecvRing &) = delete;
+
+        RecvRing &operator=(const RecvRing &) = delete;
+
+        /**
+         * Buffer backing every slot
+         * @return buffer
+         */
+        inline unique_buf &buffer() {
+            return buf;
+        }
+
+        /**
+         * Posts a receive for every slot
+         * @param e endpoint to post on
+         */
+        inline void post_all(fid_ep *e) {
+            assert(buf.isRegistered());
+            ep = e;
+            for (size_t i = 0; i < ctxs.size(); i++) {
+                post(i);
+            }
+        }
+
+        /**
+         * Takes the oldest completed slot.
+         * @param v set to the message if there is one
+         * @return true if a message was ready
+         */
+        inline bool take(msg_view &v) {
+            if (ready.empty()) {
+                return false;
+            }
+            size_t idx = ready.front();
+            ready.pop_front();
+            v.data = buf.get() + idx * slotSize;
+            v.size = ctxs[idx].len;
+            v.slot = idx;
+            return true;
+        }
+
+        /**
+         * Returns a slot to the ring by posting its receive again
+         * @param v view from take
+         */
+        inline void release(const msg_view &v) {
+            assert(v.slot < ctxs.size());
+            post(v.slot);
+        }
+
+        /**
+         * Returns and clears the last error reported for a slot
+         * @return 0 or a positive fi_errno value
+         */
+        inline int take_error() {
+            int e = err;
+            err = 0;
+            return e;
+        }
+
+        /**
+         * Returns and clears the remote CQ data of the latest message that carried some
+         * @param d set to the data
+         * @return true if a message with data completed since the last call
+         */
+        inline bool take_data(uint64_t &d) {
+            if (!hasData) {
+                return false;
+            }
+            d = data;
+            hasData = false;
+            return true;
+        }
+
+        /**
+         * Size of each slot
+         * @return slot size
+         */
+        [[nodiscard]] inline size_t slot_size() const {
+            return slotSize;
+        }
+
+        /**
+         * Number of slots
+         * @return slots
+         */
+        [[nodiscard]] inline size_t slots() const {
+            return ctxs.size();
+        }
+
+    private:
+        struct slot_context : public op_context {
+            RecvRing *ring = nullptr;
+            size_t index = 0;
+            size_t len = 0;
+        };
+
+        static void complete_cb(op_context *ctx, const fi_cq_tagged_entry &entry) {
+            auto *slot = static_cast<slot_context *>(ctx);
+            slot->len = entry.len;
+            if (entry.flags & FI_REMOTE_CQ_DATA) {
+                slot->ring->data = entry.data;
+                slot->ring->hasData = true;
+            }
+            slot->ring->ready.push_back(slot->index);
+        }
+
+        static void error_cb(op_context *ctx, const fi_cq_err_entry &entry) {
+            auto *slot = static_cast<slot_context *>(ctx);
+            slot->ring->err = entry.err;
+            if (entry.err != FI_ECANCELED) {
+                slot->ring->post(slot->index);
+            }
+        }
+
+        inline void post(size_t idx) {
+            SAFE_CALL(fi_recv(ep, buf.get() + idx * slotSize, slotSize, buf.getDesc(), 0, &ctxs[idx]));
+        }
+
+        unique_buf buf;
+        const size_t slotSize;
+        std::vector<slot_context> ctxs;
+        std::deque<size_t> ready;
+        fid_ep *ep = nullptr;
+        int err = 0;
+        uint64_t data = 0;
+        bool hasData = false;
+    };
+
+}
+
+#endif //NETWORKLAYER_RECV_RING_HH
@@ -0,0 +1,90 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_REMOTE_SHARED_MEMORY_HH
+#define NETWORKLAYER_REMOTE_SHARED_MEMORY_HH
+
+#include "connection.hh"
+
+#include <networklayer/SharedMemory.hh>
+
+namespace cse498 {
+
+    /**
+     * SharedMemory backed by a T in memory the peer of a connection registered with
+     * FI_REMOTE_READ | FI_REMOTE_WRITE. Every operation is a single remote atomic, so counters and
+     * locks can live on another node without an RPC round trip.
+     *
+     * The connection must outlive this object. Check supported before use: operations on a T the
+     * provider cannot handle post nothing and return T().
+     */
+    template<typename T>
+    class RemoteSharedMemory final : public SharedMemory<T> {
+    public:
+        /**
+         * Refers to remote memory
+         * @param conn connection to the node holding the memory
+         * @param addr remote address of the T (see Connection::remote_address)
+         * @param key key of the remote registration
+         */
+        RemoteSharedMemory(Connection &conn, uint64_t addr, uint64_t key) : conn(conn), addr(addr), key(key),
+                                                                          ok(conn.supports_atomics<T>()) {
+            if (!ok) {
+                DO_LOG(ERROR) << "Provider does not support remote atomics on this type";
+            }
+        }
+
+        ~RemoteSharedMemory() {}
+
+        /**
+         * Whether the provider supports every operation on T, checked once on construction
+         * @return true if operations can be used
+         */
+        [[nodiscard]] bool supported() const {
+            return ok;
+        }
+
+        T load() {
+            if (!ok) {
+                return T();
+            }
+            return conn.atomic_load<T>(addr, key);
+        }
+
+        void store(T t) {
+            if (!ok) {
+                return;
+            }
+            conn.atomic_store(t, addr, key);
+        }
+
+        T compare_and_swap(T expected, T desired) {
+            if (!ok) {
+                return T();
+            }
+            return conn.compare_and_swap(expected, desired, addr, key);
+        }
+
+        /**
+         * Atomically add to the remote memory
+         * @param t value to add
+         * @return value before the add
+         */
+        T fetch_add(T t) {
+            if (!ok) {
+                return T();
+            }
+            return conn.fetch_add(t, addr, key);
+        }
+
+    private:
+        Connection &conn;
+        const uint64_t addr;
+        const uint64_t key;
+        const bool ok;
+    };
+
+}
+
+#endif //NETWORKLAYER_REMOTE_SHARED_MEMORY_HH
@@ -0,0 +1,377 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_RING_CHANNEL_HH
+#define NETWORKLAYER_RING_CHANNEL_HH
+
+#include "connection.hh"
+#include "recv_ring.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+
+namespace cse498 {
+
+    /**
+     * Default size of the ring a RingReceiver exposes
+     */
+    const size_t DEFAULT_RING_CHANNEL_SIZE = 1 << 20;
+
+    /**
+     * Most writes a RingSender keeps in flight before waiting for the oldest
+     */
+    const size_t RING_CHANNEL_WINDOW = 16;
+
+    namespace ring_channel {
+
+        // Sent by the receiver when the channel is set up
+        struct ring_setup {
+            uint64_t addr;
+            uint64_t key;
+            uint64_t capacity;
+        };
+
+        // Sent back by the sender
+        struct credit_setup {
+            uint64_t addr;
+            uint64_t key;
+        };
+
+        // Length stamped on the record that skips the rest of the ring
+        const uint32_t PAD = UINT32_MAX;
+
+        // Header and trailer around every record
+        const size_t OVERHEAD = 2 * sizeof(uint64_t);
+
+        inline size_t round_up(size_t len) {
+            return (len + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+        }
+
+        // Memory written by the NIC has to be read through a volatile load
+        inline uint64_t load(const char *p) {
+            uint64_t v = *(volatile const uint64_t *) p;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return v;
+        }
+
+        inline void store(char *p, uint64_t v) {
+            memcpy(p, &v, sizeof(v));
+        }
+
+        inline uint32_t next_seq(uint32_t seq) {
+            return seq == UINT32_MAX ? 1 : seq + 1;
+        }
+
+        // Stamped after the payload. Mixes the header with the position of the record in the stream,
+        // so bytes left over from an earlier lap cannot pass for the trailer of a new record.
+        inline uint64_t trailer(uint64_t header, uint64_t pos) {
+            uint64_t x = header ^ (pos * 0x9E3779B97F4A7C15ULL);
+            x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+            return x ^ (x >> 31);
+        }
+
+    }
+
+    /**
+     * Receiving end of a one-sided channel. Exposes a registered ring that the RingSender on the
+     * other side of the connection writes records into with RDMA writes; records are found by polling
+     * local memory, so no receive is ever posted. Space is handed back to the sender by writing the
+     * consumed position into its memory.
+     *
+     * Each record starts with its sequence number and length and ends with a trailer derived from them
+     * and from its position, and is complete once both are in place. This relies on the provider placing the bytes of a write in order,
+     * which sockets and verbs RC do.
+     */
+    class RingReceiver {
+    public:
+        /**
+         * Registers the ring and exchanges addresses with the RingSender constructed on the other
+         * side. Blocks until the sender answers.
+         * @param conn connected connection; must outlive the receiver
+         * @param capacity size of the ring in bytes, a multiple of 8
+         * @param key key to register the ring under, see register_mr
+         */
+        RingReceiver(Connection &conn, size_t capacity, uint64_t &key) : conn(conn), ring(capacity),
+                                                                          headBuf(sizeof(uint64_t)) {
+            assert(capacity % sizeof(uint64_t) == 0 && capacity >= 64);
+            memset(ring.get(), 0, capacity);
+            conn.register_mr(ring, FI_REMOTE_WRITE, key);
+            // Local buffers get keys of their own so they never replace a region of the caller
+            conn.register_mr_unique(headBuf, FI_WRITE);
+
+            unique_buf msg(sizeof(ring_channel::ring_setup));
+            conn.register_mr_unique(msg, FI_SEND | FI_RECV);
+            ring_channel::ring_setup setup = {conn.remote_address(ring), key, capacity};
+            msg.cpyTo((const char *) &setup, sizeof(setup));
+            conn.send(msg, sizeof(setup));
+
+            conn.recv(msg, sizeof(ring_channel::credit_setup));
+            ring_channel::credit_setup credit = {};
+            memcpy(&credit, msg.get(), sizeof(credit));
+            creditAddr = credit.addr;
+            creditKey = credit.key;
+            conn.deregister_mr(msg);
+        }
+
+        RingReceiver(const RingReceiver &) = delete;
+
+        RingReceiver &operator=(const RingReceiver &) = delete;
+
+        ~RingReceiver() {
+            conn.deregister_mr(ring);
+            conn.deregister_mr(headBuf);
+        }
+
+        /**
+         * Checks the ring for the next record without blocking. Hands space back to the sender when
+         * nothing has arrived.
+         * @param v set to a view of the record, valid until released
+         * @return true if a record was returned
+         */
+        inline bool try_recv(msg_view &v) {
+            const size_t capacity = ring.size();
+            while (true) {
+                size_t off = readPos % capacity;
+                uint64_t h = ring_channel::load(ring.get() + off);
+                if ((uint32_t) (h >> 32) != seq) {
+                    if (head != published) {
+                        publish();
+                    }
+                    return false;
+                }
+                auto len = (uint32_t) h;
+                if (len == ring_channel::PAD) {
+                    readPos += capacity - off;
+                    seq = ring_channel::next_seq(seq);
+                    if (outstanding == 0) {
+                        head = readPos;
+                    }
+                    continue;
+                }
+                size_t body = ring_channel::round_up(len);
+                // A header left over from an earlier lap may carry any length
+                if (ring_channel::OVERHEAD + body > capacity - off) {
+                    return false;
+                }
+                if (ring_channel::load(ring.get() + off + sizeof(uint64_t) + body) !=
+                    ring_channel::trailer(h, readPos)) {
+                    return false;
+                }
+                v.data = ring.get() + off + sizeof(uint64_t);
+                v.size = len;
+                // The slot of a ring channel view is where its record ends
+                v.slot = readPos + ring_channel::OVERHEAD + body;
+                readPos = v.slot;
+                seq = ring_channel::next_seq(seq);
+                ++outstanding;
+                return true;
+            }
+        }
+
+        /**
+         * Spins on the ring until the next record arrives
+         * @return view of the record, valid until released
+         */
+        inline msg_view recv() {
+            msg_view v;
+            while (!try_recv(v));
+            return v;
+        }
+
+        /**
+         * Hands the space of a record back. Views must be released in the order they were received.
+         * @param v view
+         */
+        inline void release(const msg_view &v) {
+            assert(outstanding > 0 && v.slot > head);
+            --outstanding;
+            head = outstanding == 0 ? readPos : v.slot;
+            if (head - published >= ring.size() / 4) {
+                publish();
+            }
+        }
+
+    private:
+        inline void publish() {
+            memcpy(headBuf.get(), &head, sizeof(head));
+            conn.write(headBuf, sizeof(head), creditAddr, creditKey);
+            published = head;
+        }
+
+        Connection &conn;
+        unique_buf ring;
+        unique_buf headBuf;
+        uint64_t creditAddr = 0;
+        uint64_t creditKey = 0;
+        // Positions count every byte that went through the ring
+        uint64_t readPos = 0;
+        uint64_t head = 0;
+        uint64_t published = 0;
+        uint32_t seq = 1;
+        size_t outstanding = 0;
+    };
+
+    /**
+     * Sending end of a one-sided channel, see RingReceiver. Records are staged in a local mirror of
+     * the remote ring and written in batches, so one RDMA write can carry many records.
+     */
+    class RingSender {
+    public:
+        /**
+         * Waits for the RingReceiver on the other side and registers the memory it writes credits
+         * into.
+         * @param conn connected connection; must outlive the sender
+         * @param key key to register the credit word under, see register_mr
+         */
+        RingSender(Connection &conn, uint64_t &key) : RingSender(conn, key, recv_setup(conn)) {}
+
+        RingSender(const RingSender &) = delete;
+
+        RingSender &operator=(const RingSender &) = delete;
+
+        ~RingSender() {
+            flush();
+            for (auto &c : pending) {
+                conn.wait(c);
+            }
+            conn.deregister_mr(mirror);
+            conn.deregister_mr(credit);
+        }
+
+        /**
+         * Stages a record without blocking. It is written once enough records are staged, or on
+         * flush.
+         * @param data payload
+         * @param len length of the payload, at most max_size()
+         * @return false if the ring has no room until the receiver frees some
+         */
+        inline bool try_send(const char *data, size_t len) {
+            assert(len <= max_size());
+            const size_t capacity = mirror.size();
+            size_t need = ring_channel::OVERHEAD + ring_channel::round_up(len);
+            size_t off = tail % capacity;
+            size_t pad = off + need > capacity ? capacity - off : 0;
+            uint64_t head = ring_channel::load(credit.get());
+            if (tail + pad + need - head > capacity) {
+                flush();
+                return false;
+            }
+
+            if (pad) {
+                ring_channel::store(mirror.get() + off, ((uint64_t) seq << 32) | ring_channel::PAD);
+                seq = ring_channel::next_seq(seq);
+                tail += pad;
+                // The rest of the lap has to go out before anything at the start of the ring
+                flush();
+                off = 0;
+            }
+            char *p = mirror.get() + off;
+            uint64_t h = ((uint64_t) seq << 32) | (uint32_t) len;
+            memcpy(p + sizeof(uint64_t), data, len);
+            ring_channel::store(p + sizeof(uint64_t) + ring_channel::round_up(len), ring_channel::trailer(h, tail));
+            ring_channel::store(p, h);
+            seq = ring_channel::next_seq(seq);
+            tail += need;
+
+            if (tail - flushed >= capacity / 8) {
+                flush();
+            }
+            return true;
+        }
+
+        /**
+         * Stages a record, waiting for room in the ring, and writes every staged record
+         * @param data payload
+         * @param len length of the payload, at most max_size()
+         */
+        inline void send(const char *data, size_t len) {
+            while (!try_send(data, len)) {
+                reap();
+            }
+            flush();
+        }
+
+        /**
+         * Writes every staged record to the receiver without waiting for the writes to complete
+         */
+        inline void flush() {
+            if (flushed == tail) {
+                return;
+            }
+            const size_t capacity = mirror.size();
+            size_t off = flushed % capacity;
+            // Staged records never cross the end of the ring, a pad record fills it instead
+            size_t len = tail - flushed;
+            assert(off + len <= capacity);
+            if (pending.size() >= RING_CHANNEL_WINDOW) {
+                SAFE_CALL(conn.wait(pending.front()));
+                pending.pop_front();
+            }
+            auto c = conn.async_write(mirror, len, ringAddr + off, ringKey, off);
+            SAFE_CALL(-c->error());
+            pending.push_back(std::move(c));
+            flushed = tail;
+            reap();
+        }
+
+        /**
+         * Largest payload a record can carry
+         * @return size
+         */
+        [[nodiscard]] inline size_t max_size() const {
+            return mirror.size() / 2 - ring_channel::OVERHEAD;
+        }
+
+    private:
+        RingSender(Connection &conn, uint64_t &key, ring_channel::ring_setup setup) : conn(conn),
+                                                                                      mirror(setup.capacity),
+                                                                                      credit(sizeof(uint64_t)),
+                                                                                      ringAddr(setup.addr),
+                                                                                      ringKey(setup.key) {
+            memset(credit.get(), 0, credit.size());
+            // Local buffers get keys of their own so they never replace a region of the caller
+            conn.register_mr_unique(mirror, FI_WRITE);
+            conn.register_mr(credit, FI_REMOTE_WRITE, key);
+
+            unique_buf msg(sizeof(ring_channel::credit_setup));
+            conn.register_mr_unique(msg, FI_SEND);
+            ring_channel::credit_setup reply = {conn.remote_address(credit), key};
+            msg.cpyTo((const char *) &reply, sizeof(reply));
+            conn.send(msg, sizeof(reply));
+            conn.deregister_mr(msg);
+        }
+
+        static inline ring_channel::ring_setup recv_setup(Connection &conn) {
+            unique_buf msg(sizeof(ring_channel::ring_setup));
+            conn.register_mr_unique(msg, FI_RECV);
+            conn.recv(msg, sizeof(ring_channel::ring_setup));
+            ring_channel::ring_setup setup = {};
+            memcpy(&setup, msg.get(), sizeof(setup));
+            conn.deregister_mr(msg);
+            return setup;
+        }
+
+        inline void reap() {
+            while (!pending.empty() && conn.test(pending.front())) {
+                SAFE_CALL(-pending.front()->error());
+                pending.pop_front();
+            }
+        }
+
+        Connection &conn;
+        unique_buf mirror;
+        unique_buf credit;
+        uint64_t ringAddr = 0;
+        uint64_t ringKey = 0;
+        uint64_t tail = 0;
+        uint64_t flushed = 0;
+        uint32_t seq = 1;
+        std::deque<completion_t> pending;
+    };
+
+}
+
+#endif //NETWORKLAYER_RING_CHANNEL_HH
@@ -0,0 +1,81 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_SEGMENT_HH
+#define NETWORKLAYER_SEGMENT_HH
+
+#include <rdma/fi_errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace cse498 {
+
+    /**
+     * Most segments a single scatter-gather call accepts
+     */
+    const size_t MAX_SEGMENTS = 16;
+
+    /**
+     * Piece of a registered buffer used in scatter-gather calls
+     */
+    struct segment {
+        /**
+         * Start of the segment
+         */
+        char *addr;
+        /**
+         * Length of the segment
+         */
+        size_t len;
+        /**
+         * Descriptor of the buffer the segment is in
+         */
+        void *desc;
+    };
+
+    /**
+     * Create a segment from a registered buffer
+     * @param data registered buffer
+     * @param len length of the segment
+     * @param offset offset of the segment into the buffer
+     * @return segment
+     */
+    template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+    inline segment make_segment(buf_t &data, size_t len, size_t offset = 0) {
+        assert(data.isRegistered());
+        assert(offset + len <= data.size());
+        return {data.get() + offset, len, data.getDesc()};
+    }
+
+    /**
+     * Fill iovec and descriptor arrays from segments
+     * @param segs segments
+     * @param limit most segments the provider takes in one call (its iov_limit)
+     * @param iov array of at least MAX_SEGMENTS iovecs
+     * @param desc array of at least MAX_SEGMENTS descriptors
+     * @return total length of the segments, or -FI_EINVAL if there are none or more than
+     * min(limit, MAX_SEGMENTS)
+     */
+    inline ssize_t to_iov(const std::vector<segment> &segs, size_t limit, iovec *iov, void **desc) {
+        if (segs.empty() || segs.size() > std::min(limit, MAX_SEGMENTS)) {
+            return -FI_EINVAL;
+        }
+        size_t total = 0;
+        for (size_t i = 0; i < segs.size(); i++) {
+            iov[i].iov_base = segs[i].addr;
+            iov[i].iov_len = segs[i].len;
+            desc[i] = segs[i].desc;
+            total += segs[i].len;
+        }
+        return (ssize_t) total;
+    }
+
+}
+
+#endif //NETWORKLAYER_SEGMENT_HH
@@ -13,6 +13,7 @@
 #include <cassert>
 #include <string>
 #include <atomic>
+#include "unique_buf.hh"
 
 namespace cse498 {
 
@@ -29,6 +30,7 @@ namespace cse498 {
             registered = new std::atomic_bool(false);
             key_ = new std::atomic_int64_t();
             desc = new std::atomic<void*>(nullptr);
+            regOffset_ = new std::atomic<size_t>(0);
         }
 
         /**
@@ -39,6 +41,24 @@ namespace cse498 {
             registered = new std::atomic_bool(false);
             key_ = new std::atomic_int64_t();
             desc = new std::atomic<void*>(nullptr);
+            regOffset_ = new std::atomic<size_t>(0);
+        }
+
+        /**
+         * Adopt memory owned by someone else; release is called with owner instead of delete[] once
+         * the last reference is gone
+         * @param mem memory
+         * @param s size
+         * @param owner passed to release
+         * @param release gives mem back to owner
+         */
+        shared_buf(char *mem, size_t s, void *owner, buf_release_t release) : buf(mem), s_(s),
+                                                                             refCount(new std::atomic_uint32_t(1)) {
+            registered = new std::atomic_bool(false);
+            key_ = new std::atomic_int64_t();
+            desc = new std::atomic<void*>(nullptr);
+            regOffset_ = new std::atomic<size_t>(0);
+            owner_ = new std::pair<void *, buf_release_t>(owner, release);
         }
 
         shared_buf(const shared_buf &other) {
@@ -49,6 +69,8 @@ namespace cse498 {
             registered = other.registered;
             key_ = other.key_;
             desc = other.desc;
+            regOffset_ = other.regOffset_;
+            owner_ = other.owner_;
             refCount = other.refCount;
         }
 
@@ -60,17 +82,15 @@ namespace cse498 {
             key_ = other.key_;
             desc = other.desc;
             other.desc = nullptr;
+            regOffset_ = other.regOffset_;
+            owner_ = other.owner_;
             refCount = other.refCount;
             other.refCount = nullptr;
         }
 
         ~shared_buf() {
             if (refCount && refCount->fetch_add(-1) == 1) {
-                delete[] buf;
-                delete refCount;
-                delete registered;
-                delete key_;
-                delete desc;
+                destroy();
             }
         }
 
@@ -80,11 +100,7 @@ namespace cse498 {
             }
 
             if (refCount && refCount->fetch_add(-1) == 1) {
-                delete[] buf;
-                delete refCount;
-                delete registered;
-                delete key_;
-                delete desc;
+                destroy();
             }
 
             other.refCount->fetch_add(1);
@@ -94,6 +110,8 @@ namespace cse498 {
             registered = other.registered;
             key_ = other.key_;
             desc = other.desc;
+            regOffset_ = other.regOffset_;
+            owner_ = other.owner_;
             refCount = other.refCount;
             return *this;
         }
@@ -104,11 +122,7 @@ namespace cse498 {
             }
 
             if (refCount && refCount->fetch_add(-1) == 1) {
-                delete[] buf;
-                delete refCount;
-                delete registered;
-                delete key_;
-                delete desc;
+                destroy();
             }
 
             buf = other.buf;
@@ -118,6 +132,8 @@ namespace cse498 {
             key_ = other.key_;
             desc = other.desc;
             other.desc = nullptr;
+            regOffset_ = other.regOffset_;
+            owner_ = other.owner_;
             refCount = other.refCount;
             other.refCount = nullptr;
             return *this;
@@ -193,11 +209,13 @@ namespace cse498 {
          * Callback for when memory is registered
          * @param key
          * @param d
+         * @param offset offset of the buffer into the registered region
          */
-        inline void registerMemoryCallback(uint64_t key, void *d) {
+        inline void registerMemoryCallback(uint64_t key, void *d, size_t offset = 0) {
             registered->store(true);
             key_->store(key);
             desc->store(d);
+            regOffset_->store(offset);
         }
 
         /**
@@ -233,12 +251,36 @@ namespace cse498 {
             return registered->load();
         }
 
+        /**
+         * Offset of the buffer into its registered region (nonzero for buffers carved out of a pool)
+         * @return
+         */
+        [[nodiscard]] inline size_t regOffset() const {
+            return regOffset_->load();
+        }
+
     private:
+        inline void destroy() {
+            if (owner_) {
+                owner_->second(owner_->first, buf);
+            } else {
+                delete[] buf;
+            }
+            delete refCount;
+            delete registered;
+            delete key_;
+            delete desc;
+            delete regOffset_;
+            delete owner_;
+        }
+
         char *buf;
         size_t s_;
         std::atomic_bool *registered;
         std::atomic_int64_t *key_;
         std::atomic<void *> *desc = nullptr;
+        std::atomic<size_t> *regOffset_ = nullptr;
+        std::pair<void *, buf_release_t> *owner_ = nullptr;
         std::atomic_uint32_t *refCount;
     };
 
@@ -0,0 +1,340 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_SUBMIT_QUEUE_HH
+#define NETWORKLAYER_SUBMIT_QUEUE_HH
+
+#include "connection.hh"
+#include "completion.hh"
+#include "segment.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace cse498 {
+
+    /**
+     * Default number of requests a SubmitQueue holds before producers have to wait
+     */
+    const size_t DEFAULT_SUBMIT_QUEUE_SIZE = 1024;
+
+    /**
+     * Most requests posted back to back with FI_MORE before the provider is told to go
+     */
+    const size_t SUBMIT_BATCH = 16;
+
+    /**
+     * Called once a request from a SubmitQueue has completed, on the thread polling the connection
+     * @param err 0 on success or a positive fi_errno value
+     * @param len bytes reported by the completion
+     */
+    using submit_callback_t = std::function<void(int err, size_t len)>;
+
+    /**
+     * Front end that lets many threads share a connection without a lock. Producers push sends,
+     * writes and reads into a bounded lock-free queue; a single progress thread calls progress, which
+     * posts them in batches with FI_MORE and retires their completions. Each request carries a
+     * callback that runs when it completes.
+     *
+     * Only the progress thread may use the connection itself while the queue is in use. The queue
+     * must not outlive the connection, and buffers must stay untouched until their callback runs.
+     */
+    class SubmitQueue {
+    public:
+        /**
+         * @param conn connected connection
+         * @param capacity requests the queue holds, rounded up to a power of two
+         */
+        explicit SubmitQueue(Connection &conn, size_t capacity = DEFAULT_SUBMIT_QUEUE_SIZE)
+                : conn(conn), cells(roundUp(capacity)), mask(cells.size() - 1),
+                  window(conn.limits.tx_size) {
+            assert(!conn.flow);
+            for (size_t i = 0; i < cells.size(); i++) {
+                cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        SubmitQueue(const SubmitQueue &) = delete;
+
+        SubmitQueue &operator=(const SubmitQueue &) = delete;
+
+        ~SubmitQueue() {
+            // Contexts of requests in flight are still held by the provider
+            while (!idle()) {
+                progress();
+            }
+        }
+
+        /**
+         * Queues a send without blocking. Safe to call from any thread.
+         * @param data registered buffer
+         * @param size
+         * @param offset offset into buffer
+         * @param done called once the send completes
+         * @return false if the queue is full
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool try_send(buf_t &data, size_t size, size_t offset, submit_callback_t done) {
+            assert(data.isRegistered() && size <= conn.limits.max_msg_size);
+            return push({SEND, {data.get() + offset, size, data.getDesc()}, 0, 0, std::move(done)});
+        }
+
+        /**
+         * Queues a write without blocking, see Connection::async_write. Safe to call from any thread.
+         * @param data registered buffer
+         * @param size
+         * @param addr remote address
+         * @param key remote key
+         * @param offset offset into buffer
+         * @param done called once the write completes
+         * @return false if the queue is full
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool try_write(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset,
+                              submit_callback_t done) {
+            assert(data.isRegistered());
+            return push({WRITE, {data.get() + offset, size, data.getDesc()}, addr, key, std::move(done)});
+        }
+
+        /**
+         * Queues a read without blocking, see Connection::async_read. Safe to call from any thread.
+         * @param data registered buffer
+         * @param size
+         * @param addr remote address
+         * @param key remote key
+         * @param offset offset into buffer
+         * @param done called once the read completes
+         * @return false if the queue is full
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool try_read(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset,
+                             submit_callback_t done) {
+            assert(data.isRegistered());
+            return push({READ, {data.get() + offset, size, data.getDesc()}, addr, key, std::move(done)});
+        }
+
+        /**
+         * Queues a send, yielding while the queue is full
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void send(buf_t &data, size_t size, size_t offset, submit_callback_t done) {
+            while (!try_send(data, size, offset, done)) {
+                std::this_thread::yield();
+            }
+        }
+
+        /**
+         * Queues a write, yielding while the queue is full
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void write(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset,
+                          submit_callback_t done) {
+            while (!try_write(data, size, addr, key, offset, done)) {
+                std::this_thread::yield();
+            }
+        }
+
+        /**
+         * Queues a read, yielding while the queue is full
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void read(buf_t &data, size_t size, uint64_t addr, uint64_t key, size_t offset,
+                         submit_callback_t done) {
+            while (!try_read(data, size, addr, key, offset, done)) {
+                std::this_thread::yield();
+            }
+        }
+
+        /**
+         * Posts queued requests while the send window has room, then retires completions. Requests are
+         * posted with FI_MORE while more are ready behind them; a post that has to be retried, and the
+         * first post after one that failed, go out without it. Only one thread may call this.
+         * @return number of requests posted
+         */
+        inline size_t progress() {
+            size_t posted = 0;
+            request r;
+            while (inflight.load(std::memory_order_relaxed) < window && pop(r)) {
+                // Hold the doorbell while more requests are ready to go out right behind this one, but
+                // ring it on the next post once a failure left requests sent with FI_MORE waiting
+                bool more = !stalled && (posted + 1) % SUBMIT_BATCH != 0 &&
+                            inflight.load(std::memory_order_relaxed) + 1 < window && ready();
+                post(r, more ? FI_MORE : 0);
+                ++posted;
+            }
+            ERRREPORT(conn.txq.poll());
+            return posted;
+        }
+
+        /**
+         * Returns if every queued request has completed. Only the progress thread may call this.
+         * @return true if idle
+         */
+        [[nodiscard]] inline bool idle() const {
+            return tail.load(std::memory_order_acquire) == head && inflight.load(std::memory_order_acquire) == 0;
+        }
+
+    private:
+        enum op_t {
+            SEND,
+            WRITE,
+            READ
+        };
+
+        struct request {
+            op_t op;
+            segment seg;
+            uint64_t addr;
+            uint64_t key;
+            submit_callback_t done;
+        };
+
+        struct cell {
+            std::atomic<size_t> seq{0};
+            request req;
+        };
+
+        // Context of a posted request; freed once its completion is read
+        struct posted_request : public op_context {
+            SubmitQueue *queue;
+            submit_callback_t done;
+        };
+
+        static inline size_t roundUp(size_t capacity) {
+            size_t n = 2;
+            while (n < capacity) {
+                n <<= 1;
+            }
+            return n;
+        }
+
+        // Bounded multi-producer queue: a cell is free for position pos when its sequence is pos and
+        // holds a request once it is pos + 1
+        inline bool push(request r) {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            while (true) {
+                cell &c = cells[pos & mask];
+                size_t seq = c.seq.load(std::memory_order_acquire);
+                auto diff = (intptr_t) seq - (intptr_t) pos;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        c.req = std::move(r);
+                        c.seq.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        inline bool ready() const {
+            return cells[head & mask].seq.load(std::memory_order_acquire) == head + 1;
+        }
+
+        inline bool pop(request &r) {
+            if (!ready()) {
+                return false;
+            }
+            cell &c = cells[head & mask];
+            r = std::move(c.req);
+            c.seq.store(head + cells.size(), std::memory_order_release);
+            ++head;
+            return true;
+        }
+
+        static void complete_cb(op_context *ctx, const fi_cq_tagged_entry &entry) {
+            auto *p = static_cast<posted_request *>(ctx);
+            p->queue->inflight.fetch_sub(1, std::memory_order_release);
+            if (p->done) {
+                p->done(0, entry.len);
+            }
+            delete p;
+        }
+
+        static void error_cb(op_context *ctx, const fi_cq_err_entry &entry) {
+            auto *p = static_cast<posted_request *>(ctx);
+            p->queue->inflight.fetch_sub(1, std::memory_order_release);
+            if (p->done) {
+                p->done(entry.err ? entry.err : FI_EINVAL, entry.len);
+            }
+            delete p;
+        }
+
+        inline void post(request &r, uint64_t flags) {
+            auto *p = new posted_request();
+            p->on_complete = &SubmitQueue::complete_cb;
+            p->on_error = &SubmitQueue::error_cb;
+            p->queue = this;
+            p->done = std::move(r.done);
+
+            iovec iov = {r.seg.addr, r.seg.len};
+            void *desc = r.seg.desc;
+            fi_rma_iov rma_iov = {r.addr, r.seg.len, r.key};
+            inflight.fetch_add(1, std::memory_order_relaxed);
+            ssize_t ret;
+            while (true) {
+                if (r.op == SEND) {
+                    fi_msg msg = {};
+                    msg.msg_iov = &iov;
+                    msg.desc = &desc;
+                    msg.iov_count = 1;
+                    msg.context = p;
+                    ret = fi_sendmsg(conn.ep, &msg, flags);
+                } else {
+                    fi_msg_rma msg = {};
+                    msg.msg_iov = &iov;
+                    msg.desc = &desc;
+                    msg.iov_count = 1;
+                    msg.rma_iov = &rma_iov;
+                    msg.rma_iov_count = 1;
+                    msg.context = p;
+                    ret = r.op == WRITE ? fi_writemsg(conn.ep, &msg, flags) : fi_readmsg(conn.ep, &msg, flags);
+                }
+                if (ret != -FI_EAGAIN) {
+                    break;
+                }
+                // Retry without FI_MORE so requests already posted with it go out and can complete
+                flags &= ~FI_MORE;
+                ret = conn.txq.poll();
+                if (ret < 0) {
+                    break;
+                }
+            }
+            if (ret < 0) {
+                DO_LOG(ERROR) << "Unable to post request: " << fi_strerror((int) -ret);
+                inflight.fetch_sub(1, std::memory_order_relaxed);
+                if (p->done) {
+                    p->done((int) -ret, 0);
+                }
+                delete p;
+                stalled = held;
+                return;
+            }
+            held = (flags & FI_MORE) != 0;
+            stalled = false;
+        }
+
+        Connection &conn;
+        std::vector<cell> cells;
+        const size_t mask;
+        const size_t window;
+        std::atomic<size_t> tail{0};
+        // Only the progress thread moves the head
+        size_t head = 0;
+        std::atomic<size_t> inflight{0};
+        // The last successful post carried FI_MORE, so the provider may still hold it back
+        bool held = false;
+        // A post failed while held was set; the next one must go out without FI_MORE
+        bool stalled = false;
+    };
+
+}
+
+#endif //NETWORKLAYER_SUBMIT_QUEUE_HH
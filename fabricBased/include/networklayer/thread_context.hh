@@ -0,0 +1,168 @@
+/**
+ * @file
+ */
+
+#ifndef NETWORKLAYER_THREAD_CONTEXT_HH
+#define NETWORKLAYER_THREAD_CONTEXT_HH
+
+#include "connection.hh"
+#include "completion.hh"
+
+namespace cse498 {
+
+    /**
+     * Sends and receives for one thread on a connection that other threads use at the same time.
+     * Every thread creates its own context; operations are posted straight to the connection's
+     * endpoint, which must be opened with FI_THREAD_SAFE (the threadSafe flag of the Connection
+     * constructors), and each context counts only its own completions. Whichever thread polls the
+     * shared completion queues first retires the entries of every thread, so no thread has to wrap
+     * the connection in a lock.
+     *
+     * MSG endpoints do not offer scalable endpoints, so the contexts share the endpoint and its
+     * completion queues instead of having transmit contexts of their own. Flow control, the receive
+     * ring, notices, remote atomics and registration stay single-threaded.
+     *
+     * A context must be used by one thread only and must not outlive the connection.
+     */
+    class ThreadContext {
+    public:
+        /**
+         * Creates a context for the calling thread
+         * @param conn connected connection created with threadSafe set
+         */
+        explicit ThreadContext(Connection &conn) : conn(conn) {
+            assert(conn.thread_safe && !conn.flow && !conn.ring);
+        }
+
+        ThreadContext(const ThreadContext &) = delete;
+
+        ThreadContext &operator=(const ThreadContext &) = delete;
+
+        ~ThreadContext() {
+            // The provider still holds the counters of anything in flight
+            wait_for_sends();
+        }
+
+        /**
+         * Posts a message without blocking, see Connection::async_send. data cannot be modified until
+         * wait_for_sends returns.
+         * @param data registered buffer
+         * @param size
+         * @param offset offset into buffer
+         * @return true on success
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool async_send(buf_t &data, size_t size, size_t offset = 0) {
+            assert(data.isRegistered());
+            if (size > conn.limits.max_msg_size) {
+                DO_LOG(ERROR) << "Too large of a message! Use send_stream instead.";
+                return false;
+            }
+            ssize_t ret = post(conn.txq, [&]() {
+                return fi_send(conn.ep, data.get() + offset, size, data.getDesc(), 0, &tx);
+            });
+            if (ret == 0) {
+                ++sends;
+            }
+            return ERRREPORT(ret);
+        }
+
+        /**
+         * Sends a message, blocking until data can be reused
+         * @param data registered buffer
+         * @param size
+         * @param offset offset into buffer
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void send(buf_t &data, size_t size, size_t offset = 0) {
+            if (size <= conn.limits.inject_size) {
+                SAFE_CALL(inject_msg(data.get() + offset, size));
+                return;
+            }
+            async_send(data, size, offset);
+            wait_for_sends();
+        }
+
+        /**
+         * Sends a message of at most inject_size bytes, see Connection::inject
+         * @param data buffer; does not need to be registered
+         * @param size
+         * @param offset offset into buffer
+         * @return true on success
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline bool inject(buf_t &data, size_t size, size_t offset = 0) {
+            if (size > conn.limits.inject_size) {
+                DO_LOG(ERROR) << "Too large of a message to inject!";
+                return false;
+            }
+            return ERRREPORT(inject_msg(data.get() + offset, size));
+        }
+
+        /**
+         * Blocks until every message this context posted has been sent
+         */
+        inline void wait_for_sends() {
+            while (sends > 0) {
+                SAFE_CALL(conn.txq.wait_until([this]() { return tx.ready() > 0; }));
+                SAFE_CALL(tx.take());
+                --sends;
+            }
+        }
+
+        /**
+         * Blocks until a message arrives. Messages go to whichever thread's receive was posted first.
+         * @param data registered buffer
+         * @param max_len largest message that fits
+         * @param offset offset into buffer
+         */
+        template<typename buf_t, std::enable_if_t<!std::is_same<char *, buf_t>::value> * = nullptr>
+        inline void recv(buf_t &data, size_t max_len, size_t offset = 0) {
+            assert(data.isRegistered());
+            SAFE_CALL(post(conn.rxq, [&]() {
+                return fi_recv(conn.ep, data.get() + offset, max_len, data.getDesc(), 0, &rx);
+            }));
+            SAFE_CALL(conn.rxq.wait_until([this]() { return rx.ready() > 0; }));
+            SAFE_CALL(rx.take());
+        }
+
+        /**
+         * Number of messages posted by this context that have not been waited for
+         * @return count
+         */
+        [[nodiscard]] inline uint64_t pending_sends() const {
+            return sends;
+        }
+
+    private:
+        inline ssize_t inject_msg(const char *buf, size_t size) {
+            return post(conn.txq, [&]() { return fi_inject(conn.ep, buf, size, 0); });
+        }
+
+        /**
+         * Posts an operation, driving q while the provider has no room for it
+         * @return 0 on success, or a negative fi_errno value
+         */
+        template<typename post_t>
+        inline ssize_t post(CompletionQueue &q, post_t op) {
+            while (true) {
+                ssize_t ret = op();
+                if (ret != -FI_EAGAIN) {
+                    return ret;
+                }
+                int polled = q.poll();
+                if (polled < 0) {
+                    return polled;
+                }
+            }
+        }
+
+        Connection &conn;
+        CompletionCounter tx;
+        CompletionCounter rx;
+        uint64_t sends = 0;
+    };
+
+}
+
+#endif //NETWORKLAYER_THREAD_CONTEXT_HH
@@ -13,6 +13,11 @@
 
 namespace cse498 {
 
+    /**
+     * Gives memory adopted by a buffer back to its owner (e.g. a BufferPool) instead of deleting it
+     */
+    using buf_release_t = void (*)(void *owner, char *buf);
+
     /**
      * Unique buffer; uses the semantics of unique_ptr<char[]>
      */
@@ -30,12 +35,32 @@ namespace cse498 {
          */
         explicit unique_buf(size_t s) : buf(new char[s]), s_(s) {}
 
+        /**
+         * Adopt memory owned by someone else; release is called with owner instead of delete[] when
+         * the buffer is destroyed
+         * @param mem memory
+         * @param s size
+         * @param owner passed to release
+         * @param release gives mem back to owner
+         */
+        unique_buf(char *mem, size_t s, void *owner, buf_release_t release) : buf(mem), s_(s), owner(owner),
+                                                                             release(release) {}
+
         unique_buf(const unique_buf &) = delete;
 
-        unique_buf(unique_buf &&other) = default;
+        unique_buf(unique_buf &&other) : buf(other.buf), s_(other.s_), owner(other.owner), release(other.release),
+                                         registered(other.registered), key_(other.key_), desc(other.desc),
+                                         regOffset_(other.regOffset_) {
+            other.buf = nullptr;
+            other.release = nullptr;
+        }
 
         ~unique_buf() {
-            delete[] buf;
+            if (release) {
+                release(owner, buf);
+            } else {
+                delete[] buf;
+            }
         }
 
         /**
@@ -108,11 +133,13 @@ namespace cse498 {
          * Callback for when memory is registered
          * @param key
          * @param d
+         * @param offset offset of the buffer into the registered region
          */
-        inline void registerMemoryCallback(uint64_t key, void *d) {
+        inline void registerMemoryCallback(uint64_t key, void *d, size_t offset = 0) {
             registered = true;
             key_ = key;
             desc = d;
+            regOffset_ = offset;
         }
 
         /**
@@ -148,12 +175,23 @@ namespace cse498 {
             return registered;
         }
 
+        /**
+         * Offset of the buffer into its registered region (nonzero for buffers carved out of a pool)
+         * @return
+         */
+        [[nodiscard]] inline size_t regOffset() const {
+            return regOffset_;
+        }
+
     private:
         char *buf;
         const size_t s_;
+        void *owner = nullptr;
+        buf_release_t release = nullptr;
         bool registered = false;
         uint64_t key_;
         void *desc = nullptr;
+        size_t regOffset_ = 0;
     };
 
 }
@@ -0,0 +1,238 @@
+#include <networklayer/completion.hh>
+#include <networklayer/fabricBased.hh>
+#include <rdma/fi_endpoint.h>
+#include <gtest/gtest.h>
+#include <cstring>
+#include <vector>
+
+int LOG_LEVEL = DEBUG;
+
+/**
+ * RDM endpoint that sends to itself, so completion queues can be filled without a peer
+ */
+struct Loopback {
+    fi_info *hints = nullptr;
+    fi_info *fi = nullptr;
+    fid_fabric *fabric = nullptr;
+    fid_domain *domain = nullptr;
+    fid_cq *tx_cq = nullptr;
+    fid_cq *rx_cq = nullptr;
+    fid_av *av = nullptr;
+    fid_ep *ep = nullptr;
+    fi_addr_t self = FI_ADDR_UNSPEC;
+
+    explicit Loopback(int port) {
+        hints = fi_allocinfo();
+        hints->caps = FI_MSG;
+        hints->ep_attr->type = FI_EP_RDM;
+        hints->ep_attr->protocol = FI_PROTO_SOCK_TCP;
+        ERRCHK(fi_getinfo(FI_VERSION(MAJOR_VERSION_USED, MINOR_VERSION_USED), "127.0.0.1",
+                          std::to_string(port).c_str(), FI_SOURCE, hints, &fi));
+        ERRCHK(fi_fabric(fi->fabric_attr, &fabric, nullptr));
+        ERRCHK(fi_domain(fabric, fi, &domain, nullptr));
+
+        fi_cq_attr cq_attr = {};
+        cq_attr.wait_obj = FI_WAIT_NONE;
+        cq_attr.format = FI_CQ_FORMAT_TAGGED;
+        cq_attr.size = fi->tx_attr->size;
+        ERRCHK(fi_cq_open(domain, &cq_attr, &tx_cq, nullptr));
+        cq_attr.size = fi->rx_attr->size;
+        ERRCHK(fi_cq_open(domain, &cq_attr, &rx_cq, nullptr));
+
+        fi_av_attr av_attr = {};
+        av_attr.type = fi->domain_attr->av_type ? fi->domain_attr->av_type : FI_AV_MAP;
+        av_attr.count = 1;
+        ERRCHK(fi_av_open(domain, &av_attr, &av, nullptr));
+
+        ERRCHK(fi_endpoint(domain, fi, &ep, nullptr));
+        ERRCHK(fi_ep_bind(ep, &av->fid, 0));
+        ERRCHK(fi_ep_bind(ep, &rx_cq->fid, FI_RECV));
+        ERRCHK(fi_ep_bind(ep, &tx_cq->fid, FI_TRANSMIT));
+        ERRCHK(fi_enable(ep));
+
+        char name[256];
+        size_t len = sizeof(name);
+        ERRCHK(fi_getname(&ep->fid, name, &len));
+        if (1 != fi_av_insert(av, name, 1, &self, 0, nullptr)) {
+            ERRCHK(-FI_EINVAL);
+        }
+    }
+
+    ~Loopback() {
+        ERRCHK(fi_close(&ep->fid));
+        ERRCHK(fi_close(&av->fid));
+        ERRCHK(fi_close(&rx_cq->fid));
+        ERRCHK(fi_close(&tx_cq->fid));
+        ERRCHK(fi_close(&domain->fid));
+        ERRCHK(fi_close(&fabric->fid));
+        fi_freeinfo(fi);
+        fi_freeinfo(hints);
+    }
+
+    void recv(char *buf, size_t len, void *ctx = nullptr) {
+        ssize_t ret;
+        while ((ret = fi_recv(ep, buf, len, nullptr, FI_ADDR_UNSPEC, ctx)) == -FI_EAGAIN);
+        ERRCHK(ret);
+    }
+
+    void send(char *buf, size_t len, void *ctx = nullptr) {
+        ssize_t ret;
+        while ((ret = fi_send(ep, buf, len, nullptr, self, ctx)) == -FI_EAGAIN);
+        ERRCHK(ret);
+    }
+};
+
+/**
+ * Polls until count entries have been retired
+ * @return largest number of entries a single poll retired
+ */
+int drain(cse498::CompletionQueue &q, int count, size_t max = 0) {
+    int largest = 0;
+    while (count > 0) {
+        int ret = q.poll(max);
+        EXPECT_GE(ret, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        largest = std::max(largest, ret);
+        count -= ret;
+    }
+    return largest;
+}
+
+TEST(completionTest, completion_batching) {
+    DO_LOG(DEBUG);
+    Loopback lb(8095);
+    cse498::CompletionQueue txq(lb.tx_cq, FI_CQ_FORMAT_TAGGED, 4);
+    cse498::CompletionQueue rxq(lb.rx_cq, FI_CQ_FORMAT_TAGGED, 4);
+
+    std::vector<char> buf(16 * 8);
+    for (int i = 0; i < 16; i++) {
+        lb.recv(buf.data() + 8 * i, 8);
+    }
+    for (int i = 0; i < 16; i++) {
+        lb.send(buf.data() + 8 * i, 8);
+    }
+
+    // Never reads more than the batch or the requested maximum
+    ASSERT_LE(drain(txq, 16), 4);
+    ASSERT_LE(drain(rxq, 16, 2), 2);
+    ASSERT_EQ(16, txq.pending());
+    ASSERT_EQ(16, rxq.pending());
+    ASSERT_EQ(0, txq.poll());
+}
+
+TEST(completionTest, completion_unclaimed) {
+    DO_LOG(DEBUG);
+    Loopback lb(8096);
+    cse498::CompletionQueue txq(lb.tx_cq, FI_CQ_FORMAT_TAGGED);
+    cse498::CompletionQueue rxq(lb.rx_cq, FI_CQ_FORMAT_TAGGED);
+
+    char buf[16];
+    lb.recv(buf, 8);
+    lb.recv(buf + 8, 8);
+    lb.send(buf, 8);
+    lb.send(buf + 8, 8);
+
+    // Entries without a context or handler are banked and handed out one at a time
+    ASSERT_EQ(0, rxq.wait_for_completion());
+    ASSERT_EQ(0, rxq.wait_for_completion());
+    ASSERT_EQ(0, rxq.pending());
+    drain(txq, 2);
+    ASSERT_EQ(2, txq.pending());
+    ASSERT_EQ(0, txq.wait_for_completion());
+    ASSERT_EQ(1, txq.pending());
+}
+
+TEST(completionTest, completion_handlers) {
+    DO_LOG(DEBUG);
+    Loopback lb(8097);
+    cse498::CompletionQueue txq(lb.tx_cq, FI_CQ_FORMAT_TAGGED);
+    cse498::CompletionQueue rxq(lb.rx_cq, FI_CQ_FORMAT_TAGGED);
+
+    int sends = 0, recvs = 0, other = 0;
+    size_t received = 0;
+    txq.on(FI_SEND, [&sends](const fi_cq_tagged_entry &) { sends++; });
+    rxq.on(FI_RECV, [&other](const fi_cq_tagged_entry &) { other++; });
+    // Registering again replaces the handler
+    rxq.on(FI_RECV, [&recvs, &received](const fi_cq_tagged_entry &e) {
+        recvs++;
+        received += e.len;
+    });
+    // Handlers are tried in registration order, so the catch-all only gets what FI_RECV does not match
+    rxq.on(0, [&other](const fi_cq_tagged_entry &) { other++; });
+
+    char buf[4 * 8];
+    for (int i = 0; i < 4; i++) {
+        lb.recv(buf + 8 * i, 8);
+    }
+    for (int i = 0; i < 4; i++) {
+        lb.send(buf + 8 * i, 8);
+    }
+    drain(txq, 4);
+    drain(rxq, 4);
+
+    ASSERT_EQ(4, sends);
+    ASSERT_EQ(4, recvs);
+    ASSERT_EQ(32, received);
+    ASSERT_EQ(0, other);
+    ASSERT_EQ(0, txq.pending());
+    ASSERT_EQ(0, rxq.pending());
+
+    // Entries with a context go to the context rather than a handler
+    auto c = std::make_shared<cse498::Completion>();
+    c->posted(c);
+    lb.recv(buf, 8);
+    lb.send(buf, 8, c.get());
+    ASSERT_EQ(0, txq.wait_until([&c]() { return c->done(); }));
+    ASSERT_TRUE(c->ok());
+    ASSERT_EQ(4, sends);
+    drain(rxq, 1);
+}
+
+TEST(completionTest, completion_errors) {
+    DO_LOG(DEBUG);
+    Loopback lb(8098);
+    cse498::CompletionQueue txq(lb.tx_cq, FI_CQ_FORMAT_TAGGED);
+    cse498::CompletionQueue rxq(lb.rx_cq, FI_CQ_FORMAT_TAGGED);
+
+    char small[4], big[16];
+    memset(big, 1, sizeof(big));
+
+    // Without an error handler the error is returned from poll
+    lb.recv(small, sizeof(small));
+    lb.send(big, sizeof(big));
+    int ret;
+    while ((ret = rxq.poll()) == 0);
+    ASSERT_LT(ret, 0);
+    // The sender may or may not see the truncation as an error
+    while (txq.poll() == 0);
+
+    // With one the entry is handed to it and counts as retired
+    int errors = 0;
+    int err = 0;
+    rxq.on_error([&errors, &err](const fi_cq_err_entry &e) {
+        errors++;
+        err = e.err;
+    });
+    lb.recv(small, sizeof(small));
+    lb.send(big, sizeof(big));
+    while ((ret = rxq.poll()) == 0);
+    ASSERT_EQ(1, ret);
+    ASSERT_EQ(1, errors);
+    ASSERT_EQ(FI_ETRUNC, err);
+    ASSERT_EQ(0, rxq.pending());
+    // The sender may or may not see the truncation as an error
+    while (txq.poll() == 0);
+
+    // Errors for entries with a context go to the context
+    auto c = std::make_shared<cse498::Completion>();
+    c->posted(c);
+    lb.recv(small, sizeof(small), c.get());
+    lb.send(big, sizeof(big));
+    ASSERT_EQ(0, rxq.wait_until([&c]() { return c->done(); }));
+    ASSERT_EQ(FI_ETRUNC, c->error());
+    ASSERT_EQ(1, errors);
+    // The sender may or may not see the truncation as an error
+    while (txq.poll() == 0);
+}
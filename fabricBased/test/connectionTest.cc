@@ -1,6 +1,15 @@
 #include <networklayer/connection.hh>
+#include <networklayer/reactor.hh>
+#include <networklayer/buf_pool.hh>
+#include <networklayer/remote_shared_memory.hh>
+#include <networklayer/ring_channel.hh>
+#include <networklayer/multi_rail.hh>
+#include <networklayer/thread_context.hh>
+#include <networklayer/submit_queue.hh>
+#include <networklayer/connection_pool.hh>
 #include <gtest/gtest.h>
 #include <future>
+#include <set>
 #include <atomic>
 #include <chrono>
 #include <thread>
@@ -39,6 +48,135 @@ TEST(connectionTest, connection_async_send_recv) {
     delete c2;
 }
 
+TEST(connectionTest, connection_inject) {
+    DO_LOG(DEBUG);
+
+    auto f = std::async([]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        // Injected buffers do not need to be registered
+        cse498::unique_buf buf;
+        bool injecting = sizeof(uint64_t) <= c1->inject_size();
+        if (!injecting) {
+            uint64_t key = 1;
+            c1->register_mr(buf, FI_SEND, key);
+        }
+        for (uint64_t i = 0; i < 4; i++) {
+            ((uint64_t *) buf.get())[0] = i;
+            if (injecting) {
+                ASSERT_TRUE(c1->inject(buf, sizeof(uint64_t)));
+            } else {
+                c1->send(buf, sizeof(uint64_t));
+            }
+        }
+        ASSERT_TRUE(c1->try_wait_for_sends());
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf;
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_RECV, key);
+    for (uint64_t i = 0; i < 4; i++) {
+        c2->recv(buf, 128);
+        ASSERT_EQ(i, ((uint64_t *) buf.get())[0]);
+    }
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_inject_behind_backlog) {
+    DO_LOG(DEBUG);
+    const uint64_t maxMsgs = 1 << 16;
+    const uint64_t last = ~0ULL;
+
+    auto f = std::async([maxMsgs, last]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        cse498::unique_buf buf(maxMsgs * sizeof(uint64_t));
+        uint64_t key = 1;
+        c1->register_mr(buf, FI_SEND, key);
+        // Nothing retires sends here, so the window fills and the rest are queued
+        uint64_t i = 0;
+        for (; i < maxMsgs && c1->backlog_size() == 0; i++) {
+            ((uint64_t *) buf.get())[i] = i;
+            ASSERT_TRUE(c1->async_send(buf, sizeof(uint64_t), i * sizeof(uint64_t)));
+        }
+        ASSERT_LT(0, c1->backlog_size());
+        // Injected, but only after everything queued before it
+        cse498::unique_buf small;
+        key = 2;
+        c1->register_mr(small, FI_SEND, key);
+        ASSERT_LE(sizeof(uint64_t), c1->inject_size());
+        ((uint64_t *) small.get())[0] = last;
+        c1->send(small, sizeof(uint64_t));
+        ASSERT_EQ(0, c1->backlog_size());
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf;
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_RECV, key);
+    uint64_t expected = 0;
+    while (true) {
+        c2->recv(buf, 128);
+        uint64_t v = ((uint64_t *) buf.get())[0];
+        if (v == last) {
+            break;
+        }
+        ASSERT_EQ(expected, v);
+        expected++;
+    }
+    ASSERT_LT(0, expected);
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_hybrid_wait) {
+    DO_LOG(DEBUG);
+    const std::string msg = "sleepy_potato\0";
+
+    auto f = std::async([&msg]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        c1->set_wait_policy(cse498::wait_policy::hybrid(std::chrono::microseconds(10)));
+        while (!c1->connect());
+
+        cse498::unique_buf buf;
+        buf.cpyTo(msg.c_str(), msg.length() + 1);
+        uint64_t key = 1;
+        c1->register_mr(buf, FI_SEND, key);
+        // Let the receiver run out of spin time and go to sleep
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        c1->send(buf, msg.length() + 1);
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    c2->set_wait_policy(cse498::wait_policy::hybrid(std::chrono::microseconds(10)));
+    while (!c2->connect());
+
+    cse498::unique_buf buf;
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_RECV, key);
+    c2->recv(buf, 128);
+    ASSERT_STREQ(msg.c_str(), buf.get());
+    f.get();
+    delete c2;
+}
+
 TEST(connectionTest, connection_try_recv) {
     DO_LOG(DEBUG);
     const std::string msg = "try_potato\0";
@@ -117,6 +255,157 @@ TEST(connectionTest, connection_wait_send_recv_response) {
     delete c2;
 }
 
+TEST(connectionTest, connection_recv_ring) {
+    DO_LOG(DEBUG);
+
+    auto f = std::async([]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect()) {
+            delete c1;
+            c1 = new cse498::Connection("127.0.0.1", false);
+        }
+
+        cse498::unique_buf buf;
+        uint64_t key = 1;
+        c1->register_mr(buf, FI_WRITE | FI_READ, key);
+
+        for (uint64_t i = 0; i < 17; i++) {
+            ((uint64_t *) buf.get())[i] = i;
+            c1->async_send(buf, sizeof(uint64_t), i * sizeof(uint64_t));
+        }
+        c1->wait_for_sends();
+
+        c1->recv(buf, 1);
+        delete c1;
+    });
+
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    uint64_t key = 1;
+    c2->enable_recv_ring(4, 64, key);
+
+    for (uint64_t i = 0; i < 16; i++) {
+        auto v = c2->recv_view();
+        ASSERT_EQ(sizeof(uint64_t), v.size);
+        ASSERT_EQ(i, *(const uint64_t *) v.data);
+        c2->release(v);
+    }
+
+    cse498::unique_buf buf;
+    key = 2;
+    c2->register_mr(buf, FI_WRITE | FI_READ, key);
+
+    // A message longer than the space given is truncated and reported
+    ((uint32_t *) buf.get())[1] = ~0u;
+    ASSERT_FALSE(c2->try_recv(buf, sizeof(uint32_t)));
+    ASSERT_EQ(16u, ((uint32_t *) buf.get())[0]);
+    ASSERT_EQ(~0u, ((uint32_t *) buf.get())[1]);
+
+    c2->send(buf, 1);
+
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_stream) {
+    DO_LOG(DEBUG);
+    const size_t size = (3 << 20) + 123;
+
+    auto f = std::async([size]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect()) {
+            delete c1;
+            c1 = new cse498::Connection("127.0.0.1", false);
+        }
+
+        cse498::unique_buf buf(size);
+        uint64_t key = 1;
+        c1->register_mr(buf, FI_WRITE | FI_READ, key);
+        for (size_t i = 0; i < size; i++) {
+            buf[i] = (char) (i % 251);
+        }
+
+        ASSERT_TRUE(c1->send_stream(buf, size));
+        c1->recv(buf, 1);
+        delete c1;
+    });
+
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf(size + 8);
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_WRITE | FI_READ, key);
+
+    ASSERT_EQ((ssize_t) size, c2->recv_stream(buf, size, 8));
+    for (size_t i = 0; i < size; i++) {
+        ASSERT_EQ((char) (i % 251), buf[i + 8]);
+    }
+    c2->send(buf, 1);
+
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_send_auto) {
+    DO_LOG(DEBUG);
+    const size_t large = 1 << 20;
+
+    auto f = std::async([large]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect()) {
+            delete c1;
+            c1 = new cse498::Connection("127.0.0.1", false);
+        }
+
+        cse498::unique_buf buf(large);
+        uint64_t key = 1;
+        c1->register_mr(buf, FI_WRITE | FI_READ | FI_REMOTE_READ, key);
+        for (size_t i = 0; i < large; i++) {
+            buf[i] = (char) (i % 127);
+        }
+
+        // eager
+        ASSERT_TRUE(c1->send_auto(buf, 64));
+        // rendezvous
+        ASSERT_TRUE(c1->send_auto(buf, large));
+        // empty
+        ASSERT_TRUE(c1->send_auto(buf, 0));
+        // too large for the other side; only a rendezvous hears about it
+        ASSERT_TRUE(c1->send_auto(buf, 64));
+        ASSERT_FALSE(c1->send_auto(buf, large));
+        delete c1;
+    });
+
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf(large);
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_WRITE | FI_READ, key);
+
+    ASSERT_LE(64, c2->eager_threshold());
+    ASSERT_EQ(64, c2->recv_auto(buf, large));
+    for (size_t i = 0; i < 64; i++) {
+        ASSERT_EQ((char) (i % 127), buf[i]);
+    }
+    memset(buf.get(), 0, large);
+    ASSERT_EQ((ssize_t) large, c2->recv_auto(buf, large));
+    for (size_t i = 0; i < large; i++) {
+        ASSERT_EQ((char) (i % 127), buf[i]);
+    }
+    ASSERT_EQ(0, c2->recv_auto(buf, large));
+    ASSERT_EQ(-FI_ETOOSMALL, c2->recv_auto(buf, 32));
+    ASSERT_EQ(-FI_ETOOSMALL, c2->recv_auto(buf, large / 2));
+
+    f.get();
+    delete c2;
+}
+
 TEST(connectionTest, connection_send_recv_multiple_connections) {
     DO_LOG(DEBUG);
     std::atomic_bool c1_connected;
@@ -211,6 +500,10 @@ TEST(connectionTest, connection_send_recv_multiple_connections_accept) {
         ASSERT_TRUE(p2.first);
         auto c0_c2 = std::move(p2.second);
 
+        // Accepted connections keep the fabric open once the listener is gone
+        delete server;
+        c0_c1.try_wait();
+
         cse498::unique_buf c0_to_c1_msg_buf, c0_to_c2_msg_buf;
         uint64_t key = 1;
         c0_c1.register_mr(c0_to_c1_msg_buf, FI_WRITE | FI_READ, key);
@@ -224,8 +517,6 @@ TEST(connectionTest, connection_send_recv_multiple_connections_accept) {
         c0_c2.async_send(c0_to_c2_msg_buf, c0_to_c2_msg.length() + 1);
         c0_c1.wait_for_sends();
         c0_c2.wait_for_sends();
-
-        delete server;
     });
 
     auto f2 = std::async([&c0_to_c1_msg, &c1_connected]() {
@@ -266,6 +557,65 @@ TEST(connectionTest, connection_send_recv_multiple_connections_accept) {
     delete c2;
 }
 
+TEST(connectionTest, connection_shared_resources) {
+    DO_LOG(DEBUG);
+    std::atomic_int connected;
+    connected = 0;
+    const std::string msg = "shared potato\0";
+
+    auto f = std::async([&msg]() {
+        // c0 stuff
+        auto *server = new cse498::Connection("127.0.0.1", true);
+        server->share_resources();
+        {
+            auto p = server->accept();
+            ASSERT_TRUE(p.first);
+            auto c0_c1 = std::move(p.second);
+            auto p2 = server->accept();
+            ASSERT_TRUE(p2.first);
+            auto c0_c2 = std::move(p2.second);
+            ASSERT_TRUE(c0_c1.is_shared());
+            ASSERT_TRUE(c0_c2.is_shared());
+
+            // One buffer registered on the listener serves both connections
+            cse498::unique_buf buf;
+            uint64_t key = 1;
+            server->register_mr(buf, FI_SEND, key);
+            buf = msg;
+
+            c0_c1.async_send(buf, msg.length() + 1);
+            c0_c2.async_send(buf, msg.length() + 1);
+            // Each connection only waits for its own send even though the queue is shared
+            ASSERT_TRUE(c0_c2.try_wait_for_sends());
+            ASSERT_TRUE(c0_c1.try_wait_for_sends());
+        }
+        delete server;
+    });
+
+    std::vector<std::future<void>> clients;
+    for (int i = 0; i < 2; i++) {
+        clients.push_back(std::async([&msg, &connected]() {
+            auto *c = new cse498::Connection("127.0.0.1", false);
+            while (!c->connect()) {
+                delete c;
+                c = new cse498::Connection("127.0.0.1", false);
+            }
+            ++connected;
+
+            cse498::unique_buf buf;
+            uint64_t key = 1;
+            c->register_mr(buf, FI_RECV, key);
+            c->recv(buf, 128);
+            ASSERT_STREQ(msg.c_str(), buf.get());
+            delete c;
+        }));
+    }
+    for (auto &c : clients) {
+        c.get();
+    }
+    f.get();
+}
+
 TEST(connectionTest, connection_send_recv_multiple_connections_nonblockingAccept) {
     DO_LOG(DEBUG);
     std::atomic_bool c1_connected;
@@ -344,6 +694,55 @@ TEST(connectionTest, connection_send_recv_multiple_connections_nonblockingAccept
 }
 
 
+TEST(connectionTest, connection_reactor) {
+    DO_LOG(DEBUG);
+    const int clients = 4;
+    std::atomic_int received, disconnected;
+    received = 0;
+    disconnected = 0;
+
+    cse498::Reactor reactor("127.0.0.1");
+    reactor.on_message([&received](cse498::Connection &, const cse498::msg_view &v) {
+        ASSERT_EQ(sizeof(uint64_t), v.size);
+        received += (int) *(const uint64_t *) v.data;
+    });
+    reactor.on_disconnect([&disconnected](cse498::Connection &) {
+        ++disconnected;
+    });
+    auto server = std::async([&reactor]() {
+        reactor.run(2);
+    });
+
+    std::vector<std::future<void>> futures;
+    for (int i = 0; i < clients; i++) {
+        futures.push_back(std::async([i]() {
+            auto *c = new cse498::Connection("127.0.0.1", false);
+            while (!c->connect()) {
+                delete c;
+                c = new cse498::Connection("127.0.0.1", false);
+            }
+            cse498::unique_buf buf;
+            uint64_t key = 1;
+            c->register_mr(buf, FI_SEND, key);
+            *(uint64_t *) buf.get() = i + 1;
+            c->send(buf, sizeof(uint64_t));
+            delete c;
+        }));
+    }
+    for (auto &f : futures) {
+        f.get();
+    }
+
+    // 1 + 2 + ... + clients
+    while (received != clients * (clients + 1) / 2);
+    // Every client has disconnected
+    while (reactor.connections() != 0);
+    ASSERT_EQ(clients, disconnected);
+    reactor.stop();
+    server.get();
+    ASSERT_EQ(clients, reactor.size());
+}
+
 TEST(connectionTest, connection_broadcast) {
     DO_LOG(DEBUG);
     const std::string msg = "wowww (owen wilson voice)\0";
@@ -456,13 +855,14 @@ TEST(connectionTest, connection_rma) {
     delete c2;
 }
 
-TEST(connectionTest, connection_rma_try_read) {
+TEST(connectionTest, connection_async_rma) {
     DO_LOG(DEBUG);
     std::atomic_bool done;
     done = false;
 
     std::atomic_bool latch;
     latch = false;
+
     cse498::unique_buf remoteAccess, buf;
 
     auto f = std::async([&done, &latch, &remoteAccess]() {
@@ -471,7 +871,6 @@ TEST(connectionTest, connection_rma_try_read) {
         auto *c1 = new cse498::Connection(addr, true);
         while(!c1->connect());
 
-        *((uint64_t *) remoteAccess.get()) = ~0;
         uint64_t key = 1;
         c1->register_mr(remoteAccess, FI_WRITE | FI_REMOTE_WRITE | FI_READ | FI_REMOTE_READ,
                         key);
@@ -479,7 +878,9 @@ TEST(connectionTest, connection_rma_try_read) {
         latch = true;
         while (!done);
 
-        ASSERT_TRUE(*((uint64_t *) remoteAccess.get()) == 0);
+        for (uint64_t i = 0; i < 8; i++) {
+            ASSERT_EQ(i, ((uint64_t *) remoteAccess.get())[i]);
+        }
         delete c1;
     });
 
@@ -491,17 +892,923 @@ TEST(connectionTest, connection_rma_try_read) {
     uint64_t key = 1;
     c2->register_mr(buf, FI_WRITE | FI_READ, key);
 
-    *((uint64_t *) buf.get()) = 10;
     while (!latch);
-    while (!c2->try_read(buf, sizeof(uint64_t), 0, 1));
-    //c2->wait_read(buf, sizeof(uint64_t), 0, 1);
-    std::cerr << "Read: " << *(uint64_t *) buf.get() << std::endl;
-    ASSERT_TRUE(*((uint64_t *) buf.get()) == ~0);
 
-    *((uint64_t *) buf.get()) = 0;
-    c2->write(buf, sizeof(uint64_t), 0, 1);
+    std::vector<cse498::completion_t> writes;
+    for (uint64_t i = 0; i < 8; i++) {
+        ((uint64_t *) buf.get())[i] = i;
+        writes.push_back(c2->async_write(buf, sizeof(uint64_t), i * sizeof(uint64_t), 1, i * sizeof(uint64_t)));
+    }
+    for (auto &c : writes) {
+        ASSERT_EQ(0, c2->wait(c));
+        ASSERT_TRUE(c->ok());
+    }
+
+    std::vector<cse498::completion_t> reads;
+    for (uint64_t i = 0; i < 8; i++) {
+        ((uint64_t *) buf.get())[8 + i] = ~0;
+        reads.push_back(c2->async_read(buf, sizeof(uint64_t), i * sizeof(uint64_t), 1, (8 + i) * sizeof(uint64_t)));
+    }
+    // Completions may be matched in any order
+    for (auto it = reads.rbegin(); it != reads.rend(); ++it) {
+        ASSERT_EQ(0, c2->wait(*it));
+    }
+    for (uint64_t i = 0; i < 8; i++) {
+        ASSERT_EQ(i, ((uint64_t *) buf.get())[8 + i]);
+    }
+
+    // Tokens never waited on are finished by the teardown and no longer keep themselves alive
+    std::vector<cse498::completion_t> pending;
+    for (uint64_t i = 0; i < 8; i++) {
+        pending.push_back(c2->async_read(buf, sizeof(uint64_t), i * sizeof(uint64_t), 1, (8 + i) * sizeof(uint64_t)));
+    }
+    delete c2;
+    for (auto &c : pending) {
+        ASSERT_TRUE(c->done());
+        ASSERT_EQ(1, c.use_count());
+    }
+
     done = true;
     f.get();
+}
+
+TEST(connectionTest, connection_scatter_gather) {
+    DO_LOG(DEBUG);
+    std::atomic_bool done;
+    done = false;
+
+    std::atomic_bool latch;
+    latch = false;
+
+    cse498::unique_buf remoteAccess, buf, header;
+
+    auto f = std::async([&done, &latch, &remoteAccess]() {
+        // c1 stuff
+        const char *addr = "127.0.0.1";
+        auto *c1 = new cse498::Connection(addr, true);
+        while(!c1->connect());
+
+        uint64_t key = 1;
+        c1->register_mr(remoteAccess, FI_WRITE | FI_REMOTE_WRITE | FI_READ | FI_REMOTE_READ,
+                        key);
+        cse498::unique_buf msg;
+        key = 2;
+        c1->register_mr(msg, FI_RECV, key);
+
+        latch = true;
+
+        c1->recv(msg, 4096);
+        ASSERT_EQ(0xabcdULL, ((uint64_t *) msg.get())[0]);
+        for (uint64_t i = 0; i < 8; i++) {
+            ASSERT_EQ(i, ((uint64_t *) msg.get())[1 + i]);
+        }
+
+        while (!done);
+
+        for (uint64_t i = 0; i < 8; i++) {
+            ASSERT_EQ(i, ((uint64_t *) remoteAccess.get())[i]);
+        }
+        delete c1;
+    });
+
+    auto *c2 = new cse498::Connection("127.0.0.1", false);
+    while(!c2->connect()){
+        delete c2;
+        c2 = new cse498::Connection("127.0.0.1", false);
+    }
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_WRITE | FI_READ | FI_SEND, key);
+    key = 2;
+    c2->register_mr(header, FI_SEND, key);
+
+    while (!latch);
+
+    ((uint64_t *) header.get())[0] = 0xabcd;
+    for (uint64_t i = 0; i < 8; i++) {
+        ((uint64_t *) buf.get())[i] = i;
+    }
+    c2->sendv({cse498::make_segment(header, sizeof(uint64_t)),
+               cse498::make_segment(buf, 8 * sizeof(uint64_t))});
+
+    // Gather the two halves of buf into one remote region
+    c2->writev({cse498::make_segment(buf, 4 * sizeof(uint64_t)),
+                cse498::make_segment(buf, 4 * sizeof(uint64_t), 4 * sizeof(uint64_t))}, 0, 1);
+
+    // Scatter the remote region back in reverse halves
+    for (uint64_t i = 0; i < 8; i++) {
+        ((uint64_t *) buf.get())[8 + i] = ~0;
+    }
+    auto c = c2->async_readv({cse498::make_segment(buf, 4 * sizeof(uint64_t), 12 * sizeof(uint64_t)),
+                              cse498::make_segment(buf, 4 * sizeof(uint64_t), 8 * sizeof(uint64_t))}, 0, 1);
+    ASSERT_EQ(0, c2->wait(c));
+    ASSERT_EQ(8 * sizeof(uint64_t), c->length());
+    for (uint64_t i = 0; i < 4; i++) {
+        ASSERT_EQ(i, ((uint64_t *) buf.get())[12 + i]);
+        ASSERT_EQ(4 + i, ((uint64_t *) buf.get())[8 + i]);
+    }
+
+    // Too many segments fail instead of overrunning the iovec array
+    std::vector<cse498::segment> tooMany(cse498::MAX_SEGMENTS + 1, cse498::make_segment(buf, sizeof(uint64_t)));
+    ASSERT_FALSE(c2->async_sendv(tooMany));
+    c = c2->async_writev(tooMany, 0, 1);
+    ASSERT_NE(0, c2->wait(c));
+
+    done = true;
+    f.get();
+
+    delete c2;
+}
+
+TEST(connectionTest, connection_mr_cache) {
+    DO_LOG(DEBUG);
+    const std::string msg = "cached potato\0";
+
+    auto f = std::async([&msg]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        cse498::unique_buf buf;
+        uint64_t key = c1->register_mr_cached(buf, FI_SEND);
+        // Registering the same local buffer again reuses the cached region
+        uint64_t key2 = c1->register_mr_cached(buf, FI_SEND);
+        ASSERT_EQ(key, key2);
+        buf = msg;
+        c1->send(buf, msg.length() + 1);
+        ASSERT_TRUE(c1->deregister_mr(buf));
+        ASSERT_TRUE(c1->deregister_mr(buf, true));
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf;
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_RECV, key);
+    c2->recv(buf, 128);
+    ASSERT_STREQ(msg.c_str(), buf.get());
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_buf_pool) {
+    DO_LOG(DEBUG);
+    const std::string msg = "pooled potato\0";
+
+    auto f = std::async([&msg]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        cse498::BufferPool pool({{64, 4}, {1024, 2}});
+        ASSERT_EQ(nullptr, pool.get_unique(64).get());
+        pool.register_on(*c1, FI_SEND);
+        ASSERT_EQ(c1->get_domain(), pool.domain());
+        ASSERT_EQ(6, pool.available());
+        {
+            auto buf = pool.get_unique(msg.length() + 1);
+            ASSERT_TRUE(buf.isRegistered());
+            ASSERT_EQ(64, buf.size());
+            ASSERT_EQ(5, pool.available());
+            buf = msg;
+            c1->send(buf, msg.length() + 1);
+        }
+        ASSERT_EQ(6, pool.available());
+        {
+            // An empty pool hands out nothing rather than unregistered memory
+            std::vector<cse498::unique_buf> taken;
+            for (int i = 0; i < 6; i++) {
+                taken.push_back(pool.get_unique(64));
+                ASSERT_TRUE(taken.back().isRegistered());
+            }
+            ASSERT_EQ(nullptr, pool.get_unique(64).get());
+            ASSERT_EQ(nullptr, pool.get_shared(64).get());
+        }
+        ASSERT_EQ(6, pool.available());
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf;
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_RECV, key);
+    c2->recv(buf, 128);
+    ASSERT_STREQ(msg.c_str(), buf.get());
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_hugepage_buffer) {
+    DO_LOG(DEBUG);
+    const std::string msg = "huge potato\0";
+
+    auto f = std::async([&msg]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        // Falls back to standard pages when no hugepages are reserved
+        auto buf = cse498::allocate(1 << 21, cse498::mem_policy::huge(cse498::HugePages2M, c1->numa_node()));
+        ASSERT_EQ(1 << 21, buf.size());
+        ASSERT_EQ(0, (uintptr_t) buf.get() % 4096);
+        uint64_t key = 1;
+        c1->register_mr(buf, FI_SEND, key);
+        buf = msg;
+        c1->send(buf, msg.length() + 1);
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf;
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_RECV, key);
+    c2->recv(buf, 128);
+    ASSERT_STREQ(msg.c_str(), buf.get());
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_rma_try_read) {
+    DO_LOG(DEBUG);
+    std::atomic_bool done;
+    done = false;
+
+    std::atomic_bool latch;
+    latch = false;
+    cse498::unique_buf remoteAccess, buf;
+
+    auto f = std::async([&done, &latch, &remoteAccess]() {
+        // c1 stuff
+        const char *addr = "127.0.0.1";
+        auto *c1 = new cse498::Connection(addr, true);
+        while(!c1->connect());
+
+        *((uint64_t *) remoteAccess.get()) = ~0;
+        uint64_t key = 1;
+        c1->register_mr(remoteAccess, FI_WRITE | FI_REMOTE_WRITE | FI_READ | FI_REMOTE_READ,
+                        key);
+
+        latch = true;
+        while (!done);
+
+        ASSERT_TRUE(*((uint64_t *) remoteAccess.get()) == 0);
+        delete c1;
+    });
+
+    auto *c2 = new cse498::Connection("127.0.0.1", false);
+    while(!c2->connect()){
+        delete c2;
+        c2 = new cse498::Connection("127.0.0.1", false);
+    }
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_WRITE | FI_READ, key);
+
+    *((uint64_t *) buf.get()) = 10;
+    while (!latch);
+    while (!c2->try_read(buf, sizeof(uint64_t), 0, 1));
+    //c2->wait_read(buf, sizeof(uint64_t), 0, 1);
+    std::cerr << "Read: " << *(uint64_t *) buf.get() << std::endl;
+    ASSERT_TRUE(*((uint64_t *) buf.get()) == ~0);
+
+    *((uint64_t *) buf.get()) = 0;
+    c2->write(buf, sizeof(uint64_t), 0, 1);
+    done = true;
+    f.get();
+
+    delete c2;
+}
+
+TEST(connectionTest, connection_remote_atomics) {
+    DO_LOG(DEBUG);
+    std::atomic_bool done;
+    done = false;
+
+    std::atomic_bool latch;
+    latch = false;
+    std::atomic<uint64_t> remoteAddr, remoteKey;
+    cse498::unique_buf remoteAccess;
+
+    auto f = std::async([&done, &latch, &remoteAddr, &remoteKey, &remoteAccess]() {
+        // c1 stuff
+        const char *addr = "127.0.0.1";
+        auto *c1 = new cse498::Connection(addr, true);
+        while(!c1->connect());
+
+        *((uint64_t *) remoteAccess.get()) = 5;
+        uint64_t key = 1;
+        c1->register_mr(remoteAccess, FI_WRITE | FI_REMOTE_WRITE | FI_READ | FI_REMOTE_READ,
+                        key);
+        remoteAddr = c1->remote_address(remoteAccess);
+        remoteKey = key;
+
+        latch = true;
+        while (!done);
+
+        ASSERT_EQ(42, *((uint64_t *) remoteAccess.get()));
+        delete c1;
+    });
+
+    // c2 stuff
+    const char *addr = "127.0.0.1";
+    auto *c2 = new cse498::Connection(addr, false);
+    while (!c2->connect());
+    while (!latch);
+
+    ASSERT_TRUE(c2->supports_atomics<uint64_t>());
+    cse498::RemoteSharedMemory<uint64_t> mem(*c2, remoteAddr, remoteKey);
+    ASSERT_TRUE(mem.supported());
+    ASSERT_EQ(5, mem.load());
+    ASSERT_EQ(5, mem.fetch_add(3));
+    // Fails, the value is 8
+    ASSERT_EQ(8, mem.compare_and_swap(7, 40));
+    ASSERT_EQ(8, mem.compare_and_swap(8, 40));
+    ASSERT_EQ(40, mem.load());
+    mem.store(42);
+    done = true;
+    f.get();
+
+    delete c2;
+}
+
+TEST(connectionTest, connection_write_notify) {
+    DO_LOG(DEBUG);
+    std::atomic_bool latch;
+    latch = false;
+    std::atomic<uint64_t> remoteAddr, remoteKey;
+    cse498::unique_buf remoteAccess;
+
+    auto f = std::async([&latch, &remoteAddr, &remoteKey, &remoteAccess]() {
+        // c1 stuff
+        const char *addr = "127.0.0.1";
+        auto *c1 = new cse498::Connection(addr, true);
+        while(!c1->connect());
+
+        *((uint64_t *) remoteAccess.get()) = 0;
+        uint64_t key = 1;
+        c1->register_mr(remoteAccess, FI_WRITE | FI_REMOTE_WRITE | FI_READ | FI_REMOTE_READ, key);
+        remoteAddr = c1->remote_address(remoteAccess, sizeof(uint64_t));
+        remoteKey = key;
+
+        cse498::write_notice n{};
+        ASSERT_FALSE(c1->try_recv_notice(n));
+        latch = true;
+        n = c1->recv_notice();
+        ASSERT_EQ(7, n.data);
+        // The data is visible as soon as the notice arrives
+        ASSERT_EQ(~0ULL, *((uint64_t *) (remoteAccess.get() + sizeof(uint64_t))));
+        ASSERT_EQ(0, *((uint64_t *) remoteAccess.get()));
+        delete c1;
+    });
+
+    // c2 stuff
+    const char *addr = "127.0.0.1";
+    auto *c2 = new cse498::Connection(addr, false);
+    while (!c2->connect());
+
+    cse498::unique_buf buf;
+    uint64_t key = 1;
+    c2->register_mr(buf, FI_WRITE | FI_READ, key);
+    *((uint64_t *) buf.get()) = ~0ULL;
+    while (!latch);
+
+    ASSERT_GE(c2->notice_data_size(), 4);
+    c2->write_notify(buf, sizeof(uint64_t), remoteAddr, remoteKey, 7);
+    f.get();
+
+    delete c2;
+}
+
+TEST(connectionTest, connection_ring_channel) {
+    DO_LOG(DEBUG);
+    const int records = 1000;
+
+    auto f = std::async([records]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        uint64_t key = 1;
+        {
+            cse498::RingSender sender(*c1, key);
+            char data[256];
+            for (int i = 0; i < records; i++) {
+                // Varying sizes so records wrap around the ring at different offsets
+                size_t len = sizeof(int) + 1 + i % 200;
+                memset(data, (char) i, len);
+                memcpy(data, &i, sizeof(int));
+                sender.send(data, len);
+            }
+        }
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    uint64_t key = 1;
+    {
+        // Small ring so the sender has to wait for credits
+        cse498::RingReceiver receiver(*c2, 4096, key);
+        for (int i = 0; i < records; i++) {
+            auto v = receiver.recv();
+            ASSERT_EQ(sizeof(int) + 1 + i % 200, v.size);
+            int seen;
+            memcpy(&seen, v.data, sizeof(int));
+            ASSERT_EQ(i, seen);
+            ASSERT_EQ((char) i, v.data[v.size - 1]);
+            receiver.release(v);
+        }
+    }
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_flow_control) {
+    DO_LOG(DEBUG);
+    const size_t messages = 100;
+    const size_t msgSize = 64;
+
+    auto f = std::async([messages, msgSize]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        uint64_t key = 1;
+        ASSERT_TRUE(c1->enable_flow_control(4, msgSize, key));
+        ASSERT_LE(c1->credits(), 4);
+
+        cse498::unique_buf buf(messages * msgSize);
+        uint64_t bufKey = 2;
+        c1->register_mr(buf, FI_SEND, bufKey);
+        for (size_t i = 0; i < messages; i++) {
+            *(size_t *) (buf.get() + i * msgSize) = i;
+            // Never fails even though the receiver only has 4 slots
+            ASSERT_TRUE(c1->async_send(buf, msgSize, i * msgSize));
+        }
+        ASSERT_GT(c1->backlog_size(), 0);
+        c1->wait_for_sends();
+        ASSERT_EQ(0, c1->backlog_size());
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    uint64_t key = 1;
+    ASSERT_TRUE(c2->enable_flow_control(4, msgSize, key));
+    for (size_t i = 0; i < messages; i++) {
+        auto v = c2->recv_view();
+        ASSERT_EQ(msgSize, v.size);
+        ASSERT_EQ(i, *(const size_t *) v.data);
+        c2->release(v);
+    }
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_multi_rail) {
+    DO_LOG(DEBUG);
+    // Uneven so the last stripe is shorter than the others
+    const size_t size = 4 * cse498::MIN_STRIPE_SIZE + 13;
+
+    auto f = std::async([size]() {
+        // c1 stuff
+        cse498::MultiRail c1("127.0.0.1", 2, false, 8090);
+        while (!c1.connect());
+
+        cse498::unique_buf region(sizeof(cse498::rail_region));
+        uint64_t key = 0;
+        c1.rail(0).register_mr(region, FI_RECV, key);
+        c1.rail(0).recv(region, sizeof(cse498::rail_region));
+        cse498::rail_region remote = {};
+        memcpy(&remote, region.get(), sizeof(remote));
+        ASSERT_EQ(2, remote.rails);
+
+        cse498::unique_buf buf(size);
+        for (size_t i = 0; i < size; i++) {
+            buf[i] = (char) (i % 251);
+        }
+        c1.register_mr(buf, FI_WRITE | FI_READ | FI_SEND, 1);
+        c1.write(buf, size, remote);
+
+        // Tells the other side the write is done, and sends the data again as a message
+        ASSERT_TRUE(c1.send(buf, size));
+
+        memset(buf.get(), 0, size);
+        c1.read(buf, size, remote);
+        for (size_t i = 0; i < size; i++) {
+            ASSERT_EQ((char) (i % 251), buf[i]);
+        }
+        // Too large for the other side, which drops it
+        ASSERT_TRUE(c1.send(buf, size));
+        ASSERT_TRUE(c1.send(buf, 1));
+        c1.rail(0).deregister_mr(region);
+    });
+
+    // c2 stuff
+    cse498::MultiRail c2("127.0.0.1", 2, true, 8090);
+    while (!c2.connect());
+
+    cse498::unique_buf target(size);
+    memset(target.get(), 0, size);
+    auto local = c2.register_mr(target, FI_REMOTE_WRITE | FI_REMOTE_READ, 1);
+    ASSERT_EQ(2, local.rails);
+
+    cse498::unique_buf region(sizeof(cse498::rail_region));
+    uint64_t key = 0;
+    c2.rail(0).register_mr(region, FI_SEND, key);
+    region.cpyTo((const char *) &local, sizeof(local));
+    c2.rail(0).send(region, sizeof(local));
+
+    cse498::unique_buf msg(size);
+    c2.register_mr(msg, FI_RECV, 2);
+    ASSERT_EQ((ssize_t) size, c2.recv(msg, size));
+    for (size_t i = 0; i < size; i++) {
+        ASSERT_EQ((char) (i % 251), target[i]);
+        ASSERT_EQ((char) (i % 251), msg[i]);
+    }
+
+    ASSERT_EQ(-FI_ETOOSMALL, c2.recv(msg, size / 2));
+    // Wait for the read before the target goes away; the dropped message left nothing behind
+    ASSERT_EQ(1, c2.recv(msg, size));
+    f.get();
+    c2.rail(0).deregister_mr(region);
+}
+
+TEST(connectionTest, connection_thread_context) {
+    DO_LOG(DEBUG);
+    const int threads = 4;
+    const int messages = 100;
+
+    auto f = std::async([threads, messages]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false, 8080, cse498::Sockets, true);
+        ASSERT_TRUE(c1->is_thread_safe());
+        while (!c1->connect());
+
+        // Registration is not thread-safe, so every thread's buffer is registered up front
+        cse498::unique_buf bufs(threads * 2 * sizeof(int));
+        uint64_t key = 0;
+        c1->register_mr(bufs, FI_SEND, key);
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([c1, &bufs, t, messages]() {
+                cse498::ThreadContext ctx(*c1);
+                const size_t offset = t * 2 * sizeof(int);
+                for (int i = 0; i < messages; i++) {
+                    ((int *) (bufs.get() + offset))[0] = t;
+                    ((int *) (bufs.get() + offset))[1] = i;
+                    ctx.async_send(bufs, 2 * sizeof(int), offset);
+                    ctx.wait_for_sends();
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf(2 * sizeof(int));
+    uint64_t key = 0;
+    c2->register_mr(buf, FI_RECV, key);
+    std::vector<int> next(threads, 0);
+    for (int i = 0; i < threads * messages; i++) {
+        c2->recv(buf, 2 * sizeof(int));
+        int t = ((int *) buf.get())[0];
+        ASSERT_LT(t, threads);
+        // Each thread's messages arrive in the order it sent them
+        ASSERT_EQ(next[t]++, ((int *) buf.get())[1]);
+    }
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_submit_queue) {
+    DO_LOG(DEBUG);
+    const int threads = 4;
+    const int messages = 100;
+
+    auto f = std::async([threads, messages]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", false);
+        while (!c1->connect());
+
+        cse498::unique_buf bufs(threads * messages * 2 * sizeof(int));
+        uint64_t key = 0;
+        c1->register_mr(bufs, FI_SEND, key);
+
+        std::atomic<int> completed(0);
+        std::atomic<int> failed(0);
+        {
+            cse498::SubmitQueue q(*c1, 64);
+            std::vector<std::thread> producers;
+            for (int t = 0; t < threads; t++) {
+                producers.emplace_back([&, t]() {
+                    for (int i = 0; i < messages; i++) {
+                        size_t offset = (t * messages + i) * 2 * sizeof(int);
+                        ((int *) (bufs.get() + offset))[0] = t;
+                        ((int *) (bufs.get() + offset))[1] = i;
+                        q.send(bufs, 2 * sizeof(int), offset, [&](int err, size_t) {
+                            if (err) {
+                                ++failed;
+                            }
+                            ++completed;
+                        });
+                    }
+                });
+            }
+            // This thread is the progress thread
+            while (completed < threads * messages) {
+                q.progress();
+            }
+            for (auto &p : producers) {
+                p.join();
+            }
+            ASSERT_TRUE(q.idle());
+        }
+        ASSERT_EQ(0, failed.load());
+        delete c1;
+    });
+
+    // c2 stuff
+    auto *c2 = new cse498::Connection("127.0.0.1", true);
+    while (!c2->connect());
+
+    cse498::unique_buf buf(2 * sizeof(int));
+    uint64_t key = 0;
+    c2->register_mr(buf, FI_RECV, key);
+    std::vector<int> next(threads, 0);
+    for (int i = 0; i < threads * messages; i++) {
+        c2->recv(buf, 2 * sizeof(int));
+        int t = ((int *) buf.get())[0];
+        ASSERT_LT(t, threads);
+        // The queue keeps each producer's order
+        ASSERT_EQ(next[t]++, ((int *) buf.get())[1]);
+    }
+    f.get();
+    delete c2;
+}
+
+TEST(connectionTest, connection_connect_all) {
+    DO_LOG(DEBUG);
+    const int servers = 3;
+
+    std::vector<std::future<void>> fs;
+    for (int s = 0; s < servers; s++) {
+        fs.push_back(std::async(std::launch::async, [s]() {
+            // server stuff
+            cse498::Connection server("127.0.0.1", true, 8100 + s);
+            while (!server.connect());
+            cse498::unique_buf buf(sizeof(int));
+            uint64_t key = 0;
+            server.register_mr(buf, FI_RECV, key);
+            server.recv(buf, sizeof(int));
+            ASSERT_EQ(s, *(int *) buf.get());
+        }));
+    }
+
+    std::vector<cse498::peer_addr> peers;
+    for (int s = 0; s < servers; s++) {
+        peers.push_back({"127.0.0.1", 8100 + s});
+    }
+    // Nobody listens here
+    peers.push_back({"127.0.0.1", 8100 + servers});
+
+    std::vector<cse498::Connection *> conns(servers, nullptr);
+    // The servers may not be listening yet, so retry the peers that refused
+    for (int attempt = 0; attempt < 100; attempt++) {
+        std::vector<cse498::peer_addr> retry;
+        std::vector<size_t> index;
+        for (size_t i = 0; i < servers; i++) {
+            if (!conns[i]) {
+                retry.push_back(peers[i]);
+                index.push_back(i);
+            }
+        }
+        if (retry.empty()) {
+            break;
+        }
+        auto r = cse498::connect_all(retry);
+        for (auto &c : r.connected) {
+            conns[index[c.first]] = new cse498::Connection(std::move(c.second));
+        }
+    }
+
+    auto r = cse498::connect_all({peers[servers]}, cse498::Sockets, 1000);
+    ASSERT_EQ(0, r.connected.size());
+    ASSERT_EQ(1, r.failed.size());
+
+    cse498::unique_buf buf(sizeof(int));
+    uint64_t key = 0;
+    for (int s = 0; s < servers; s++) {
+        ASSERT_NE(nullptr, conns[s]);
+        conns[s]->register_mr(buf, FI_SEND, key);
+        *(int *) buf.get() = s;
+        conns[s]->send(buf, sizeof(int));
+        conns[s]->deregister_mr(buf);
+    }
+    for (auto &f : fs) {
+        f.get();
+    }
+    for (auto *c : conns) {
+        delete c;
+    }
+}
+
+TEST(connectionTest, connection_fabric_context) {
+    DO_LOG(DEBUG);
+    const int clients = 5;
+
+    auto f = std::async([clients]() {
+        // server stuff
+        auto *server = new cse498::Connection("127.0.0.1", true, 8120);
+        cse498::unique_buf buf(sizeof(int));
+        for (int i = 0; i < clients; i++) {
+            auto p = server->accept();
+            ASSERT_TRUE(p.first);
+            uint64_t key = 0;
+            p.second.register_mr(buf, FI_RECV, key);
+            p.second.recv(buf, sizeof(int));
+            ASSERT_EQ(i, *(int *) buf.get());
+            p.second.deregister_mr(buf);
+        }
+        delete server;
+    });
+
+    cse498::FabricContext ctx;
+    std::vector<cse498::Connection *> conns;
+    std::vector<cse498::unique_buf> bufs;
+    std::set<uint64_t> keys;
+    for (int i = 0; i < clients; i++) {
+        // Large enough not to share pages, so every buffer gets a region of its own
+        bufs.emplace_back(1 << 20);
+        // Clients only pay for fi_getinfo, the fabric and the domain once
+        auto *c = new cse498::Connection(ctx, "127.0.0.1", false, 8120);
+        while (!c->connect()) {
+            delete c;
+            c = new cse498::Connection(ctx, "127.0.0.1", false, 8120);
+        }
+        ASSERT_EQ(1, ctx.size());
+        // Live connections on the shared domain never ask for the same key
+        keys.insert(c->register_mr_cached(bufs[i], FI_SEND));
+        *(int *) bufs[i].get() = i;
+        c->send(bufs[i], sizeof(int));
+        conns.push_back(c);
+    }
+    ASSERT_EQ(clients, keys.size());
+    for (int i = 0; i < clients; i++) {
+        conns[i]->deregister_mr(bufs[i], true);
+        delete conns[i];
+    }
+    f.get();
+}
+
+TEST(connectionTest, connection_pool) {
+    DO_LOG(DEBUG);
+    std::atomic<int> sum(0);
+
+    auto f = std::async([&sum]() {
+        // server stuff
+        auto *server = new cse498::Connection("127.0.0.1", true, 8130);
+        std::vector<std::future<void>> handlers;
+        // The pool never opens more than max connections
+        for (int i = 0; i < 2; i++) {
+            auto p = server->accept();
+            ASSERT_TRUE(p.first);
+            auto *conn = new cse498::Connection(std::move(p.second));
+            handlers.push_back(std::async(std::launch::async, [conn, &sum]() {
+                cse498::unique_buf buf(sizeof(int));
+                uint64_t key = 0;
+                conn->register_mr(buf, FI_RECV, key);
+                while (true) {
+                    conn->recv(buf, sizeof(int));
+                    int v = *(int *) buf.get();
+                    if (v < 0) {
+                        break;
+                    }
+                    sum += v;
+                }
+                conn->deregister_mr(buf);
+                delete conn;
+            }));
+        }
+        for (auto &h : handlers) {
+            h.get();
+        }
+        delete server;
+    });
+
+    cse498::pool_options opts;
+    opts.min = 2;
+    opts.max = 2;
+    opts.bufSize = sizeof(int);
+    opts.bufAccess = FI_SEND;
+    cse498::FabricContext ctx;
+    {
+        cse498::ConnectionPool pool(opts, ctx);
+        while (!pool.warm("127.0.0.1", 8130));
+        ASSERT_EQ(2, pool.idle("127.0.0.1", 8130));
+
+        for (int i = 1; i <= 2; i++) {
+            auto l = pool.lease("127.0.0.1", 8130);
+            ASSERT_TRUE((bool) l);
+            *(int *) l.buf().get() = i;
+            l->send(l.buf(), sizeof(int));
+        }
+        {
+            // Both connections at once
+            auto a = pool.lease("127.0.0.1", 8130);
+            auto b = pool.lease("127.0.0.1", 8130);
+            ASSERT_EQ(0, pool.idle("127.0.0.1", 8130));
+            *(int *) a.buf().get() = 3;
+            a->send(a.buf(), sizeof(int));
+            *(int *) b.buf().get() = 4;
+            b->send(b.buf(), sizeof(int));
+            ASSERT_EQ(2, pool.size("127.0.0.1", 8130));
+
+            *(int *) a.buf().get() = -1;
+            a->send(a.buf(), sizeof(int));
+            *(int *) b.buf().get() = -1;
+            b->send(b.buf(), sizeof(int));
+        }
+        f.get();
+    }
+    ASSERT_EQ(10, sum.load());
+}
+
+TEST(connectionTest, connection_handshake_regions) {
+    DO_LOG(DEBUG);
+    std::atomic_bool done;
+    done = false;
+
+    cse498::unique_buf remoteAccess, buf;
+
+    auto f = std::async([&done, &remoteAccess]() {
+        // c1 stuff
+        auto *c1 = new cse498::Connection("127.0.0.1", true, 8140);
+        c1->share_resources();
+
+        *((uint64_t *) remoteAccess.get()) = ~0;
+        uint64_t key = 1;
+        c1->register_mr(remoteAccess, FI_WRITE | FI_REMOTE_WRITE | FI_READ | FI_REMOTE_READ, key);
+
+        std::vector<cse498::mr_desc> remote;
+        while (!c1->connect({c1->describe(remoteAccess)}, remote));
+        ASSERT_EQ(1, remote.size());
+        ASSERT_EQ(2, remote[0].key);
+
+        while (!done);
+
+        ASSERT_TRUE(*((uint64_t *) remoteAccess.get()) == 0);
+        delete c1;
+    });
+
+    // c2 stuff
+
+    uint64_t key = 2;
+    std::vector<cse498::mr_desc> remote;
+    auto *c2 = new cse498::Connection("127.0.0.1", false, 8140);
+    c2->register_mr(buf, FI_WRITE | FI_READ | FI_REMOTE_READ, key);
+
+    // A table larger than the provider's private data is refused before anything is sent
+    std::vector<cse498::mr_desc> tooMany(c2->cm_data_size() / sizeof(cse498::mr_desc) + 1, c2->describe(buf));
+    ASSERT_FALSE(c2->connect(tooMany, remote));
+
+    while (!c2->connect({c2->describe(buf)}, remote)) {
+        delete c2;
+        c2 = new cse498::Connection("127.0.0.1", false, 8140);
+        c2->register_mr(buf, FI_WRITE | FI_READ | FI_REMOTE_READ, key);
+    }
+
+    // No messages were needed to learn where the server's region is
+    ASSERT_EQ(1, remote.size());
+    ASSERT_EQ(1, remote[0].key);
+
+    *((uint64_t *) buf.get()) = 10;
+    c2->read(buf, sizeof(uint64_t), remote[0].addr, remote[0].key);
+    ASSERT_TRUE(*((uint64_t *) buf.get()) == ~0);
+
+    *((uint64_t *) buf.get()) = 0;
+    c2->write(buf, sizeof(uint64_t), remote[0].addr, remote[0].key);
+    done = true;
+
+    f.get();
 
     delete c2;
 }
@@ -192,3 +192,59 @@ TEST(connectionlessTest, connectionlessTest_broadcast) {
     ERRCHK(fi_close(&(mr->fid)));
 
 }
+
+TEST(connectionlessTest, connectionlessTest_multi_recv) {
+    std::atomic_bool done;
+
+    done = false;
+
+    const int messages = 500;
+    const size_t msgSize = 64;
+
+    auto f = std::async([&done, messages, msgSize]() {
+        const char *address = "127.0.0.1";
+        cse498::ConnectionlessServer f(address, 8080, FI_PROTO_SOCK_TCP, true);
+        // Small buffers, so the area is recycled several times over the burst
+        f.enable_multi_recv(8192);
+        char *buf = new char[4096];
+        fid_mr *mr;
+        f.registerMR(buf, 4096, mr);
+        done = true;
+        cse498::addr_t addr = f.accept(buf, 4096);
+        f.send(addr, buf, 1);
+
+        std::vector<bool> seen(messages, false);
+        for (int i = 0; i < messages; i++) {
+            cse498::multi_recv_msg msg = f.recv_multi();
+            ASSERT_EQ(addr, msg.src);
+            ASSERT_EQ(msgSize, msg.len);
+            ASSERT_LT(msg.tag, messages);
+            ASSERT_EQ(msg.tag, *(uint64_t *) msg.data);
+            ASSERT_FALSE(seen[msg.tag]);
+            seen[msg.tag] = true;
+        }
+        f.send(addr, buf, 1);
+        ERRCHK(fi_close(&(mr->fid)));
+    });
+
+    while (!done);
+
+    std::string addr = "127.0.0.1";
+    cse498::ConnectionlessClient c(addr.c_str(), 8080);
+    char *buf = new char[4096];
+    fid_mr *mr;
+
+    c.registerMR(buf, 4096, mr);
+    c.connect(buf, 4096);
+    // Wait until the server knows our address
+    c.recv(buf, 4096);
+    for (uint64_t i = 0; i < messages; i++) {
+        *(uint64_t *) buf = i;
+        c.send_multi(buf, msgSize, i);
+    }
+    c.recv(buf, 4096);
+
+    f.get();
+    ERRCHK(fi_close(&(mr->fid)));
+
+}
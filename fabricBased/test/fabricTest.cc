@@ -33,6 +33,15 @@ TEST(fabricTest, fabricTest_echo) {
 
     ASSERT_TRUE(addr == s);
 
+    // Larger than one message both ways
+    cse498::pack_t large(2 * cse498::MAX_RPC_MSG_SIZE + 123);
+    for (size_t i = 0; i < large.size(); i++) {
+        large[i] = (char) (i % 251);
+    }
+    cse498::pack_t largeRes;
+    ASSERT_TRUE(c.tryCallRemote(1, large, largeRes));
+    ASSERT_TRUE(large == largeRes);
+
     c.callRemote(0, cse498::pack_t(addr.begin(), addr.end()));
 
     f.get();